@@ -0,0 +1,560 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * bench.c
+ * Offline pipeline benchmark. Synthetic devices ("synth:N") feed audio chunks
+ * to the real disk worker, as fast as it can take them: drift correction,
+ * dual mono split, take writing through the volume writers, all run as in a
+ * real recording. Slave N runs N*ppm parts per million faster than the
+ * master, so the drift correction has some real work to do.
+ *
+ * Usage: mrbench [-d devices] [-s seconds] [-r rate] [-R out rate]
+ *                [-c chunk frames] [-p ppm] [-o output root]...
+ *                [-j results.json] [-k] [-t]
+ *   -k : keep the recorded files (they are removed by default).
+ *   -t : record the same click track on all devices, each on its own clock,
+ *        instead of a sine per device. mrsync can then measure how well the
+ *        drift correction lined them up.
+ *   -T s : trace the threads (see trace.h), and dump the last s seconds at
+ *        the end of the run.
+ *   -L n : with -t, device N hears the clicks N*n frames late, as a card with
+ *        a slower converter would.
+ *   -F stages : run every channel through this chain (see dsp.h), e.g.
+ *        -F "dc hpf 80 gain -3".
+ *   -D channels : don't record these channels, e.g. -D bdf (see the disarm
+ *        stage of dsp.h).
+ *   -P channels : also encode a proxy of each take, in 1 or 2 channels (see
+ *        proxy.h), to measure what it costs the worker.
+ *   -Z ms : sparse storage, leaving out the silence after the first ms
+ *        milliseconds (see silenceMillis). With -t, mrexpand then gives
+ *        back the full click track.
+ *   -C file : calibration file (see calibration.h), e.g. written by mrsync
+ *        -c from a run with -L: the takes are then lined up again.
+ *   -R rate : record the takes at this rate (see outRate), e.g. 44100: the
+ *        master is then converted too, and every card through a sinc
+ *        converter (see MR_SRC_TYPE).
+ *   -a name : publish the stream to a shared memory tap (see tap.h), e.g.
+ *        /mrbench, for mrtap to read.
+ *
+ * A summary goes to stdout, and the results are written as JSON (bench.json
+ * by default), to track regressions between versions.
+ *
+ * Soak test: mrbench -f scenario -x speed [-m queue MB] [-S skew frames]
+ *   Runs the fault scenario (see fault.h) while feeding the audio at speed
+ *   times real time, as real cards would: the queues then grow whenever the
+ *   disks can't keep up. Scenario times are wall clock seconds, so with
+ *   -x 10 a fault at 60 s hits 10 minutes into the audio. At the end, the
+ *   sync between devices must be within -S frames (plus the frames lost to
+ *   injected xruns), and the queues must fit in -m MB. The exit status is
+ *   1 if not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "multirec.h"
+#include "worker.h"
+#include "volume.h"
+#include "calibration.h"
+#include "dsp.h"
+#include "proxy.h"
+#include "tap.h"
+#include "fault.h"
+#include "trace.h"
+#include "log.h"
+#include "main.h"
+
+
+// *** Globals normally defined in multirec.c ***
+
+unsigned long long CPS = 0;
+unsigned int CPMillis = 0;
+const char *trackName = "bench";
+States volatile state;
+MRDevice **devices;
+size_t devCount = 4;
+unsigned int rate = 48000;
+unsigned int outRate = 0;
+unsigned int syncMillis = 2000;
+unsigned int syncKBytes = 0;
+unsigned int prerollMillis = 0;
+unsigned int segmentSecs = 0;
+unsigned int segmentMBytes = 0;
+unsigned int writePeaks = 0;
+unsigned int silenceMillis = 0;
+unsigned int silenceDb = 60;
+
+/** Worker thread (see worker.c), to read its CPU time */
+extern pthread_t wrk;
+
+
+// *** Benchmark parameters ***
+
+static unsigned int seconds = 600;
+static unsigned long chunkFrames = 51200;
+static double ppm = 50;
+static const char *jsonFile = "bench.json";
+static int keepFiles = 0;
+static double speed = 0;
+static double queueLimitMB = 0;
+static long long skewTolerance = 16;
+static int clicks = 0;
+static long latencyStep = 0;
+static const char *chain = NULL;
+static const char *disarm = "";
+
+
+/** Click track of the -t option: a 20 ms chirp every half second */
+#define CLICK_PERIOD 0.5
+#define CLICK_LEN 0.02
+
+
+unsigned long long int rdtsc()
+{
+	unsigned int lo, hi;
+	__asm__ volatile (".byte 0x0f, 0x31" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long int)hi << 32) | lo;
+}
+
+
+void finish(int sig) {
+	flushLogging();
+	exit(sig);
+}
+
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+static double threadCpu(pthread_t thread) {
+	clockid_t cid;
+	struct timespec t;
+	if (pthread_getcpuclockid(thread, &cid) || clock_gettime(cid, &t))
+		return 0;
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/**
+ * Measure the rdtsc() rate against the system clock.
+ */
+static void calibrate() {
+	double t0 = now();
+	unsigned long long c0 = rdtsc();
+	usleep(200000);
+	unsigned long long c1 = rdtsc();
+	double t1 = now();
+
+	double cps = (c1 - c0) / (t1 - t0);
+	CPMillis = cps / 1000;
+	CPS = cps / rate;
+}
+
+
+/**
+ * Create the synthetic devices, each with a sine of its own frequency.
+ */
+static MRFrame **initDevices() {
+	MRFrame **signal = calloc(devCount, sizeof(MRFrame*));
+	unsigned long len = chunkFrames * 2;
+	int i;
+	unsigned long n;
+
+	devices = calloc(devCount, sizeof(MRDevice*));
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = calloc(1, sizeof(MRDevice));
+		char name[32];
+		sprintf(name, "synth:%d", i);
+		c->name = strdup(name);
+		c->idx = i;
+		c->idxBit = 1 << i;
+		c->dualQueue = create(6, sizeof(MRAlsaChunk));
+
+		int err;
+		c->srcState = src_new(MR_SRC_TYPE, MR_CHANNELS, &err);
+		if (c->srcState)
+			c->srcMono = src_new(MR_SRC_TYPE, 1, &err);
+		if (!c->srcState || !c->srcMono) {
+			printf("src_new error: %s\n", src_strerror(err));
+			exit(-1);
+		}
+		devices[i] = c;
+
+		signal[i] = malloc(len * sizeof(MRFrame));
+		for (n = 0; n < len; n++) {
+			double v = sin(2 * M_PI * (220.0 * (i + 1)) * n / rate);
+			signal[i][n].v[0] = v * 16000;
+			signal[i][n].v[1] = -v * 16000;
+		}
+	}
+	return signal;
+}
+
+
+/**
+ * Value of the click track at t seconds: a Hann windowed chirp from 500 Hz to
+ * 5 kHz, which has a sharp autocorrelation peak.
+ */
+static double clickAt(double t) {
+	double q = fmod(t, CLICK_PERIOD);
+	if (q >= CLICK_LEN)
+		return 0;
+	double env = 0.5 - 0.5 * cos(2 * M_PI * q / CLICK_LEN);
+	return env * sin(2 * M_PI * (500 * q + 4500 * q * q / (2 * CLICK_LEN)));
+}
+
+
+/**
+ * Fill a chunk with the click track, as sampled by a device whose clock runs
+ * drift times the master one, from its frame pos on, latency frames late.
+ */
+static void fillClicks(MRFrame *buf, unsigned long len,
+		unsigned long long pos, double drift, long latency) {
+	unsigned long n;
+	for (n = 0; n < len; n++) {
+		double t = ((double) pos + n - latency) / drift / rate;
+		short v = t < 0 ? 0 : clickAt(t) * 16000;
+		buf[n].v[0] = v;
+		buf[n].v[1] = v;
+	}
+}
+
+
+/**
+ * Remove the files of the benchmark take, on every volume.
+ */
+static void removeTake(const char *dir) {
+	char path[600];
+	int v;
+	for (v = 0; v < volCount; v++) {
+		sprintf(path, "%s/%s", volumes[v]->root, dir);
+		struct dirent **namelist;
+		int n = scandir(path, &namelist, NULL, alphasort);
+		if (n < 0)
+			continue;
+		while (n--) {
+			if (namelist[n]->d_name[0] != '.') {
+				sprintf(path, "%s/%s/%s", volumes[v]->root, dir,
+						namelist[n]->d_name);
+				unlink(path);
+			}
+			free(namelist[n]);
+		}
+		free(namelist);
+		sprintf(path, "%s/%s", volumes[v]->root, dir);
+		rmdir(path);
+	}
+}
+
+
+static double histMs(const MRHist *h) {
+	return h->sum / 1000.0;
+}
+
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "d:s:r:R:c:p:o:j:ktT:L:C:F:D:P:Z:a:f:x:m:S:")) != -1) {
+		switch (opt) {
+		case 'd': devCount = atoi(optarg); break;
+		case 's': seconds = atoi(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 'R': outRate = atoi(optarg); break;
+		case 'c': chunkFrames = atol(optarg); break;
+		case 'p': ppm = atof(optarg); break;
+		case 'o': addVolume(optarg); break;
+		case 'j': jsonFile = optarg; break;
+		case 'k': keepFiles = 1; break;
+		case 't': clicks = 1; break;
+		case 'T': traceSecs = atoi(optarg); break;
+		case 'L': latencyStep = atol(optarg); break;
+		case 'C': calibrationFile = optarg; break;
+		case 'F': chain = optarg; break;
+		case 'D': disarm = optarg; break;
+		case 'P': proxyChannels = atoi(optarg); break;
+		case 'Z': silenceMillis = atoi(optarg); break;
+		case 'a': tapName = optarg; break;
+		case 'f': faultFile = optarg; break;
+		case 'x': speed = atof(optarg); break;
+		case 'm': queueLimitMB = atof(optarg); break;
+		case 'S': skewTolerance = atoll(optarg); break;
+		default:
+			printf("Usage: mrbench [-d devices] [-s seconds] [-r rate] "
+					"[-R out rate] [-c chunk frames] [-p ppm] [-o output root]... "
+					"[-j results.json] [-k] [-t] [-T trace s] [-L latency frames] "
+					"[-C calibration] [-F chain] [-D channels] [-P proxy channels] "
+					"[-Z silence ms] [-a tap] "
+					"[-f fault scenario] [-x speed] "
+					"[-m queue MB] [-S skew frames]\n");
+			return -1;
+		}
+	}
+	if (!outRate)
+		outRate = rate;
+	if (devCount < 1 || devCount > 16 || seconds < 1 || chunkFrames < 1
+			|| chunkFrames * (1 + devCount * ppm * 1e-6) + 1 > BSIZ
+			|| !src_is_valid_ratio((double) outRate / rate)) {
+		printf("Bad parameters.\n");
+		return -1;
+	}
+
+	initLogging("bench.log");
+	calibrate();
+	MRFrame **signal = initDevices();
+	if (initCalibration() < 0)
+		return -1;
+	int i;
+	for (i = 0; chain && i < devCount * MR_CHANNELS; i++) {
+		char line[256];
+		snprintf(line, sizeof(line), "%c %s", 'a' + i, chain);
+		if (dspParse(line) < 0)
+			return -1;
+	}
+	for (i = 0; disarm[i]; i++) {
+		char line[16];
+		snprintf(line, sizeof(line), "%c disarm", disarm[i]);
+		if (dspParse(line) < 0)
+			return -1;
+	}
+
+	state = RECORDING;
+	initWorker();
+
+	MRTake *t = openTake();
+	if (!t) {
+		printf("Can't create the output files.\n");
+		return -1;
+	}
+	char dir[256];
+	strcpy(dir, t->dir);
+	beginTake(t, 0);
+
+	printf("%zu devices, %u Hz to %u Hz, %lu frame chunks, %.0f ppm drift "
+			"steps, %u s of audio\n", devCount, rate, outRate, chunkFrames, ppm,
+			seconds);
+
+	// *** Feed the worker as fast as it takes the chunks, or at the set speed ***
+	// masterClock counts the master frames due so far, masterFrames the ones
+	// actually captured: they differ by the xruns.
+	unsigned long long totalFrames = (unsigned long long) seconds * rate;
+	unsigned long long masterClock = 0, masterFrames = 0;
+	unsigned long long *devFrames = calloc(devCount, sizeof(unsigned long long));
+	unsigned long long *lostFrames = calloc(devCount, sizeof(unsigned long long));
+	double *frac = calloc(devCount, sizeof(double));
+
+	if (initFaults() < 0)
+		return -1;
+	traceThread("producer");
+
+	double wall0 = now();
+	double mainCpu0 = threadCpu(pthread_self());
+	struct rusage ru0;
+	getrusage(RUSAGE_SELF, &ru0);
+
+	while (masterClock < totalFrames) {
+		masterClock += chunkFrames;
+		traceCheck();
+		if (speed) {
+			double wait = wall0 + masterClock / (rate * speed) - now();
+			if (wait > 0)
+				usleep(wait * 1e6);
+		}
+
+		for (i = 0; i < devCount; i++) {
+			MRDevice *c = devices[i];
+
+			// A real card would overrun here: just wait for the worker.
+			while (!speed && prod_len(c->dualQueue) >= 4)
+				usleep(100);
+
+			// Slave i runs i*ppm parts per million fast.
+			double drift = 1 + i * ppm * 1e-6;
+			double exact = chunkFrames * drift + frac[i];
+			unsigned long len = (unsigned long) exact;
+			frac[i] = exact - len;
+			devFrames[i] += len;
+
+			if (faultRead(i)) {
+				traceTrigger("xrun (injected)");
+				lostFrames[i] += len;
+				continue;
+			}
+			if (i == 0)
+				masterFrames += len;
+
+			MRAlsaChunk *cnk = (MRAlsaChunk*) prod_own(c->dualQueue);
+			if (clicks)
+				fillClicks(cnk->buf, len, devFrames[i] - len, drift,
+						i * latencyStep);
+			else
+				memcpy(cnk->buf, signal[i], len * sizeof(MRFrame));
+			cnk->len = len;
+			cnk->delay = 0;
+			cnk->ts = (unsigned long long) (devFrames[i] / drift * CPS);
+			cnk->masterFrameCount = masterFrames;
+			cnk->masterTS = masterClock * CPS;
+			cnk->masterDelay = 0;
+			cnk->commitTS = rdtsc();
+			cnk->flags = i == 0 ? CHUNK_MASTER : 0;
+			prod_free(c->dualQueue);
+		}
+	}
+	endTake(masterFrames);
+
+	// Wait for the worker to consume everything.
+	int busy = 1;
+	while (busy) {
+		usleep(1000);
+		busy = 0;
+		for (i = 0; i < devCount; i++)
+			if (queue_pending(devices[i]->dualQueue))
+				busy = 1;
+	}
+	double workerCpu = threadCpu(wrk);
+	double mainCpu = threadCpu(pthread_self()) - mainCpu0;
+
+	state = STOPPING;
+	waitPendingJobs();
+	stopFaults();
+	traceCheck();
+	traceDump("end of run");
+	double wall = now() - wall0;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	double cpu = (ru.ru_utime.tv_sec - ru0.ru_utime.tv_sec)
+			+ (ru.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6
+			+ (ru.ru_stime.tv_sec - ru0.ru_stime.tv_sec)
+			+ (ru.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6;
+	double pipelineCpu = cpu - mainCpu;
+
+	// *** Results ***
+	unsigned long long frames = 0;
+	long long maxSkew = 0;
+	double convMs = 0, queueMs = 0;
+	unsigned long long queueP99 = 0;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		frames += c->outputFrameCount;
+		long long skew = (long long) c->outputFrameCount - c->latency
+				- llround((double) masterFrames * outRate / rate);
+		if (llabs(skew) > llabs(maxSkew))
+			maxSkew = skew;
+		convMs += histMs(&c->stats.conv);
+		queueMs += histMs(&c->stats.queue);
+		if (histQuantile(&c->stats.queue, 0.99) > queueP99)
+			queueP99 = histQuantile(&c->stats.queue, 0.99);
+	}
+	double writeMs = 0, commitMs = 0;
+	unsigned long writeErrors = 0;
+	for (i = 0; i < volCount; i++) {
+		writeMs += histMs(&volumes[i]->writeHist);
+		commitMs += histMs(&volumes[i]->commitHist);
+		writeErrors += volumes[i]->writeErrors;
+	}
+
+	// Memory held by the queues: they never shrink, so this is their peak.
+	unsigned long long queueBytes = 0, maxLost = 0;
+	for (i = 0; i < devCount; i++) {
+		queueBytes += (unsigned long long) queue_size(devices[i]->dualQueue)
+				* devices[i]->dualQueue->contentSize;
+		if (lostFrames[i] > maxLost)
+			maxLost = lostFrames[i];
+	}
+	for (i = 0; i < volCount; i++)
+		queueBytes += (unsigned long long) queue_size(volumes[i]->queue)
+				* volumes[i]->queue->contentSize;
+
+	int syncOk = llabs(maxSkew) <= skewTolerance + maxLost;
+	int memOk = !queueLimitMB || queueBytes <= queueLimitMB * 1048576;
+	// conve is timed on the wall clock, so it may exceed the worker CPU time
+	// when the worker gets preempted.
+	double splitMs = workerCpu * 1000 - convMs;
+	if (splitMs < 0)
+		splitMs = 0;
+	double nsPerFrame = 1e6 / frames;
+
+	printf("wall time     : %.2f s (%.1fx real time)\n", wall, seconds / wall);
+	printf("pipeline cpu  : %.2f s\n", pipelineCpu);
+	printf("throughput    : %.0f frames/s, %.0f frames/s per core\n",
+			frames / wall, pipelineCpu > 0 ? frames / pipelineCpu : 0);
+	printf("conve         : %.1f ns/frame\n", convMs * nsPerFrame);
+	printf("split+queue   : %.1f ns/frame\n", splitMs * nsPerFrame);
+	printf("write         : %.1f ns/frame\n", writeMs * nsPerFrame);
+	printf("commit        : %.1f ns/frame\n", commitMs * nsPerFrame);
+	unsigned long long chunks = masterFrames / chunkFrames * devCount;
+	printf("queue latency : %.0f us avg, %llu us p99\n",
+			chunks ? queueMs * 1000 / chunks : 0, queueP99);
+	printf("peak memory   : %ld KB\n", ru.ru_maxrss);
+	printf("max skew      : %lld frames (%llu lost to xruns) : %s\n", maxSkew,
+			maxLost, syncOk ? "ok" : "FAILED");
+	printf("queue memory  : %llu KB : %s\n", queueBytes / 1024,
+			memOk ? "ok" : "FAILED");
+	printf("write errors  : %lu\n", writeErrors);
+
+	FILE *f = fopen(jsonFile, "w");
+	if (f) {
+		fprintf(f, "{\n");
+		fprintf(f, "  \"devices\": %zu,\n", devCount);
+		fprintf(f, "  \"rate\": %u,\n", rate);
+		fprintf(f, "  \"out_rate\": %u,\n", outRate);
+		fprintf(f, "  \"chunk_frames\": %lu,\n", chunkFrames);
+		fprintf(f, "  \"drift_ppm_step\": %g,\n", ppm);
+		fprintf(f, "  \"audio_seconds\": %u,\n", seconds);
+		fprintf(f, "  \"volumes\": %d,\n", volCount);
+		fprintf(f, "  \"wall_seconds\": %.3f,\n", wall);
+		fprintf(f, "  \"cpu_seconds\": %.3f,\n", pipelineCpu);
+		fprintf(f, "  \"frames\": %llu,\n", frames);
+		fprintf(f, "  \"frames_per_second\": %.0f,\n", frames / wall);
+		fprintf(f, "  \"frames_per_cpu_second\": %.0f,\n",
+				pipelineCpu > 0 ? frames / pipelineCpu : 0);
+		fprintf(f, "  \"ns_per_frame\": { \"conve\": %.2f, \"split_queue\": %.2f, "
+				"\"write\": %.2f, \"commit\": %.2f },\n", convMs * nsPerFrame,
+				splitMs * nsPerFrame, writeMs * nsPerFrame, commitMs * nsPerFrame);
+		fprintf(f, "  \"queue_latency_p99_us\": %llu,\n", queueP99);
+		fprintf(f, "  \"peak_rss_kb\": %ld,\n", ru.ru_maxrss);
+		fprintf(f, "  \"max_skew_frames\": %lld,\n", maxSkew);
+		fprintf(f, "  \"xrun_lost_frames\": %llu,\n", maxLost);
+		fprintf(f, "  \"queue_bytes\": %llu,\n", queueBytes);
+		fprintf(f, "  \"write_errors\": %lu,\n", writeErrors);
+		fprintf(f, "  \"passed\": %s\n", syncOk && memOk ? "true" : "false");
+		fprintf(f, "}\n");
+		fclose(f);
+	}
+
+	if (!keepFiles)
+		removeTake(dir);
+	else
+		printf("take          : %s/%s\n", volumes[0]->root, dir);
+	flushLogging();
+	return syncOk && memOk ? 0 : 1;
+}
@@ -38,7 +38,7 @@ void destroyBucket(Bucket* bkt) {
 
 
 DualQueue* create(unsigned char bucketCount, unsigned int contentSize) {
-	DualQueue *rv = (DualQueue*)malloc(sizeof(DualQueue));
+	DualQueue *rv = (DualQueue*)calloc(1, sizeof(DualQueue));
 	rv->contentSize = contentSize;
 	pthread_mutex_init( &(rv->mutex), NULL);
 
@@ -108,7 +108,7 @@ Bucket * grow(DualQueue *dq, Bucket *insertionPoint) {
 	return n;
 }
 
-inline Bucket* _poll(struct Queue_s *q) {
+static inline Bucket* _poll(struct Queue_s *q) {
 	// Return the head bucket.
 	Bucket *rv = q->head;
 
@@ -124,7 +124,7 @@ inline Bucket* _poll(struct Queue_s *q) {
 	return rv;
 }
 
-inline void _offer(struct Queue_s *q, Bucket* b) {
+static inline void _offer(struct Queue_s *q, Bucket* b) {
 	q->tail = b; // Add the newcomer at the tail.
 
 	// If this queue has no head, then the newcomer is the only bucket in the
@@ -204,6 +204,40 @@ int has_grown() {
 }
 
 
+/**
+ * Returns the number of buckets of the queue, owned ones included. As queues
+ * never shrink, this is also the most they ever held.
+ */
+int queue_size(DualQueue *dq) {
+	pthread_mutex_lock( &(dq->mutex) ); // >> critical section
+	Bucket *start = dq->empty.head ? dq->empty.head
+			: dq->full.head ? dq->full.head
+			: dq->producerOwned ? dq->producerOwned : dq->consumerOwned;
+
+	int rv = 0;
+	Bucket *b = start;
+	if(b)
+		do {
+			rv++;
+			b = b->next;
+		} while(b != start);
+
+	pthread_mutex_unlock( &(dq->mutex) ); // << exit critical section
+	return rv;
+}
+
+/**
+ * Returns whether the consumer is not done yet: buckets are still full, or
+ * it owns one.
+ */
+int queue_pending(DualQueue *dq) {
+	pthread_mutex_lock( &(dq->mutex) ); // >> critical section
+	int rv = dq->full.head || dq->consumerOwned;
+	pthread_mutex_unlock( &(dq->mutex) ); // << exit critical section
+	return rv;
+}
+
+
 // * Consumer (worker) side *
 
 /**
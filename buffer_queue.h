@@ -59,6 +59,8 @@ void prod_free(DualQueue *dq);
 int prod_len(DualQueue *dq);
 
 int has_grown();
+int queue_size(DualQueue *dq);
+int queue_pending(DualQueue *dq);
 
 void *cons_own(DualQueue *dq);
 void cons_free(DualQueue *dq);
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "calibration.h"
+#include "multirec.h"
+#include "log.h"
+
+/** Largest latency taken from the calibration file, in seconds */
+#define MAX_LATENCY 1
+
+
+char *calibrationFile = NULL;
+
+
+int initCalibration() {
+	if (!calibrationFile)
+		return 0;
+
+	FILE *f = fopen(calibrationFile, "r");
+	if (!f) {
+		printf("Can't open the calibration file %s\n", calibrationFile);
+		return -1;
+	}
+
+	char line[1024];
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineNo++;
+		char *pound = strchr(line, '#');
+		if (pound)
+			*pound = '\0';
+
+		int card;
+		double offset;
+		char extra;
+		int n = sscanf(line, "%d %lf %c", &card, &offset, &extra);
+		if (n <= 0)
+			continue;
+		if (n != 2 || card < 0 || fabs(offset) > MAX_LATENCY * outRate) {
+			printf("%s:%d: bad calibration line\n", calibrationFile, lineNo);
+			fclose(f);
+			return -1;
+		}
+		if (card >= devCount) {
+			log_error("calibration: no card %d, line %d ignored\n", card,
+					lineNo);
+			continue;
+		}
+		devices[card]->latency = lround(offset);
+		log_error("dev %d : latency %+ld frames\n", card,
+				devices[card]->latency);
+	}
+	fclose(f);
+	return 0;
+}
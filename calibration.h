@@ -0,0 +1,45 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CALIBRATION_H_
+#define CALIBRATION_H_
+
+
+/**
+ * calibration.c
+ * Fixed latency of each card (converters, USB), which drift tracking (see
+ * drift.h) leaves alone: it keeps the frame counts matched, not the cards
+ * lined up to the sample. The latency is measured once, with mrsync -c on a
+ * take of the same impulse fed to every card, and saved to a calibration file
+ * of "card offset" lines: the card number (in multirec.rc order) and how many
+ * samples of the takes (see outRate) late it is. The worker then writes the
+ * takes of each card from that many frames later in its ring.
+ */
+
+/** Calibration file, set by the calibration option. NULL if not set. */
+extern char *calibrationFile;
+
+/**
+ * Read the calibration file, if set, into the latency of the devices.
+ * Returns -1 on errors.
+ */
+int initCalibration();
+
+
+#endif /* CALIBRATION_H_ */
@@ -0,0 +1,335 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "multirec.h"
+#include "volume.h"
+#include "trace.h"
+#include "log.h"
+
+/** Most clients connected at once */
+#define MAX_CLIENTS 8
+
+/** Longest command line */
+#define LINE_SIZE 256
+
+
+char *controlSocket = NULL;
+volatile int quitRequested = 0;
+
+
+typedef struct Client_s {
+	int fd;
+	char line[LINE_SIZE];
+	int len;
+} Client;
+
+static int listenFd = -1;
+static Client clients[MAX_CLIENTS];
+static char *socketPath = NULL;
+
+static pthread_t controlThread;
+static volatile int controlExit = 0;
+
+
+static const char *stateNames[] = { "monitoring", "recording", "stopping",
+		"starting" };
+
+
+static void reply(Client *c, const char *fmt, ...)
+		__attribute__ ((format (printf, 2, 3)));
+
+static void reply(Client *c, const char *fmt, ...) {
+	char buf[1024];
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf, sizeof(buf) - 1, fmt, args);
+	va_end(args);
+	if (n > sizeof(buf) - 2)
+		n = sizeof(buf) - 2;
+	buf[n++] = '\n';
+
+	// Replies are short: a client that doesn't read them loses them.
+	if (send(c->fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		log_debug("control: reply lost: %s\n", strerror(errno));
+}
+
+
+static void replyStatus(Client *c) {
+	unsigned long errors = 0;
+	int i, offline = 0;
+	for (i = 0; i < volCount; i++)
+		errors += volumes[i]->writeErrors;
+	for (i = 0; i < devCount; i++)
+		offline += !devices[i]->online;
+
+	char disarmed[64];
+	int len = 0, ch;
+	for (i = 0; i < devCount; i++)
+		for (ch = 0; ch < MR_CHANNELS && len < sizeof(disarmed) - 2; ch++)
+			if (devices[i]->disarmed & 1 << ch)
+				disarmed[len++] = 'a' + i * MR_CHANNELS + ch;
+	if (!len)
+		disarmed[len++] = '-';
+	disarmed[len] = '\0';
+
+	const char *take = currentTakeDir();
+	reply(c, "OK state=%s take=%s frame=%llu rate=%u devices=%zu offline=%d "
+			"master=%s write_errors=%lu disarmed=%s", stateNames[state],
+			take ? take : "-", currentFrame(), rate, devCount, offline,
+			devices[masterIdx]->name, errors, disarmed);
+}
+
+
+/**
+ * Arm or disarm a channel, given by its letter. The worker picks it up with
+ * the next take.
+ */
+static void armChannel(Client *c, const char *name, int arm) {
+	if (state != MONITORING) {
+		reply(c, "ERR recording: arm and disarm between takes");
+		return;
+	}
+	if (name[0] < 'a' || name[1] || name[0] - 'a' >= devCount * MR_CHANNELS) {
+		reply(c, "ERR no such channel");
+		return;
+	}
+	MRDevice *dev = devices[(name[0] - 'a') / MR_CHANNELS];
+	int bit = 1 << (name[0] - 'a') % MR_CHANNELS;
+	if (arm)
+		dev->disarmed &= ~bit;
+	else
+		dev->disarmed |= bit;
+	reply(c, "OK");
+}
+
+
+static void replyMeters(Client *c) {
+	char buf[1024];
+	int len = 0, i, ch;
+	for (i = 0; i < devCount; i++)
+		for (ch = 0; ch < MR_CHANNELS && len < sizeof(buf) - 32; ch++) {
+			int peak = devices[i]->peaks[ch];
+			len += sprintf(buf + len, " %c=", 'a' + i * MR_CHANNELS + ch);
+			if (peak > 0)
+				len += sprintf(buf + len, "%.1f", 20 * log10(peak / 32768.0));
+			else
+				len += sprintf(buf + len, "-inf");
+		}
+	buf[len] = '\0';
+	reply(c, "OK%s", buf);
+}
+
+
+static void runCommand(Client *c, const char *cmd) {
+	log_debug("control: %s\n", cmd);
+
+	if (strcmp(cmd, "start") == 0) {
+		if (state != MONITORING)
+			reply(c, "ERR not monitoring");
+		else {
+			startRecording();
+			reply(c, "OK");
+		}
+	} else if (strcmp(cmd, "next") == 0) {
+		if (state != RECORDING)
+			reply(c, "ERR not recording");
+		else {
+			nextTake();
+			reply(c, "OK");
+		}
+	} else if (strcmp(cmd, "stop") == 0) {
+		if (state != RECORDING)
+			reply(c, "ERR not recording");
+		else {
+			stopRecording();
+			reply(c, "OK");
+		}
+	} else if (strcmp(cmd, "status") == 0) {
+		replyStatus(c);
+	} else if (strcmp(cmd, "meters") == 0) {
+		replyMeters(c);
+	} else if (strcmp(cmd, "trace") == 0) {
+		if (!traceSecs)
+			reply(c, "ERR tracing is off (see trace_s)");
+		else {
+			traceTrigger("control");
+			reply(c, "OK");
+		}
+	} else if (strncmp(cmd, "arm ", 4) == 0) {
+		armChannel(c, cmd + 4, 1);
+	} else if (strncmp(cmd, "disarm ", 7) == 0) {
+		armChannel(c, cmd + 7, 0);
+	} else if (strcmp(cmd, "quit") == 0) {
+		quitRequested = 1;
+		reply(c, "OK");
+	} else if (*cmd) {
+		reply(c, "ERR unknown command, try start next stop status meters "
+				"arm disarm trace quit");
+	}
+}
+
+
+/**
+ * Read what a client sent, and run the complete lines. Returns -1 when the
+ * client is gone.
+ */
+static int readClient(Client *c) {
+	int n = recv(c->fd, c->line + c->len, LINE_SIZE - 1 - c->len, 0);
+	if (n <= 0)
+		return -1;
+	c->len += n;
+	c->line[c->len] = '\0';
+
+	char *eol;
+	while ((eol = strchr(c->line, '\n')) != NULL) {
+		*eol = '\0';
+		if (eol > c->line && eol[-1] == '\r')
+			eol[-1] = '\0';
+		runCommand(c, c->line);
+
+		c->len -= eol + 1 - c->line;
+		memmove(c->line, eol + 1, c->len + 1);
+	}
+
+	if (c->len == LINE_SIZE - 1) {
+		reply(c, "ERR line too long");
+		c->len = 0;
+	}
+	return 0;
+}
+
+
+/**
+ * Control thread code: accept clients and serve their commands, until asked
+ * to exit.
+ */
+static void *controlLoop(void *arg) {
+	traceThread("control");
+
+	while (!controlExit) {
+		struct pollfd fds[MAX_CLIENTS + 1];
+		int i, n = 0;
+
+		fds[n].fd = listenFd;
+		fds[n++].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i].fd >= 0) {
+				fds[n].fd = clients[i].fd;
+				fds[n++].events = POLLIN;
+			}
+
+		// Wake up now and then, to see the exit flag.
+		if (poll(fds, n, 200) <= 0)
+			continue;
+
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			Client *c = &clients[i];
+			int k;
+			for (k = 1; k < n; k++)
+				if (fds[k].fd == c->fd && c->fd >= 0 && fds[k].revents
+						&& readClient(c) < 0) {
+					close(c->fd);
+					c->fd = -1;
+				}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listenFd, NULL, NULL);
+			if (fd < 0)
+				continue;
+			for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++)
+				;
+			if (i == MAX_CLIENTS) {
+				close(fd);
+				log_error("control: too many clients\n");
+				continue;
+			}
+			clients[i].fd = fd;
+			clients[i].len = 0;
+		}
+	}
+	return NULL;
+}
+
+
+int initControl(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Control socket path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// A socket left over by a crashed run would make bind() fail.
+	unlink(path);
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr*) &addr, sizeof(addr))
+			|| listen(listenFd, 4)) {
+		printf("Can't create the control socket %s: %s\n", path,
+				strerror(errno));
+		return -1;
+	}
+	socketPath = strdup(path);
+
+	int i;
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	if (pthread_create(&controlThread, NULL, controlLoop, NULL)) {
+		printf("error creating thread.");
+		return -1;
+	}
+	log_debug("control: listening on %s\n", path);
+	return 0;
+}
+
+
+void stopControl() {
+	if (!socketPath)
+		return;
+
+	controlExit = 1;
+	pthread_join(controlThread, NULL);
+
+	int i;
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	close(listenFd);
+	unlink(socketPath);
+	free(socketPath);
+	socketPath = NULL;
+}
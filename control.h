@@ -0,0 +1,61 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+
+/**
+ * control.c
+ * Local control socket. Clients connect to a Unix-domain stream socket and
+ * send one command per line; each command gets one reply line, starting
+ * with "OK" or "ERR":
+ *
+ *   start    start a take
+ *   next     close the take and go on with a new one, with no gap
+ *   stop     close the take, keep monitoring
+ *   status   OK state=<state> take=<dir|-> frame=<n> rate=<hz> devices=<n>
+ *            offline=<n> master=<device> write_errors=<n>
+ *            disarmed=<channels|->
+ *   meters   OK a=<dBFS> b=<dBFS> ... (peak of the last period, per channel)
+ *   arm <channel>, disarm <channel>
+ *            record a channel or not, from the next take on (only while
+ *            monitoring; see the chan lines in multirec.rc)
+ *   trace    dump the thread trace (see trace.h)
+ *   quit     stop capture, close the files and exit
+ *
+ * Start, next and stop are requests: check status to see them done.
+ * e.g.: echo status | socat - UNIX-CONNECT:multirec.sock
+ */
+
+/** Path of the socket, set by the control_socket option. NULL if not set. */
+extern char *controlSocket;
+
+/** Set by the quit command */
+extern volatile int quitRequested;
+
+
+/** Create the socket, and start serving it. Returns -1 on errors. */
+int initControl(const char *path);
+
+/** Stop serving, and remove the socket. */
+void stopControl();
+
+
+#endif /* CONTROL_H_ */
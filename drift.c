@@ -0,0 +1,134 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "drift.h"
+#include "log.h"
+
+/** Observations needed before the fit is trusted */
+#define DRIFT_MIN_POINTS 8
+
+/** Share of the phase error corrected at each chunk */
+#define DRIFT_GAIN 0.1
+
+/** Most the phase correction may change the ratio, in ppm */
+#define DRIFT_MAX_SLEW 500
+
+/**
+ * Observations this far off the fit (in frames, or in rms of the residuals
+ * if more) are a jump, not noise. So are phase errors as large.
+ */
+#define DRIFT_STEP_FRAMES 64
+
+
+void driftReset(MRDrift *d) {
+	d->n = 0;
+	d->head = 0;
+	d->rms = 0;
+	d->ppmError = 0;
+}
+
+
+/**
+ * Least squares fit of the observations in the ring.
+ */
+static void fit(MRDrift *d) {
+	double mx = 0, my = 0;
+	int i;
+	for (i = 0; i < d->n; i++) {
+		mx += d->x[i];
+		my += d->y[i];
+	}
+	mx /= d->n;
+	my /= d->n;
+
+	double sxx = 0, sxy = 0, syy = 0;
+	for (i = 0; i < d->n; i++) {
+		double dx = d->x[i] - mx, dy = d->y[i] - my;
+		sxx += dx * dx;
+		sxy += dx * dy;
+		syy += dy * dy;
+	}
+	if (sxx <= 0)
+		return;
+
+	d->b = sxy / sxx;
+	d->a = my - d->b * mx;
+
+	double res = syy - d->b * sxy;
+	d->rms = res > 0 && d->n > 2 ? sqrt(res / (d->n - 2)) : 0;
+	d->ppm = (1 / d->b - 1) * 1e6;
+	d->ppmError = d->rms / sqrt(sxx) * 1e6;
+}
+
+
+double driftUpdate(MRDrift *d, unsigned long long master, long delay,
+		double output, unsigned long len) {
+	unsigned long long slave = d->inFrames + len + delay;
+	d->inFrames += len;
+
+	double limit = d->rms * 8 > DRIFT_STEP_FRAMES ? d->rms * 8
+			: DRIFT_STEP_FRAMES;
+
+	// A jump in the observations: the old ones are no good anymore.
+	if (d->n >= DRIFT_MIN_POINTS) {
+		double x = (long long) (slave - d->x0);
+		double y = (long long) (master - d->x0);
+		if (fabs(y - d->a - d->b * x) > limit) {
+			log_debug("drift : jump of %.0f frames, fit restarted\n",
+					y - d->a - d->b * x);
+			driftReset(d);
+		}
+	}
+
+	if (d->n == 0)
+		d->x0 = slave;
+	d->x[d->head] = (long long) (slave - d->x0);
+	d->y[d->head] = (long long) (master - d->x0);
+	d->head = (d->head + 1) % DRIFT_WINDOW;
+	if (d->n < DRIFT_WINDOW)
+		d->n++;
+
+	// Not enough observations yet: make the difference disappear in this
+	// chunk, from the raw observation.
+	if (d->n < DRIFT_MIN_POINTS) {
+		double diff = master - (output + len + delay);
+		d->phase = diff;
+		return ((double) (len + diff)) / len;
+	}
+
+	fit(d);
+
+	// Where the output should be at the end of this chunk, on the fitted
+	// line, and how far from it converting at the fitted ratio would leave it.
+	double target = d->a + d->b * ((long long) (slave - d->x0) - delay);
+	double err = target - (output - (double) d->x0) - d->b * len;
+	d->phase = err;
+
+	if (fabs(err) > limit)
+		return d->b + err / len;
+
+	double corr = DRIFT_GAIN * err / len;
+	if (corr > DRIFT_MAX_SLEW * 1e-6)
+		corr = DRIFT_MAX_SLEW * 1e-6;
+	else if (corr < -DRIFT_MAX_SLEW * 1e-6)
+		corr = -DRIFT_MAX_SLEW * 1e-6;
+	return d->b + corr;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRIFT_H_
+#define DRIFT_H_
+
+
+/**
+ * drift.c
+ * Clock tracking of a slave device against the master. Each chunk gives one
+ * observation: how many frames the slave had captured (x), and how many the
+ * master had captured at the same instant (y). Both are noisy, since they
+ * come from a pcm delay and a timestamp taken a bit later. A least squares
+ * fit of y against x, over the last DRIFT_WINDOW observations, gives the
+ * rate of the master clock in slave frames, i.e. the conversion ratio, with
+ * most of the noise averaged out.
+ *
+ * The output timeline is then steered onto the fitted line by a small, bounded
+ * correction added to the ratio: the ratio only moves by a few ppm from chunk
+ * to chunk. A jump in the observations (an xrun, a reset pcm) restarts the
+ * fit, and a phase error too large to be steered away is corrected at once,
+ * as the converter did before.
+ *
+ * Drift tracking keeps the frame counts matched, but not the fixed latency
+ * of each card: see calibration.h.
+ */
+
+/** Observations fitted: one per chunk, i.e. about half a minute */
+#define DRIFT_WINDOW 32
+
+typedef struct MRDrift_s {
+	// Last observations, in a ring (both relative to x0)
+	double x[DRIFT_WINDOW], y[DRIFT_WINDOW];
+	int n, head;
+	unsigned long long x0;
+
+	// Slave frames seen by the converter so far
+	unsigned long long inFrames;
+
+	// Fit results: y = a + b * x, and the rms of the residuals
+	double a, b, rms;
+
+	// Exported in the stats: drift in ppm, its standard error (0 until the
+	// fit can be trusted), and the last phase error in frames.
+	volatile double ppm, ppmError, phase;
+} MRDrift;
+
+
+/**
+ * Forget the observations, e.g. when the slave stream restarts or the device
+ * becomes the master.
+ */
+void driftReset(MRDrift *d);
+
+/**
+ * Add the observation of a chunk of len frames, read with the given pcm
+ * delay, and return the ratio to convert it with. master is the estimated
+ * count of master frames when the chunk was read, output the count of
+ * output frames of the device so far, in master frames (see outRate). The
+ * ratio is in master frames too.
+ */
+double driftUpdate(MRDrift *d, unsigned long long master, long delay,
+		double output, unsigned long len);
+
+
+#endif /* DRIFT_H_ */
@@ -0,0 +1,355 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dsp.h"
+#include "log.h"
+
+/** Corner of the DC blocker, in Hz */
+#define DC_FREQ 5.0
+
+
+/** Chain of a device, created on first use */
+static MRDsp *dspOf(MRDevice *c) {
+	if (!c->dsp)
+		c->dsp = calloc(1, sizeof(MRDsp));
+	return c->dsp;
+}
+
+
+int dspParse(char *args) {
+	char delims[] = " \t\r\n";
+	char *save = NULL;
+	char *name = args ? strtok_r(args, delims, &save) : NULL;
+	if (!name || name[0] < 'a' || name[1]
+			|| name[0] - 'a' >= devCount * MR_CHANNELS) {
+		printf("chan %s: no such channel (chan lines go after the cards)\n",
+				name ? name : "");
+		return -1;
+	}
+	MRDevice *c = devices[(name[0] - 'a') / MR_CHANNELS];
+	int ch = (name[0] - 'a') % MR_CHANNELS;
+
+	char *s;
+	while ((s = strtok_r(NULL, delims, &save)) != NULL) {
+		if (strcmp(s, "disarm") == 0)
+			c->disarmed |= 1 << ch;
+		else if (strcmp(s, "dc") == 0)
+			dspOf(c)->chanStages[ch] |= DSP_DC;
+		else if (strcmp(s, "invert") == 0)
+			dspOf(c)->invert[ch] = 1;
+		else if (strcmp(s, "hpf") == 0 || strcmp(s, "gain") == 0) {
+			char *v = strtok_r(NULL, delims, &save);
+			char *end = NULL;
+			double value = v ? strtod(v, &end) : 0;
+			if (!v || *end) {
+				printf("chan %s: %s needs a value\n", name, s);
+				return -1;
+			}
+			if (s[0] == 'h') {
+				if (value <= 0) {
+					printf("chan %s: bad hpf frequency %s\n", name, v);
+					return -1;
+				}
+				dspOf(c)->chanStages[ch] |= DSP_HPF;
+				dspOf(c)->hpfFreq[ch] = value;
+			} else {
+				dspOf(c)->chanStages[ch] |= DSP_GAIN;
+				dspOf(c)->gainDb[ch] = value;
+			}
+		} else {
+			printf("chan %s: unknown stage %s, try dc hpf gain invert disarm\n",
+					name, s);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Coefficients of one device. Channels without a stage get an identity for
+ * it, since both channels run the same loop. Returns -1 on errors.
+ */
+static int setupDsp(MRDevice *c) {
+	MRDsp *d = c->dsp;
+	int ch;
+
+	d->stages = 0;
+	for (ch = 0; ch < MR_CHANNELS; ch++) {
+		if (d->invert[ch] || c->invert)
+			d->chanStages[ch] |= DSP_GAIN;
+		d->stages |= d->chanStages[ch];
+	}
+
+	for (ch = 0; ch < MR_CHANNELS; ch++) {
+		int st = d->chanStages[ch];
+
+		d->dcP[ch] = st & DSP_DC ? -1 : 0;
+		d->dcR[ch] = st & DSP_DC ? 1 - 2 * M_PI * DC_FREQ / outRate : 0;
+
+		// Butterworth high pass (RBJ cookbook, Q = 1/sqrt(2))
+		d->b0[ch] = 1;
+		d->b1[ch] = d->b2[ch] = d->a1[ch] = d->a2[ch] = 0;
+		if (st & DSP_HPF) {
+			// Only checked now: the filter runs at outRate, set by the
+			// whole rc.
+			if (d->hpfFreq[ch] >= outRate / 2) {
+				printf("chan %c: bad hpf frequency %g, above %u Hz\n",
+						'a' + c->idx * MR_CHANNELS + ch, d->hpfFreq[ch],
+						outRate / 2);
+				return -1;
+			}
+			double w0 = 2 * M_PI * d->hpfFreq[ch] / outRate;
+			double alpha = sin(w0) / (2 * M_SQRT1_2);
+			double a0 = 1 + alpha;
+			d->b0[ch] = (1 + cos(w0)) / 2 / a0;
+			d->b1[ch] = -(1 + cos(w0)) / a0;
+			d->b2[ch] = d->b0[ch];
+			d->a1[ch] = -2 * cos(w0) / a0;
+			d->a2[ch] = (1 - alpha) / a0;
+		}
+
+		d->gain[ch] = st & DSP_GAIN ? pow(10, d->gainDb[ch] / 20) : 1;
+		if (d->invert[ch] != c->invert)
+			d->gain[ch] = -d->gain[ch];
+
+		if (st)
+			log_error("dev %d : channel %c:%s%s%s%s\n", c->idx,
+					'a' + c->idx * MR_CHANNELS + ch, st & DSP_DC ? " dc" : "",
+					st & DSP_HPF ? " hpf" : "", st & DSP_GAIN ? " gain" : "",
+					d->gain[ch] < 0 ? " inverted" : "");
+	}
+	return 0;
+}
+
+
+int initDsp() {
+	int i;
+	for (i = 0; i < devCount; i++)
+		if (devices[i]->dsp && setupDsp(devices[i]) < 0)
+			return -1;
+	return 0;
+}
+
+
+static inline MR_SAMPLE clip(double v) {
+	long s = lrint(v);
+	return s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+}
+
+/**
+ * The chain of one channel, for one set of stages. stages is a constant, so
+ * the unused ones go away.
+ */
+static inline __attribute__((always_inline)) void runLane(MRDsp *d,
+		MRFrame *in, long len, int ch, MR_SAMPLE *out, const int stages) {
+	double dcX1 = d->dcX1[ch], dcY1 = d->dcY1[ch];
+	double x1 = d->x1[ch], x2 = d->x2[ch], y1 = d->y1[ch], y2 = d->y2[ch];
+	long n;
+
+	for (n = 0; n < len; n++) {
+		double x = in[n].v[ch];
+		if (stages & DSP_DC) {
+			double y = x + d->dcP[ch] * dcX1 + d->dcR[ch] * dcY1;
+			dcX1 = x;
+			dcY1 = y;
+			x = y;
+		}
+		if (stages & DSP_HPF) {
+			double y = d->b0[ch] * x + d->b1[ch] * x1 + d->b2[ch] * x2
+					- d->a1[ch] * y1 - d->a2[ch] * y2;
+			x2 = x1;
+			x1 = x;
+			y2 = y1;
+			y1 = y;
+			x = y;
+		}
+		if (stages & DSP_GAIN)
+			x *= d->gain[ch];
+		out[n] = clip(x);
+	}
+	d->dcX1[ch] = dcX1;
+	d->dcY1[ch] = dcY1;
+	d->x1[ch] = x1;
+	d->x2[ch] = x2;
+	d->y1[ch] = y1;
+	d->y2[ch] = y2;
+}
+
+
+#ifdef __SSE2__
+
+/**
+ * The chain, for one set of stages. Both channels go in one SSE2 register, a
+ * double each; stages is a constant, so the unused ones go away.
+ */
+static inline __attribute__((always_inline)) void runChain(MRDsp *d,
+		MRFrame *in, long len, MR_SAMPLE *left, MR_SAMPLE *right,
+		const int stages) {
+	__m128d dcP = _mm_loadu_pd(d->dcP), dcR = _mm_loadu_pd(d->dcR);
+	__m128d dcX1 = _mm_loadu_pd(d->dcX1), dcY1 = _mm_loadu_pd(d->dcY1);
+	__m128d b0 = _mm_loadu_pd(d->b0), b1 = _mm_loadu_pd(d->b1);
+	__m128d b2 = _mm_loadu_pd(d->b2), a1 = _mm_loadu_pd(d->a1);
+	__m128d a2 = _mm_loadu_pd(d->a2);
+	__m128d x1 = _mm_loadu_pd(d->x1), x2 = _mm_loadu_pd(d->x2);
+	__m128d y1 = _mm_loadu_pd(d->y1), y2 = _mm_loadu_pd(d->y2);
+	__m128d gain = _mm_loadu_pd(d->gain);
+	long n;
+
+	for (n = 0; n < len; n++) {
+		// Both 16 bit samples of the frame, to 2 doubles.
+		int pair;
+		memcpy(&pair, &in[n], sizeof(pair));
+		__m128i v = _mm_cvtsi32_si128(pair);
+		v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128d x = _mm_cvtepi32_pd(v);
+
+		if (stages & DSP_DC) {
+			__m128d y = _mm_add_pd(_mm_add_pd(x, _mm_mul_pd(dcP, dcX1)),
+					_mm_mul_pd(dcR, dcY1));
+			dcX1 = x;
+			dcY1 = y;
+			x = y;
+		}
+		if (stages & DSP_HPF) {
+			__m128d y = _mm_add_pd(_mm_mul_pd(b0, x), _mm_mul_pd(b1, x1));
+			y = _mm_add_pd(y, _mm_mul_pd(b2, x2));
+			y = _mm_sub_pd(y, _mm_mul_pd(a1, y1));
+			y = _mm_sub_pd(y, _mm_mul_pd(a2, y2));
+			x2 = x1;
+			x1 = x;
+			y2 = y1;
+			y1 = y;
+			x = y;
+		}
+		if (stages & DSP_GAIN)
+			x = _mm_mul_pd(x, gain);
+
+		// Round, and clip to 16 bits on the way back.
+		v = _mm_cvtpd_epi32(x);
+		v = _mm_packs_epi32(v, v);
+		pair = _mm_cvtsi128_si32(v);
+		left[n] = (MR_SAMPLE) pair;
+		right[n] = (MR_SAMPLE) (pair >> 16);
+	}
+
+	_mm_storeu_pd(d->dcX1, dcX1);
+	_mm_storeu_pd(d->dcY1, dcY1);
+	_mm_storeu_pd(d->x1, x1);
+	_mm_storeu_pd(d->x2, x2);
+	_mm_storeu_pd(d->y1, y1);
+	_mm_storeu_pd(d->y2, y2);
+}
+
+#else
+
+/**
+ * The chain, for one set of stages (plain C version).
+ */
+static inline __attribute__((always_inline)) void runChain(MRDsp *d,
+		MRFrame *in, long len, MR_SAMPLE *left, MR_SAMPLE *right,
+		const int stages) {
+	runLane(d, in, len, 0, left, stages);
+	runLane(d, in, len, 1, right, stages);
+}
+
+#endif
+
+
+void dspSplit(MRDevice *c, MRFrame *in, long len, MR_SAMPLE *left,
+		MR_SAMPLE *right) {
+	MRDsp *d = c->dsp;
+
+#ifdef __SSE2__
+	// The filters decay into denormals on digital silence: flush them to 0.
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+
+	switch (d->stages) {
+	case DSP_DC:
+		runChain(d, in, len, left, right, DSP_DC);
+		break;
+	case DSP_HPF:
+		runChain(d, in, len, left, right, DSP_HPF);
+		break;
+	case DSP_DC | DSP_HPF:
+		runChain(d, in, len, left, right, DSP_DC | DSP_HPF);
+		break;
+	case DSP_GAIN:
+		runChain(d, in, len, left, right, DSP_GAIN);
+		break;
+	case DSP_DC | DSP_GAIN:
+		runChain(d, in, len, left, right, DSP_DC | DSP_GAIN);
+		break;
+	case DSP_HPF | DSP_GAIN:
+		runChain(d, in, len, left, right, DSP_HPF | DSP_GAIN);
+		break;
+	case DSP_DC | DSP_HPF | DSP_GAIN:
+		runChain(d, in, len, left, right, DSP_DC | DSP_HPF | DSP_GAIN);
+		break;
+	default:
+		runChain(d, in, len, left, right, 0);
+		break;
+	}
+}
+
+
+void dspSplitMono(MRDevice *c, MRFrame *in, long len, int chan,
+		MR_SAMPLE *out) {
+	MRDsp *d = c->dsp;
+
+#ifdef __SSE2__
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+
+	switch (d->stages) {
+	case DSP_DC:
+		runLane(d, in, len, chan, out, DSP_DC);
+		break;
+	case DSP_HPF:
+		runLane(d, in, len, chan, out, DSP_HPF);
+		break;
+	case DSP_DC | DSP_HPF:
+		runLane(d, in, len, chan, out, DSP_DC | DSP_HPF);
+		break;
+	case DSP_GAIN:
+		runLane(d, in, len, chan, out, DSP_GAIN);
+		break;
+	case DSP_DC | DSP_GAIN:
+		runLane(d, in, len, chan, out, DSP_DC | DSP_GAIN);
+		break;
+	case DSP_HPF | DSP_GAIN:
+		runLane(d, in, len, chan, out, DSP_HPF | DSP_GAIN);
+		break;
+	case DSP_DC | DSP_HPF | DSP_GAIN:
+		runLane(d, in, len, chan, out, DSP_DC | DSP_HPF | DSP_GAIN);
+		break;
+	default:
+		runLane(d, in, len, chan, out, 0);
+		break;
+	}
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DSP_H_
+#define DSP_H_
+
+#include "multirec.h"
+
+
+/**
+ * dsp.c
+ * Per channel processing, run by the worker while it splits the frames of a
+ * device to dual mono into its ring, so it costs no extra pass over the audio.
+ * Configured by "chan" lines in multirec.rc, after the card lines:
+ *
+ *   chan <channel> [dc] [hpf <Hz>] [gain <dB>] [invert] [disarm]
+ *
+ *   dc       DC blocker (one pole high pass at 5 Hz)
+ *   hpf      high pass filter, 12 dB/octave (Butterworth biquad)
+ *   gain     trim, in dB
+ *   invert   polarity
+ *   disarm   don't record the channel (it can be armed over the control
+ *            socket, between takes)
+ *
+ * The stages run in that order, in double precision; the result is rounded
+ * and clipped to 16 bits. Both channels of a device go through the same
+ * code, one per SSE2 lane; a stage set on one channel only is an identity
+ * on the other one. There is one specialized loop per combination of stages,
+ * so the stages no channel of the device uses cost nothing, and devices with
+ * no chan line take the plain split.
+ */
+
+#define DSP_DC 1
+#define DSP_HPF 2
+#define DSP_GAIN 4
+
+typedef struct MRDsp_s {
+	int stages;                    // DSP_* set on any channel
+
+	// Settings, from multirec.rc
+	int chanStages[MR_CHANNELS];
+	double hpfFreq[MR_CHANNELS];
+	double gainDb[MR_CHANNELS];
+	int invert[MR_CHANNELS];
+
+	// DC blocker: y = x + dcP * x1 + dcR * y1
+	double dcP[MR_CHANNELS], dcR[MR_CHANNELS];
+	double dcX1[MR_CHANNELS], dcY1[MR_CHANNELS];
+
+	// High pass: y = b0 x + b1 x1 + b2 x2 - a1 y1 - a2 y2
+	double b0[MR_CHANNELS], b1[MR_CHANNELS], b2[MR_CHANNELS];
+	double a1[MR_CHANNELS], a2[MR_CHANNELS];
+	double x1[MR_CHANNELS], x2[MR_CHANNELS], y1[MR_CHANNELS], y2[MR_CHANNELS];
+
+	double gain[MR_CHANNELS];
+} MRDsp;
+
+
+/**
+ * Parse the arguments of a "chan" line, and set up the chain of that channel.
+ * Returns -1 on errors.
+ */
+int dspParse(char *args);
+
+/**
+ * Compute the coefficients of all the chains, once the rate is known. The
+ * invert flag of a device with a chain is folded into its gain. Returns -1 on
+ * errors.
+ */
+int initDsp();
+
+/**
+ * Split len frames to dual mono, through the chains of the device.
+ */
+void dspSplit(MRDevice *c, MRFrame *in, long len, MR_SAMPLE *left,
+		MR_SAMPLE *right);
+
+/**
+ * Copy one channel of len frames to a mono buffer, through its chain (see
+ * dspSplit()). The state of the other channel is left alone.
+ */
+void dspSplitMono(MRDevice *c, MRFrame *in, long len, int chan,
+		MR_SAMPLE *out);
+
+
+#endif /* DSP_H_ */
@@ -0,0 +1,311 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fault.h"
+#include "log.h"
+
+/** Most CPU starving threads */
+#define MAX_SPINNERS 32
+
+/** How often the control thread looks at the schedule, in microseconds */
+#define FAULT_PERIOD_US 10000
+
+
+char *faultFile = NULL;
+
+
+typedef enum {
+	FAULT_WRITE_STALL=0,
+	FAULT_WRITE_SLOW,
+	FAULT_WRITE_ERROR,
+	FAULT_READ_DELAY,
+	FAULT_XRUN,
+	FAULT_CPU_STARVE,
+	FAULT_WORKER_SLOW,
+	FAULT_UNPLUG
+} FaultType;
+
+static const char *faultNames[] = { "write_stall", "write_slow",
+		"write_error", "read_delay", "xrun", "cpu_starve", "worker_slow", "unplug", NULL };
+
+typedef struct Fault_s {
+	FaultType type;
+	unsigned long long at, end;   // ms since initFaults()
+	int target;                   // -1 = all
+	long value;
+	volatile unsigned long fired; // targets a one-shot fault has hit (bits)
+	int active;                   // seen active by the control thread
+} Fault;
+
+static Fault *faults = NULL;
+static int faultCount = 0;
+
+static struct timespec startTime;
+
+static pthread_t faultThread;
+static volatile int faultExit = 0;
+static int faultRunning = 0;
+
+static pthread_t spinners[MAX_SPINNERS];
+static volatile int spinRun[MAX_SPINNERS];
+static int spinnerCount = 0;
+
+
+static unsigned long long now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - startTime.tv_sec) * 1000ULL
+			+ (t.tv_nsec - startTime.tv_nsec) / 1000000;
+}
+
+
+static void spin(unsigned long long ms) {
+	unsigned long long end = now() + ms;
+	while (now() < end)
+		;
+}
+
+
+/**
+ * Find the fault of the specified type hitting a target right now. One-shot
+ * faults are marked as fired for that target.
+ */
+static Fault *hit(FaultType type, int target) {
+	unsigned long long t = now();
+	int i;
+	for (i = 0; i < faultCount; i++) {
+		Fault *f = &faults[i];
+		if (f->type != type || t < f->at
+				|| (f->target >= 0 && f->target != target))
+			continue;
+
+		if (f->end == f->at) {
+			unsigned long bit = 1UL << (target % (8 * sizeof(long)));
+			if (!(__sync_fetch_and_or(&f->fired, bit) & bit))
+				return f;
+		} else if (t < f->end)
+			return f;
+	}
+	return NULL;
+}
+
+
+int faultWrite(int vol) {
+	if (!faultCount)
+		return 0;
+
+	Fault *f;
+	if ((f = hit(FAULT_WRITE_STALL, vol)) != NULL) {
+		log_error("fault: write stall of %ld ms on volume %d\n", f->value, vol);
+		usleep(f->value * 1000);
+	}
+	if ((f = hit(FAULT_WRITE_SLOW, vol)) != NULL)
+		usleep(f->value * 1000);
+	if ((f = hit(FAULT_WRITE_ERROR, vol)) != NULL)
+		return f->value;
+	return 0;
+}
+
+
+int faultRead(int dev) {
+	if (!faultCount)
+		return 0;
+
+	Fault *f;
+	if ((f = hit(FAULT_READ_DELAY, dev)) != NULL)
+		usleep(f->value * 1000);
+	if ((f = hit(FAULT_XRUN, dev)) != NULL) {
+		log_error("fault: xrun on device %d\n", dev);
+		return 1;
+	}
+	return 0;
+}
+
+
+int faultUnplugged(int dev) {
+	return faultCount && hit(FAULT_UNPLUG, dev) != NULL;
+}
+
+
+void faultWorker() {
+	if (!faultCount)
+		return;
+
+	Fault *f = hit(FAULT_WORKER_SLOW, 0);
+	if (f && f->value > 0)
+		spin(random() % f->value);
+}
+
+
+static void *spinner(void *arg) {
+	volatile int *run = (volatile int*) arg;
+	while (!faultExit) {
+		if (*run)
+			spin(1);
+		else
+			usleep(1000);
+	}
+	return NULL;
+}
+
+
+/**
+ * Control thread code: log the faults as they begin and end, and keep as many
+ * spinning threads as the active cpu_starve faults ask for.
+ */
+static void *faultLoop(void *arg) {
+	while (!faultExit) {
+		usleep(FAULT_PERIOD_US);
+
+		unsigned long long t = now();
+		int i, spinning = 0;
+		for (i = 0; i < faultCount; i++) {
+			Fault *f = &faults[i];
+			int active = t >= f->at && t < f->end;
+			if (active != f->active) {
+				f->active = active;
+				log_error("fault: %s %ld %s\n", faultNames[f->type], f->value,
+						active ? "begins" : "ends");
+			}
+			if (active && f->type == FAULT_CPU_STARVE)
+				spinning += f->value;
+		}
+
+		if (spinning > MAX_SPINNERS)
+			spinning = MAX_SPINNERS;
+		for (i = 0; i < MAX_SPINNERS; i++)
+			spinRun[i] = i < spinning;
+		while (spinnerCount < spinning) {
+			if (pthread_create(&spinners[spinnerCount], NULL, spinner,
+					(void*) &spinRun[spinnerCount])) {
+				log_error("fault: can't start a spinning thread\n");
+				break;
+			}
+			spinnerCount++;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Parse one line of the scenario into a new fault. Returns -1 on errors.
+ */
+static int parseFault(char *line, int lineNo) {
+	char delims[] = " \t\r\n";
+	char *pound = strchr(line, '#');
+	if (pound)
+		*pound = '\0';
+
+	char *at = strtok(line, delims);
+	if (!at)
+		return 0;
+	char *dur = strtok(NULL, delims);
+	char *type = strtok(NULL, delims);
+	char *target = strtok(NULL, delims);
+	char *value = strtok(NULL, delims);
+	if (!value) {
+		printf("%s:%d : expected <at> <duration> <fault> <target> <value>\n",
+				faultFile, lineNo);
+		return -1;
+	}
+
+	Fault f;
+	memset(&f, 0, sizeof(f));
+	for (f.type = 0; faultNames[f.type]; f.type++)
+		if (strcmp(type, faultNames[f.type]) == 0)
+			break;
+	if (!faultNames[f.type]) {
+		printf("%s:%d : unknown fault %s\n", faultFile, lineNo, type);
+		return -1;
+	}
+
+	f.at = atof(at) * 1000;
+	f.end = f.at + atof(dur) * 1000;
+	f.target = strcmp(target, "*") == 0 ? -1 : atoi(target);
+
+	if (f.type == FAULT_WRITE_ERROR) {
+		if (strcmp(value, "ENOSPC") == 0)
+			f.value = ENOSPC;
+		else if (strcmp(value, "EIO") == 0)
+			f.value = EIO;
+		else {
+			printf("%s:%d : write_error takes ENOSPC or EIO\n", faultFile,
+					lineNo);
+			return -1;
+		}
+	} else
+		f.value = atol(value);
+
+	faults = realloc(faults, sizeof(Fault) * (faultCount + 1));
+	faults[faultCount++] = f;
+	return 0;
+}
+
+
+int initFaults() {
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	if (!faultFile)
+		return 0;
+
+	FILE *f = fopen(faultFile, "r");
+	if (!f) {
+		printf("Can't open the fault scenario %s\n", faultFile);
+		return -1;
+	}
+
+	char line[1024];
+	int lineNo = 0, err = 0;
+	while (!err && fgets(line, sizeof(line), f) != NULL)
+		err = parseFault(line, ++lineNo);
+	fclose(f);
+	if (err)
+		return -1;
+
+	log_error("fault: %d faults scheduled from %s\n", faultCount, faultFile);
+
+	if (pthread_create(&faultThread, NULL, faultLoop, NULL)) {
+		printf("error creating thread.");
+		return -1;
+	}
+	faultRunning = 1;
+	return 0;
+}
+
+
+void stopFaults() {
+	if (!faultRunning)
+		return;
+	faultRunning = 0;
+
+	faultExit = 1;
+	pthread_join(faultThread, NULL);
+
+	int i;
+	for (i = 0; i < spinnerCount; i++)
+		pthread_join(spinners[i], NULL);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAULT_H_
+#define FAULT_H_
+
+
+/**
+ * fault.c
+ * Fault injection, for soak tests. A scenario file schedules faults, one per
+ * line:
+ *
+ *   <at s> <duration s> <fault> <target> <value>
+ *
+ * Times are seconds since capture started. A fault with duration 0 fires
+ * once per target; otherwise it is active for that long. The target is a
+ * volume index for write faults, a device index for capture faults, and "*"
+ * for all of them. Faults:
+ *
+ *   write_stall  <ms>        the next write blocks for ms
+ *   write_slow   <ms>        every write takes ms longer
+ *   write_error  ENOSPC|EIO  writes fail with that error
+ *   read_delay   <ms>        every capture read is late by ms
+ *   xrun         <ignored>   the next capture read is lost, as in an overrun
+ *   cpu_starve   <threads>   that many threads spin on the CPU
+ *   worker_slow  <max ms>    the disk worker spins up to ms for each chunk
+ *   unplug       <ignored>   capture reads fail, and the card can't be
+ *                            reopened, as if it was unplugged
+ *
+ * Without a scenario, the hooks cost one test each.
+ */
+
+/** Scenario file, set by the "faults" option. NULL if none. */
+extern char *faultFile;
+
+
+/** Load the scenario, and start its clock. Returns -1 on errors. */
+int initFaults();
+
+/** Stop the CPU starving threads. */
+void stopFaults();
+
+/**
+ * Called by the volume writers before each write. Applies stalls and
+ * slowdowns, then returns the error to fake for this write, or 0.
+ */
+int faultWrite(int vol);
+
+/**
+ * Called by the device threads before each read. Applies delays, then
+ * returns 1 if the read must be dropped as an xrun.
+ */
+int faultRead(int dev);
+
+/** Returns 1 while the device must look unplugged. */
+int faultUnplugged(int dev);
+
+/** Called by the disk worker for each chunk. */
+void faultWorker();
+
+
+#endif /* FAULT_H_ */
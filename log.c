@@ -0,0 +1,414 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "multirec.h"
+
+/** Records per thread ring (a power of 2) */
+#define LOG_RING_SIZE 1024
+
+/** How often the logger thread writes the pending records, in microseconds */
+#define LOG_PERIOD_US 10000
+
+
+unsigned int logLevel = DEBUG;
+FILE *logFile = NULL;
+
+
+typedef union LogArg_u {
+	long long i;      // integers, and offset in str for strings
+	double d;
+	const void *p;
+} LogArg;
+
+typedef struct LogRecord_s {
+	unsigned long long ts;     // ns since initLogging()
+	const char *fmt;
+	short level;
+	short dev;                 // -1 if not a device message
+	unsigned char nargs;
+	LogArg arg[LOG_MAX_ARGS];
+	char str[LOG_STR_SIZE];
+} LogRecord;
+
+/**
+ * Single producer, single consumer ring: head is only moved by the owner
+ * thread, tail only by the logger.
+ */
+typedef struct LogRing_s {
+	struct LogRing_s *next;
+	int id;
+	volatile unsigned long head, tail;
+	volatile unsigned long dropped;   // records lost to a full ring
+	unsigned long reported;           // drops already reported in the log
+	LogRecord rec[LOG_RING_SIZE];
+} LogRing;
+
+/** All the rings, newest first. Rings are never removed. */
+static LogRing * volatile rings = NULL;
+static int ringCount = 0;
+
+static __thread LogRing *myRing = NULL;
+
+static struct timespec startTime;
+
+static pthread_t logThread;
+/** Serializes the draining of the rings */
+static pthread_mutex_t drainMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static unsigned long long now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - startTime.tv_sec) * 1000000000ULL + t.tv_nsec
+			- startTime.tv_nsec;
+}
+
+
+static LogRing *newRing() {
+	LogRing *r = calloc(1, sizeof(LogRing));
+	r->id = __sync_add_and_fetch(&ringCount, 1);
+	do {
+		r->next = rings;
+	} while (!__sync_bool_compare_and_swap(&rings, r->next, r));
+	myRing = r;
+	return r;
+}
+
+
+/**
+ * Parse a printf conversion spec, starting right after the '%'. Returns the
+ * conversion character (0 if none), and sets p past it. Stars found in the
+ * width / precision are counted in stars; lng tells the argument size
+ * (0 = int, 1 = long, 2 = long long).
+ */
+static char parseSpec(const char **p, int *stars, int *lng) {
+	const char *s = *p;
+	*stars = 0;
+	*lng = 0;
+
+	s += strspn(s, "-+ #0'");
+	if (*s == '*') {
+		(*stars)++;
+		s++;
+	}
+	s += strspn(s, "0123456789");
+	if (*s == '.') {
+		s++;
+		if (*s == '*') {
+			(*stars)++;
+			s++;
+		}
+		s += strspn(s, "0123456789");
+	}
+	for (; *s && strchr("hlLqjzt", *s); s++) {
+		if (*s == 'l')
+			(*lng)++;
+		else if (*s == 'q' || *s == 'L')
+			*lng = 2;
+		else if (*s != 'h')
+			*lng = 1;
+	}
+
+	*p = *s ? s + 1 : s;
+	return *s;
+}
+
+
+/**
+ * Copy the arguments of a log call into a record, as told by its format.
+ */
+static void captureArgs(LogRecord *r, const char *fmt, va_list ap) {
+	const char *p = fmt;
+	size_t strLen = 0;
+	int stars, lng;
+
+	r->nargs = 0;
+	while ((p = strchr(p, '%')) != NULL) {
+		p++;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+
+		char conv = parseSpec(&p, &stars, &lng);
+		if (r->nargs + stars + 1 > LOG_MAX_ARGS)
+			return;
+		while (stars--)
+			r->arg[r->nargs++].i = va_arg(ap, int);
+
+		LogArg *a = &r->arg[r->nargs++];
+		switch (conv) {
+		case 'd': case 'i': case 'c':
+			a->i = lng == 2 ? va_arg(ap, long long)
+					: lng == 1 ? va_arg(ap, long) : va_arg(ap, int);
+			break;
+		case 'u': case 'x': case 'X': case 'o':
+			a->i = lng == 2 ? va_arg(ap, unsigned long long)
+					: lng == 1 ? va_arg(ap, unsigned long)
+							: va_arg(ap, unsigned int);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			a->d = lng == 2 ? (double) va_arg(ap, long double)
+					: va_arg(ap, double);
+			break;
+		case 's': {
+			const char *s = va_arg(ap, const char*);
+			if (!s)
+				s = "(null)";
+			size_t n = strlen(s);
+			if (n > LOG_STR_SIZE - 1 - strLen)
+				n = LOG_STR_SIZE - 1 - strLen;
+			memcpy(r->str + strLen, s, n);
+			r->str[strLen + n] = '\0';
+			a->i = strLen;
+			strLen += n;
+			if (strLen < LOG_STR_SIZE - 1)
+				strLen++;
+			break;
+		}
+		case 'p': case 'n':
+			a->p = va_arg(ap, void*);
+			break;
+		default:
+			// Unknown conversion: don't guess the rest.
+			r->nargs--;
+			return;
+		}
+	}
+}
+
+
+/**
+ * Format a record, the same way printf would have done with the original
+ * arguments.
+ */
+static void writeRecord(FILE *f, const LogRecord *r) {
+	fprintf(f, "[%5llu.%06llu] ", r->ts / 1000000000ULL,
+			r->ts / 1000 % 1000000);
+	if (r->dev >= 0)
+		fprintf(f, "%s dev %d : ", r->level == ERROR ? "ERR-" : "DBG-",
+				r->dev);
+
+	const char *p = r->fmt, *pct;
+	int n = 0, stars, lng;
+	while ((pct = strchr(p, '%')) != NULL) {
+		fwrite(p, 1, pct - p, f);
+		p = pct + 1;
+		if (*p == '%') {
+			fputc('%', f);
+			p++;
+			continue;
+		}
+
+		char conv = parseSpec(&p, &stars, &lng);
+		if (n + stars + 1 > r->nargs) {
+			// Arguments not captured: print the rest as is.
+			p = pct;
+			break;
+		}
+
+		// Rebuild the spec, with the stars replaced by their values and
+		// without the length modifiers, which are passed on by type below.
+		char spec[64];
+		int len = 0;
+		const char *s;
+		for (s = pct; s < p - 1 && len < sizeof(spec) - 24; s++) {
+			if (*s == '*')
+				len += sprintf(spec + len, "%d", (int) r->arg[n++].i);
+			else if (!strchr("hlLqjzt", *s))
+				spec[len++] = *s;
+		}
+		const LogArg *a = &r->arg[n++];
+		switch (conv) {
+		case 'c':
+			spec[len++] = conv;
+			spec[len] = '\0';
+			fprintf(f, spec, (int) a->i);
+			break;
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+			spec[len++] = 'l';
+			spec[len++] = 'l';
+			spec[len++] = conv;
+			spec[len] = '\0';
+			if (conv == 'd' || conv == 'i')
+				fprintf(f, spec, lng ? a->i : (long long) (int) a->i);
+			else
+				fprintf(f, spec, lng == 2 ? (unsigned long long) a->i
+						: lng ? (unsigned long long) (unsigned long) a->i
+								: (unsigned long long) (unsigned int) a->i);
+			break;
+		case 's':
+			spec[len++] = conv;
+			spec[len] = '\0';
+			fprintf(f, spec, r->str + a->i);
+			break;
+		case 'p':
+			spec[len++] = conv;
+			spec[len] = '\0';
+			fprintf(f, spec, a->p);
+			break;
+		case 'n':
+			break;
+		default:
+			spec[len++] = conv;
+			spec[len] = '\0';
+			fprintf(f, spec, a->d);
+			break;
+		}
+	}
+	fputs(p, f);
+}
+
+
+/**
+ * Write out the pending records of all rings, oldest first.
+ */
+static void drain() {
+	LogRing *r;
+
+	pthread_mutex_lock(&drainMutex);
+	while (1) {
+		LogRing *best = NULL;
+		for (r = rings; r; r = r->next)
+			if (r->tail != r->head && (!best
+					|| r->rec[r->tail % LOG_RING_SIZE].ts
+							< best->rec[best->tail % LOG_RING_SIZE].ts))
+				best = r;
+		if (!best)
+			break;
+
+		// Don't read the record before its publication by the owner.
+		__sync_synchronize();
+		writeRecord(logFile, &best->rec[best->tail % LOG_RING_SIZE]);
+		__sync_synchronize();
+		best->tail++;
+	}
+
+	// Drops happened after the records which did fit in the rings.
+	for (r = rings; r; r = r->next) {
+		unsigned long dropped = r->dropped;
+		if (dropped != r->reported) {
+			fprintf(logFile, "*** %lu log records dropped by thread #%d\n",
+					dropped - r->reported, r->id);
+			r->reported = dropped;
+		}
+	}
+	fflush(logFile);
+	pthread_mutex_unlock(&drainMutex);
+}
+
+
+static void *logLoop(void *arg) {
+	while (1) {
+		usleep(LOG_PERIOD_US);
+		drain();
+	}
+	return NULL;
+}
+
+
+void initLogging(const char *fname) {
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+	logFile = fopen(fname, "w+");
+	if (!logFile)
+		logFile = stderr;
+
+	if (pthread_create(&logThread, NULL, logLoop, NULL)) {
+		printf("error creating thread.");
+		exit(-1);
+	}
+	pthread_detach(logThread);
+}
+
+
+void flushLogging() {
+	if (logFile)
+		drain();
+}
+
+
+/**
+ * Store a record in the ring of the calling thread. Never blocks: if the ring
+ * is full, the record is dropped.
+ */
+static void logRecord(int level, int dev, const char *fmt, va_list ap) {
+	LogRing *r = myRing ? myRing : newRing();
+	unsigned long h = r->head;
+	if (h - r->tail >= LOG_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+
+	LogRecord *rec = &r->rec[h % LOG_RING_SIZE];
+	rec->ts = now();
+	rec->fmt = fmt;
+	rec->level = level;
+	rec->dev = dev;
+	captureArgs(rec, fmt, ap);
+
+	// Publish the record.
+	__sync_synchronize();
+	r->head = h + 1;
+}
+
+
+#define LOG_IMPL(level, dev) \
+	va_list args; \
+	va_start(args, fmt); \
+	logRecord(level, dev, fmt, args); \
+	va_end(args);
+
+
+void log_debug(const char *fmt, ...) {
+	if (logLevel < DEBUG)
+		return;
+	LOG_IMPL(DEBUG, -1)
+}
+
+
+void log_error(const char *fmt, ...) {
+	if (logLevel < ERROR)
+		return;
+	LOG_IMPL(ERROR, -1)
+}
+
+
+void log_dev_debug(MRDevice *c, const char *fmt, ...) {
+	if (logLevel < DEBUG)
+		return;
+	LOG_IMPL(DEBUG, c->idx)
+}
+
+
+void log_dev_error(MRDevice *c, const char *fmt, ...) {
+	if (logLevel < ERROR)
+		return;
+	LOG_IMPL(ERROR, c->idx)
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdio.h>
+
+
+/**
+ * log.c
+ * Asynchronous logger. The log_* functions don't do any I/O: they copy the
+ * format string pointer and the arguments into a fixed-size record, in a
+ * ring owned by the calling thread, and return. A background thread merges
+ * the rings in timestamp order, formats the records and writes them to the
+ * log file. If a ring is full, the record is dropped and counted; the drop
+ * count is reported in the log.
+ *
+ * Format strings must be literals (or otherwise outlive the record), while
+ * %s arguments are copied. Records hold at most LOG_MAX_ARGS arguments and
+ * LOG_STR_SIZE bytes of strings; the rest is truncated.
+ */
+
+#define LOG_MAX_ARGS 8
+#define LOG_STR_SIZE 128
+
+enum LogLevel { OFF=0, ERROR, DEBUG };
+
+/** Current log level. Can be changed by the log_level option. */
+extern unsigned int logLevel;
+
+/**
+ * The log file. Only the logger thread writes to it, except for the ALSA
+ * setup dumps done before capture starts.
+ */
+extern FILE *logFile;
+
+struct MRDevice_s;
+
+
+/** Open the log file, and start the logger thread. */
+void initLogging(const char *fname);
+
+/** Write out all pending records. Can be called from any thread. */
+void flushLogging();
+
+void log_debug(const char *fmt, ...)
+		__attribute__ ((format (printf, 1, 2)));
+void log_error(const char *fmt, ...)
+		__attribute__ ((format (printf, 1, 2)));
+void log_dev_debug(struct MRDevice_s *c, const char *fmt, ...)
+		__attribute__ ((format (printf, 2, 3)));
+void log_dev_error(struct MRDevice_s *c, const char *fmt, ...)
+		__attribute__ ((format (printf, 2, 3)));
+
+
+#endif /* LOG_H_ */
@@ -20,15 +20,26 @@
 #include <ncurses.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <math.h>
 #include <time.h>
 
 #include "multirec.h"
 #include "main.h"
+#include "log.h"
+#include "trace.h"
+#include "control.h"
 
 int exitRequested = 0;
 int stopRequested = 0;
 
+/** Set when running without the curses UI (-H) */
+int headless = 0;
+
+/** Control socket of the headless mode, unless control_socket is set */
+#define DEFAULT_CONTROL_SOCKET "multirec.sock"
+
 int confirmStop = 0;
 
 short oldLevels[4][2] = {{10,10},{10,10},{10,10},{10,10}};
@@ -36,18 +47,35 @@ short levels[4][2] = {{0,0},{0,0},{0,0},{0,0}};
 
 
 void cmdStartRec() {
-	attron(A_BOLD | A_BLINK | COLOR_PAIR(COLOR_RED));
-	int y = getmaxy(stdscr);
-	//~ char buf[100];
-	//~ sprintf(buf, "%d, %d", y, x);
-	//~ mvaddstr(10, 10,buf);
-	mvaddstr(y-1, 10, "REC");
-	attroff(A_BOLD | A_BLINK | COLOR_PAIR(COLOR_RED));
-	
 	startRecording();
 }
 
 
+void cmdNextTake() {
+	nextTake();
+}
+
+
+void cmdStopTake() {
+	stopRecording();
+}
+
+
+/**
+ * Show the red REC label at the bottom while a take is being recorded.
+ */
+void showState() {
+	int y = getmaxy(stdscr);
+	if (state == RECORDING) {
+		attron(A_BOLD | A_BLINK | COLOR_PAIR(COLOR_RED));
+		mvaddstr(y-1, 10, "REC");
+		attroff(A_BOLD | A_BLINK | COLOR_PAIR(COLOR_RED));
+	} else {
+		mvaddstr(y-1, 10, "   ");
+	}
+}
+
+
 void cmdStopRec() {
 	attron(A_BOLD);
 	mvaddstr(10, 10, "Really exit (y/n) ? ");
@@ -86,6 +114,7 @@ inline void plotLevel(short lev, short devNum, short chNum) {
 
 
 void monitor() {
+	unsigned long long tr = traceStart();
 	int i;
 	for(i=0; i<devCount; i++) {
 		// Plot DEV 0, CH 0 level
@@ -96,22 +125,88 @@ void monitor() {
 		lev = 10*log10(devices[i]->peaks[1] / 32768.0);
 		plotLevel(lev>-18 ? lev : -18, i, 1);
 	}
+	showState();
 	refresh();
+	traceEnd("repaint", tr, NULL, 0);
+}
+
+
+/** SIGUSR1 handler: dump the trace, e.g. from another terminal */
+void traceSignal(int sig) {
+	traceTrigger("SIGUSR1");
+}
+
+
+/**
+ * SIGINT handler: only flag the request, for the main loop to exit through
+ * finish(), since that takes the locks of the logger, which the signal may
+ * have interrupted. A second one exits at once, e.g. if stuck in init().
+ */
+static volatile sig_atomic_t interrupted = 0;
+
+void interruptSignal(int sig) {
+	if (interrupted)
+		_exit(sig);
+	interrupted = sig;
+}
+
+
+/** SIGTERM handler of the headless mode: quit cleanly, as the quit command */
+void quitSignal(int sig) {
+	quitRequested = 1;
+}
+
+
+/**
+ * Headless mode: no curses, the session is driven through the control socket
+ * (see control.h). Returns when asked to quit, with all files closed.
+ */
+void runHeadless(const char *out) {
+	signal(SIGINT, interruptSignal);
+	signal(SIGTERM, quitSignal);
+	signal(SIGUSR1, traceSignal);
+
+	init(out);
+
+	const char *path = controlSocket ? controlSocket : DEFAULT_CONTROL_SOCKET;
+	if (initControl(path) < 0)
+		finish(-1);
+	printf("multirec: control socket %s\n", path);
+
+	while (!quitRequested && !interrupted)
+		usleep(100000);
+
+	stopControl();
+	if (interrupted)
+		finish(interrupted);
+	stopCapture();
 }
 
 
 int main(int argc, char *argv[]) {
 
+	if(argc>1 && strcmp(argv[1], "-H")==0) {
+		headless = 1;
+		argv++;
+		argc--;
+	}
+
 	// Expects a track name as argument, which will become the output dir
 	// where to save this recording session's tracks.
 	if(argc<2) {
 		printf("Output dir not specified!\n");
+		printf("Usage: multirec [-H] <track name>\n");
 		return -1;
 	}
-	
+
+	if(headless) {
+		runHeadless(argv[1]);
+		finish(0);
+	}
 
 
-    signal(SIGINT, finish);      /* arrange interrupts to terminate */
+    signal(SIGINT, interruptSignal);      /* arrange interrupts to terminate */
+    signal(SIGUSR1, traceSignal);
 
     initscr();      /* initialize the curses library */
     keypad(stdscr, TRUE);  /* enable keyboard mapping */
@@ -135,6 +230,11 @@ int main(int argc, char *argv[]) {
     }
 
 	init(argv[1]);
+	traceThread("ui");
+
+	// The control socket is optional with the UI.
+	if(controlSocket && initControl(controlSocket) < 0)
+		finish(-1);
 
 
     for (;;) {
@@ -145,9 +245,15 @@ int main(int argc, char *argv[]) {
 
 		// Got out of the last callback run (after a stop request). Stop
 		// looping and end the prog.
-		if(exitRequested)
+		if(exitRequested || interrupted)
 			break;
 
+		// Quit through the control socket
+		if(quitRequested) {
+			stopCapture();
+			break;
+		}
+
 
 		switch (c) {
 		case 'q':
@@ -156,13 +262,22 @@ int main(int argc, char *argv[]) {
 		case 'r':
 			cmdStartRec();
 			break;
+		case 't':
+			cmdNextTake();
+			break;
+		case 's':
+			cmdStopTake();
+			break;
 		case 'm':
 			monitor();
 			break;
+		case 'd':
+			traceTrigger("key");
+			break;
 		case 'y':
 			if (confirmStop) {
 				// Stop the recording hardware and finalize the files...
-				stopRecording();
+				stopCapture();
 				// ...then, exit the curses loop and end the program
 				exitRequested = 1;
 			}
@@ -171,13 +286,16 @@ int main(int argc, char *argv[]) {
         
     }
 
-    finish(0);
+    stopControl();
+    finish(interrupted);
     return 0;
 }
 
 
 void finish(int sig) {
-    endwin();
+	if(!headless)
+		endwin();
+	flushLogging();
 	
     exit(sig);
 }
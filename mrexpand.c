@@ -0,0 +1,359 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * mrexpand.c
+ * Turns the sparse files of a take (see the silence_ms option) back into
+ * contiguous ones: the stretches of silence listed in the take's silence.txt
+ * are put back in place as digital silence, so every file of the take is
+ * again sample-aligned with the others. The .peaks sidecars, if any, are
+ * rebuilt to match.
+ *
+ * Usage: mrexpand [-o out-dir] <take-dir> ...
+ *   -o dir : write expanded copies of the sparse files there (one take
+ *            only), and leave the take alone. By default the files are
+ *            replaced, and silence.txt removed; if some fail, it keeps
+ *            only their lines, so that a second run picks up where the
+ *            first one stopped.
+ *
+ * Takes spread over several volumes are found through their manifest.txt.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sndfile.h>
+
+#include "peaks.h"
+
+
+/** Samples copied per read */
+#define COPY_FRAMES 65536
+
+/** Stretch of silence left out of a file, in frames from its start */
+typedef struct Stretch_s {
+	unsigned long long from, to;
+} Stretch;
+
+/** A file of the take, and the silence to put back in it */
+typedef struct SparseFile_s {
+	char name[256];
+	Stretch *stretch;
+	int count, size;
+	int expanded;          // in place: its silence must not be put back again
+} SparseFile;
+
+
+static const char *outDir = NULL;
+
+static short buf[COPY_FRAMES];
+static const short zeros[COPY_FRAMES];
+
+
+static int byFrom(const void *a, const void *b)
+{
+	const Stretch *x = a, *y = b;
+	return x->from < y->from ? -1 : x->from > y->from;
+}
+
+
+/**
+ * Where a file of the take lives: as listed in its manifest, if it has one,
+ * or next to the manifest.
+ */
+static void findFile(const char *dir, const char *name, char *path, size_t len)
+{
+	char line[4096];
+	snprintf(path, len, "%s/manifest.txt", dir);
+	FILE *f = fopen(path, "r");
+	snprintf(path, len, "%s/%s", dir, name);
+	if(!f)
+		return;
+	while(fgets(line, sizeof(line), f)) {
+		char *n = strtok(line, "\t\r\n");
+		char *file = strtok(NULL, "\t\r\n");
+		if(n && file && strcmp(n, name) == 0 && access(file, R_OK) == 0) {
+			snprintf(path, len, "%s", file);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+
+/**
+ * Write len frames to the expanded file, and to its peak index if any.
+ */
+static int put(SNDFILE *out, MRPeakFile *peaks, const short *data,
+		sf_count_t len)
+{
+	if(peaks)
+		peaksAppend(peaks, data, len);
+	return sf_writef_short(out, data, len) == len ? 0 : -1;
+}
+
+
+/**
+ * Copy len frames of the sparse file over.
+ */
+static int copy(SNDFILE *in, SNDFILE *out, MRPeakFile *peaks,
+		unsigned long long len)
+{
+	while(len) {
+		sf_count_t n = len < COPY_FRAMES ? len : COPY_FRAMES;
+		if(sf_readf_short(in, buf, n) != n || put(out, peaks, buf, n))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Expand one file. Returns 0 if done, -1 on error (the file is left as is).
+ */
+static int expandFile(const char *dir, SparseFile *sf)
+{
+	char path[4096], outPath[4200], peaksPath[4200], outPeaks[4300];
+	findFile(dir, sf->name, path, sizeof(path));
+
+	SF_INFO sfi;
+	memset(&sfi, 0, sizeof(sfi));
+	SNDFILE *in = sf_open(path, SFM_READ, &sfi);
+	if(!in) {
+		printf("%s : %s\n", path, sf_strerror(NULL));
+		return -1;
+	}
+	if(sfi.channels != 1) {
+		printf("%s : not a mono file\n", path);
+		sf_close(in);
+		return -1;
+	}
+
+	if(outDir)
+		snprintf(outPath, sizeof(outPath), "%s/%s", outDir, sf->name);
+	else
+		snprintf(outPath, sizeof(outPath), "%s.tmp", path);
+	SNDFILE *out = sf_open(outPath, SFM_WRITE, &sfi);
+	if(!out) {
+		printf("%s : %s\n", outPath, sf_strerror(NULL));
+		sf_close(in);
+		return -1;
+	}
+
+	// The peak index is rebuilt if the file had one.
+	MRPeakFile *peaks = NULL;
+	size_t len = strlen(path);
+	snprintf(peaksPath, sizeof(peaksPath), "%.*s.peaks", (int) len - 4, path);
+	len = strlen(outPath);
+	if(outDir)
+		snprintf(outPeaks, sizeof(outPeaks), "%.*s.peaks", (int) len - 4,
+				outPath);
+	else
+		snprintf(outPeaks, sizeof(outPeaks), "%s.tmp", peaksPath);
+	if(access(peaksPath, R_OK) == 0 && !(peaks = peaksOpen(outPeaks,
+			sfi.samplerate)))
+		printf("%s : can't create the peak index\n", outPeaks);
+
+	qsort(sf->stretch, sf->count, sizeof(Stretch), byFrom);
+
+	// Audio up to each stretch, then its silence.
+	unsigned long long pos = 0, silence = 0;
+	int i, err = 0;
+	for(i=0; i<sf->count && !err; i++) {
+		Stretch *s = &sf->stretch[i];
+		if(s->from < pos || s->to < s->from) {
+			printf("%s : bad stretch %llu-%llu in silence.txt\n", sf->name,
+					s->from, s->to);
+			err = 1;
+			break;
+		}
+		err = copy(in, out, peaks, s->from - pos);
+		unsigned long long n;
+		for(n = s->to - s->from; n && !err; ) {
+			sf_count_t m = n < COPY_FRAMES ? n : COPY_FRAMES;
+			err = put(out, peaks, zeros, m);
+			n -= m;
+		}
+		silence += s->to - s->from;
+		pos = s->to;
+	}
+	unsigned long long stored = pos - silence;
+	if(!err && stored <= sfi.frames)
+		err = copy(in, out, peaks, sfi.frames - stored);
+	else if(!err) {
+		printf("%s : silence.txt goes past the end of the file\n", sf->name);
+		err = 1;
+	}
+
+	sf_close(in);
+	if(peaks)
+		peaksClose(peaks);
+	if(sf_close(out) || err) {
+		if(!err)
+			printf("%s : write error\n", outPath);
+		unlink(outPath);
+		if(peaks)
+			unlink(outPeaks);
+		return -1;
+	}
+
+	if(!outDir) {
+		if(rename(outPath, path)) {
+			printf("%s : %s\n", path, strerror(errno));
+			return -1;
+		}
+		sf->expanded = 1;
+		if(peaks && rename(outPeaks, peaksPath)) {
+			printf("%s : %s\n", peaksPath, strerror(errno));
+			return -1;
+		}
+	}
+
+	printf("%s : %llu frames of silence put back\n", sf->name, silence);
+	return 0;
+}
+
+
+/**
+ * Rewrite silence.txt without the lines of the files expanded in place, so
+ * that running mrexpand again only expands the others.
+ */
+static int dropExpanded(const char *path, SparseFile *files, int count)
+{
+	char tmpPath[4200], line[1024];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	FILE *in = fopen(path, "r");
+	FILE *out = in ? fopen(tmpPath, "w") : NULL;
+	if(!out) {
+		printf("%s : %s\n", in ? tmpPath : path, strerror(errno));
+		if(in)
+			fclose(in);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), in)) {
+		char name[256];
+		int i = count;
+		if(sscanf(line, "%255s", name) == 1)
+			for(i=0; i<count && strcmp(files[i].name, name); i++)
+				;
+		if(i == count || !files[i].expanded)
+			fputs(line, out);
+	}
+	fclose(in);
+	if(fclose(out) || rename(tmpPath, path)) {
+		printf("%s : %s\n", path, strerror(errno));
+		unlink(tmpPath);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Expand all the sparse files of a take.
+ */
+static int expandTake(const char *dir)
+{
+	char path[4096], line[1024];
+	snprintf(path, sizeof(path), "%s/silence.txt", dir);
+	FILE *f = fopen(path, "r");
+	if(!f) {
+		printf("%s : no silence.txt, nothing to expand\n", dir);
+		return 0;
+	}
+
+	SparseFile *files = NULL;
+	int count = 0, i;
+	while(fgets(line, sizeof(line), f)) {
+		char name[256];
+		Stretch s;
+		if(sscanf(line, "%255s %llu %llu", name, &s.from, &s.to) != 3)
+			continue;
+
+		for(i=0; i<count && strcmp(files[i].name, name); i++)
+			;
+		if(i == count) {
+			files = realloc(files, ++count * sizeof(SparseFile));
+			memset(&files[i], 0, sizeof(SparseFile));
+			strcpy(files[i].name, name);
+		}
+		SparseFile *sf = &files[i];
+		if(sf->count == sf->size) {
+			sf->size = sf->size ? 2 * sf->size : 64;
+			sf->stretch = realloc(sf->stretch, sf->size * sizeof(Stretch));
+		}
+		sf->stretch[sf->count++] = s;
+	}
+	fclose(f);
+
+	int rv = 0, expanded = 0;
+	for(i=0; i<count; i++) {
+		if(expandFile(dir, &files[i]))
+			rv = -1;
+		expanded += files[i].expanded;
+	}
+
+	// All in place: the take isn't sparse anymore. Some: only the others are.
+	if(!rv && !outDir)
+		unlink(path);
+	else if(expanded && dropExpanded(path, files, count))
+		rv = -1;
+
+	for(i=0; i<count; i++)
+		free(files[i].stretch);
+	free(files);
+	return rv;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int opt, i, rv = 0;
+
+	while((opt = getopt(argc, argv, "o:")) != -1) {
+		switch(opt) {
+		case 'o': outDir = optarg; break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if(optind >= argc || (outDir && optind != argc - 1)) {
+		printf("Usage: mrexpand [-o out-dir] <take-dir> ...\n");
+		return -1;
+	}
+
+	if(outDir && mkdir(outDir, 0777) && errno != EEXIST) {
+		printf("%s : %s\n", outDir, strerror(errno));
+		return -1;
+	}
+
+	for(i=optind; i<argc; i++)
+		if(expandTake(argv[i]))
+			rv = -1;
+
+	return rv;
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * mrfix.c
+ * Repairs the .wav files of a take that was never finalized (i.e. multirec
+ * died before closing its output files). The audio data is all there, up to
+ * the last fdatasync(), but the size fields in the RIFF / RF64 header may be
+ * stale: this tool makes them match the actual file size.
+ *
+ * Usage: mrfix [-n] <file.wav | take-dir> ...
+ *   -n : dry run, only report what would be fixed.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+static int dryRun = 0;
+
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t)get32(p+4) << 32);
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v>>8; p[2] = v>>16; p[3] = v>>24;
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, (uint32_t)v);
+	put32(p+4, (uint32_t)(v>>32));
+}
+
+
+static int readAt(int fd, off_t off, void *buf, size_t len)
+{
+	return pread(fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+static int writeAt(int fd, off_t off, const void *buf, size_t len)
+{
+	return pwrite(fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+
+/**
+ * Check and repair a single file.
+ * Returns 0 if the file is fine or has been fixed, -1 on error.
+ */
+static int fixFile(const char *fname)
+{
+	int fd = open(fname, dryRun ? O_RDONLY : O_RDWR);
+	if(fd < 0) {
+		printf("%s : %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	uint64_t fileSize = st.st_size;
+
+	unsigned char hdr[12];
+	if(readAt(fd, 0, hdr, 12) || memcmp(hdr+8, "WAVE", 4) ||
+			(memcmp(hdr, "RIFF", 4) && memcmp(hdr, "RF64", 4))) {
+		printf("%s : not a WAV file\n", fname);
+		close(fd);
+		return -1;
+	}
+	int rf64 = (memcmp(hdr, "RF64", 4) == 0);
+
+	// Walk the chunks up to the "data" one. Everything after its header is
+	// taken as audio data.
+	off_t pos = 12, ds64Pos = 0;
+	unsigned int blockAlign = 0;
+	uint64_t hdrDataSize = 0;
+	unsigned char ck[8];
+	while(1) {
+		if(readAt(fd, pos, ck, 8)) {
+			printf("%s : no data chunk found\n", fname);
+			close(fd);
+			return -1;
+		}
+		uint32_t ckSize = get32(ck+4);
+
+		if(memcmp(ck, "ds64", 4) == 0) {
+			ds64Pos = pos;
+		} else if(memcmp(ck, "fmt ", 4) == 0) {
+			unsigned char fmt[16];
+			if(readAt(fd, pos+8, fmt, 16) == 0)
+				blockAlign = fmt[12] | (fmt[13]<<8);
+		} else if(memcmp(ck, "data", 4) == 0) {
+			hdrDataSize = ckSize;
+			break;
+		}
+
+		pos += 8 + ckSize + (ckSize & 1);
+	}
+	off_t dataPos = pos;
+	uint64_t dataStart = dataPos + 8;
+
+	uint64_t riffSize = get32(hdr+4);
+	unsigned char ds64[24];
+	if(rf64) {
+		if(!ds64Pos || readAt(fd, ds64Pos+8, ds64, 24)) {
+			printf("%s : RF64 file without ds64 chunk\n", fname);
+			close(fd);
+			return -1;
+		}
+		riffSize = get64(ds64);
+		hdrDataSize = get64(ds64+8);
+	}
+
+	// Actual amount of audio data, rounded down to a whole frame.
+	uint64_t dataSize = fileSize > dataStart ? fileSize - dataStart : 0;
+	if(blockAlign)
+		dataSize -= dataSize % blockAlign;
+
+	if(riffSize == fileSize-8 && hdrDataSize <= fileSize - dataStart) {
+		printf("%s : ok\n", fname);
+		close(fd);
+		return 0;
+	}
+
+	printf("%s : header says %llu data bytes, found %llu%s\n", fname,
+			(unsigned long long)hdrDataSize, (unsigned long long)dataSize,
+			dryRun ? "" : ", fixing");
+	if(dryRun) {
+		close(fd);
+		return 0;
+	}
+
+	uint64_t newRiffSize = dataStart + dataSize - 8;
+	int err = 0;
+	if(rf64) {
+		put64(ds64, newRiffSize);
+		put64(ds64+8, dataSize);
+		if(blockAlign)
+			put64(ds64+16, dataSize / blockAlign);
+		err = writeAt(fd, ds64Pos+8, ds64, 24);
+	} else {
+		if(newRiffSize > 0xFFFFFFFFULL) {
+			printf("%s : too large for a RIFF header, needs RF64\n", fname);
+			close(fd);
+			return -1;
+		}
+		put32(hdr+4, (uint32_t)newRiffSize);
+		put32(ck+4, (uint32_t)dataSize);
+		err = writeAt(fd, 0, hdr, 12) || writeAt(fd, dataPos, ck, 8);
+	}
+
+	// Drop a trailing partial frame, if any.
+	if(!err && fileSize != dataStart + dataSize)
+		err = ftruncate(fd, dataStart + dataSize);
+
+	if(err || fdatasync(fd)) {
+		printf("%s : write error: %s\n", fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+
+static int wavFilter(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+	return len > 4 && strcmp(d->d_name + len - 4, ".wav") == 0;
+}
+
+
+/**
+ * Repair all the .wav files found in a take directory.
+ */
+static int fixDir(const char *dir)
+{
+	struct dirent **namelist;
+	int n = scandir(dir, &namelist, wavFilter, alphasort);
+	if(n < 0) {
+		printf("%s : %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	int i, rv = 0;
+	char path[4096];
+	for(i=0; i<n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, namelist[i]->d_name);
+		if(fixFile(path))
+			rv = -1;
+		free(namelist[i]);
+	}
+	free(namelist);
+	return rv;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int i, rv = 0;
+
+	if(argc > 1 && strcmp(argv[1], "-n") == 0) {
+		dryRun = 1;
+		argv++;
+		argc--;
+	}
+
+	if(argc < 2) {
+		printf("Usage: mrfix [-n] <file.wav | take-dir> ...\n");
+		return -1;
+	}
+
+	for(i=1; i<argc; i++) {
+		struct stat st;
+		if(stat(argv[i], &st)) {
+			printf("%s : %s\n", argv[i], strerror(errno));
+			rv = -1;
+		} else if(S_ISDIR(st.st_mode)) {
+			if(fixDir(argv[i]))
+				rv = -1;
+		} else if(fixFile(argv[i])) {
+			rv = -1;
+		}
+	}
+
+	return rv;
+}
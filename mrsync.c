@@ -0,0 +1,612 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * mrsync.c
+ * Measures how well the channels of a take stay in sync. Record the same
+ * signal (e.g. a click track) on every card, then run this on the take dir:
+ * every channel is cross-correlated against the reference, one window every
+ * few seconds, which gives its offset (in samples, with sub-sample precision)
+ * along the take. A straight line fitted through the offsets gives the
+ * residual drift in ppm; what the line doesn't explain is the jitter of the
+ * drift correction.
+ *
+ * Usage: mrsync [options] <take-dir>
+ *   -r ref   : reference, a channel name (default "a") or a .wav file
+ *   -w n     : window length, in samples (a power of 2, default 65536)
+ *   -h s     : seconds between windows (default 10)
+ *   -l n     : largest offset searched, in samples (default 2000). With
+ *              periodic clicks, keep it under half the click period.
+ *   -j n     : threads (default: one per CPU)
+ *   -o file  : write all the measured offsets there, as CSV
+ *   -M n     : fail if any offset exceeds n samples
+ *   -P ppm   : fail if any residual drift exceeds ppm
+ *   -c file  : calibration: add the mean offset of each card (the mean of
+ *              its channels) to the latency in file, for multirec to make
+ *              up for it (see the calibration option). The file is created
+ *              if missing; measure a take recorded with the calibration
+ *              already applied, and the residual offsets refine it.
+ *
+ * Segmented takes (c-SSS.wav) are read as one stream per channel, and takes
+ * spread over several volumes are found through their manifest.txt.
+ * The exit status is 1 if a -M / -P limit was exceeded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <complex.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sndfile.h>
+
+
+#define MAX_CHANNELS 64
+
+/** Channels per card, named in order: card 0 has a and b, card 1 c and d... */
+#define CARD_CHANNELS 2
+#define MAX_CARDS (26 / CARD_CHANNELS)
+#define MAX_SEGMENTS 1000
+
+/** Windows correlating less than this with the reference are skipped */
+#define MIN_SCORE 0.3
+
+
+typedef struct Channel_s {
+	char name[16];
+	char *path[MAX_SEGMENTS];
+	sf_count_t frames[MAX_SEGMENTS];
+	int segCount;
+	sf_count_t length;
+	int rate;
+} Channel;
+
+/** Result of the correlation of one window */
+typedef struct Window_s {
+	double time;      // seconds from the start of the take
+	double offset;    // samples the channel is late on the reference
+	double score;     // normalized correlation peak, 1 = identical
+	int valid;
+} Window;
+
+
+static Channel *channels[MAX_CHANNELS];
+static int chanCount = 0;
+static Channel *ref = NULL;
+
+static unsigned int winLen = 65536;
+static double hopSecs = 10;
+static int maxLag = 2000;
+static int threadCount = 0;
+
+/** Mean offset of each card, for -c */
+static double cardOffset[MAX_CARDS];
+static int cardChannels[MAX_CARDS];
+
+static int winCount;
+static Window *results;          // chanCount * winCount
+static volatile int nextJob = 0;
+
+
+// *** Input ***
+
+static Channel *findChannel(const char *name)
+{
+	int i;
+	for(i=0; i<chanCount; i++)
+		if(strcmp(channels[i]->name, name) == 0)
+			return channels[i];
+
+	if(chanCount == MAX_CHANNELS)
+		return NULL;
+	Channel *c = calloc(1, sizeof(Channel));
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	channels[chanCount++] = c;
+	return c;
+}
+
+
+/**
+ * Add a file to its channel. "c.wav" is the whole channel c, "c-SSS.wav" its
+ * segment SSS.
+ */
+static void addFile(const char *fname, const char *path)
+{
+	char name[16];
+	int seg = 0;
+	size_t len = strcspn(fname, "-.");
+	if(len == 0 || len >= sizeof(name))
+		return;
+	memcpy(name, fname, len);
+	name[len] = '\0';
+	if(fname[len] == '-')
+		seg = atoi(fname + len + 1) - 1;
+	if(seg < 0 || seg >= MAX_SEGMENTS)
+		return;
+
+	Channel *c = findChannel(name);
+	if(!c || c->path[seg])
+		return;
+	c->path[seg] = strdup(path);
+	if(seg >= c->segCount)
+		c->segCount = seg + 1;
+}
+
+
+static int wavFilter(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+	return len > 4 && strcmp(d->d_name + len - 4, ".wav") == 0;
+}
+
+
+/**
+ * Find the channels of a take: from its manifest if it has one, otherwise
+ * from the .wav files in its dir.
+ */
+static int scanTake(const char *dir)
+{
+	char path[4096], line[4096];
+	snprintf(path, sizeof(path), "%s/manifest.txt", dir);
+	FILE *f = fopen(path, "r");
+	if(f) {
+		while(fgets(line, sizeof(line), f)) {
+			char *name = strtok(line, "\t\r\n");
+			char *file = strtok(NULL, "\t\r\n");
+			if(!name || !file)
+				continue;
+			// Paths are relative to where multirec ran: if that's not here,
+			// look for the file next to the manifest.
+			if(access(file, R_OK) == 0)
+				addFile(name, file);
+			else {
+				snprintf(path, sizeof(path), "%s/%s", dir, name);
+				addFile(name, path);
+			}
+		}
+		fclose(f);
+		return 0;
+	}
+
+	struct dirent **namelist;
+	int n = scandir(dir, &namelist, wavFilter, alphasort);
+	if(n < 0) {
+		printf("%s : %s\n", dir, strerror(errno));
+		return -1;
+	}
+	int i;
+	for(i=0; i<n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, namelist[i]->d_name);
+		addFile(namelist[i]->d_name, path);
+		free(namelist[i]);
+	}
+	free(namelist);
+	return 0;
+}
+
+
+/**
+ * Check the segments of a channel, and get its length.
+ */
+static int openChannel(Channel *c)
+{
+	int i;
+	for(i=0; i<c->segCount; i++) {
+		if(!c->path[i]) {
+			printf("%s : segment %d is missing\n", c->name, i+1);
+			return -1;
+		}
+		SF_INFO sfi;
+		memset(&sfi, 0, sizeof(sfi));
+		SNDFILE *f = sf_open(c->path[i], SFM_READ, &sfi);
+		if(!f) {
+			printf("%s : %s\n", c->path[i], sf_strerror(NULL));
+			return -1;
+		}
+		sf_close(f);
+		if(c->rate && c->rate != sfi.samplerate) {
+			printf("%s : sample rate changes across segments\n", c->name);
+			return -1;
+		}
+		c->rate = sfi.samplerate;
+		c->frames[i] = sfi.frames;
+		c->length += sfi.frames;
+	}
+	return 0;
+}
+
+
+/**
+ * Read n samples of a channel from the specified position, across segments.
+ * Multichannel files give their first channel. Missing samples read as 0.
+ */
+static void readChannel(Channel *c, sf_count_t pos, double *out, int n)
+{
+	memset(out, 0, n * sizeof(double));
+	sf_count_t segStart = 0;
+	int i;
+	for(i=0; i<c->segCount && n > 0; segStart += c->frames[i], i++) {
+		if(pos >= segStart + c->frames[i])
+			continue;
+
+		SF_INFO sfi;
+		memset(&sfi, 0, sizeof(sfi));
+		SNDFILE *f = sf_open(c->path[i], SFM_READ, &sfi);
+		if(!f)
+			return;
+		sf_count_t off = pos - segStart;
+		sf_count_t len = c->frames[i] - off;
+		if(len > n)
+			len = n;
+		double *buf = malloc(len * sfi.channels * sizeof(double));
+		sf_seek(f, off, SEEK_SET);
+		len = sf_readf_double(f, buf, len);
+		sf_close(f);
+
+		sf_count_t k;
+		for(k=0; k<len; k++)
+			out[k] = buf[k * sfi.channels];
+		free(buf);
+
+		out += len;
+		pos += len;
+		n -= len;
+	}
+}
+
+
+// *** Cross-correlation ***
+
+/**
+ * In-place radix-2 FFT. n must be a power of 2; inverse if sign > 0
+ * (unscaled).
+ */
+static void fft(double complex *x, int n, int sign)
+{
+	int i, j, len;
+	for(i=1, j=0; i<n; i++) {
+		int bit = n >> 1;
+		for(; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if(i < j) {
+			double complex t = x[i];
+			x[i] = x[j];
+			x[j] = t;
+		}
+	}
+
+	for(len=2; len<=n; len<<=1) {
+		double complex w = cexp(sign * 2 * M_PI * I / len);
+		for(i=0; i<n; i+=len) {
+			double complex wk = 1;
+			for(j=0; j<len/2; j++) {
+				double complex u = x[i+j], v = x[i+j+len/2] * wk;
+				x[i+j] = u + v;
+				x[i+j+len/2] = u - v;
+				wk *= w;
+			}
+		}
+	}
+}
+
+
+/**
+ * Correlate one window of a channel against the reference.
+ */
+static void correlate(Channel *c, Window *w, double *a, double *b,
+		double complex *fa, double complex *fb)
+{
+	sf_count_t pos = (sf_count_t)(w->time * ref->rate);
+	int i, n = 2 * winLen;
+
+	readChannel(ref, pos, a, winLen);
+	readChannel(c, pos, b, winLen);
+
+	double ea = 0, eb = 0;
+	for(i=0; i<winLen; i++) {
+		ea += a[i] * a[i];
+		eb += b[i] * b[i];
+		fa[i] = a[i];
+		fb[i] = b[i];
+	}
+	w->valid = 0;
+	if(ea == 0 || eb == 0)
+		return;
+
+	// Zero padding to twice the window: the correlation is then linear.
+	for(i=winLen; i<n; i++)
+		fa[i] = fb[i] = 0;
+	fft(fa, n, -1);
+	fft(fb, n, -1);
+	for(i=0; i<n; i++)
+		fa[i] = conj(fa[i]) * fb[i];
+	fft(fa, n, 1);
+
+	// fa[k] is now sum(ref[t] * chan[t+k]): its peak is the channel delay.
+	int best = 0, k;
+	for(k=-maxLag; k<=maxLag; k++)
+		if(creal(fa[(k+n)%n]) > creal(fa[(best+n)%n]))
+			best = k;
+
+	double y0 = creal(fa[(best-1+n)%n]), y1 = creal(fa[(best+n)%n]),
+			y2 = creal(fa[(best+1+n)%n]);
+	double d = y0 - 2*y1 + y2;
+
+	// Sub-sample peak, by fitting a parabola through its neighbours.
+	w->offset = best + (d < 0 ? 0.5 * (y0 - y2) / d : 0);
+	w->score = y1 / n / sqrt(ea * eb);
+	w->valid = w->score >= MIN_SCORE;
+}
+
+
+/**
+ * Worker thread code: correlate windows until none is left. Jobs are handed
+ * out window by window, all channels interleaved.
+ */
+static void *worker(void *arg)
+{
+	int n = 2 * winLen;
+	double *a = malloc(winLen * sizeof(double));
+	double *b = malloc(winLen * sizeof(double));
+	double complex *fa = malloc(n * sizeof(double complex));
+	double complex *fb = malloc(n * sizeof(double complex));
+
+	int job;
+	while((job = __sync_fetch_and_add(&nextJob, 1)) < chanCount * winCount) {
+		Channel *c = channels[job % chanCount];
+		if(c != ref)
+			correlate(c, &results[job % chanCount * winCount
+					+ job / chanCount], a, b, fa, fb);
+	}
+
+	free(a);
+	free(b);
+	free(fa);
+	free(fb);
+	return NULL;
+}
+
+
+// *** Report ***
+
+static int compareChannels(const void *a, const void *b)
+{
+	return strcmp((*(Channel**)a)->name, (*(Channel**)b)->name);
+}
+
+
+/**
+ * Add the measured card offsets to the latencies in a calibration file. Cards
+ * not measured keep their latency.
+ */
+static int writeCalibration(const char *fname, const char *take)
+{
+	double latency[MAX_CARDS];
+	int known[MAX_CARDS];
+	memset(known, 0, sizeof(known));
+
+	char line[1024];
+	FILE *f = fopen(fname, "r");
+	if(f) {
+		while(fgets(line, sizeof(line), f) != NULL) {
+			int card;
+			double offset;
+			if(line[0] != '#' && sscanf(line, "%d %lf", &card, &offset) == 2
+					&& card >= 0 && card < MAX_CARDS) {
+				latency[card] = offset;
+				known[card] = 1;
+			}
+		}
+		fclose(f);
+	}
+
+	int i;
+	printf("\ncard  offset (smp)  latency (smp)\n");
+	for(i=0; i<MAX_CARDS; i++) {
+		if(!cardChannels[i])
+			continue;
+		double offset = cardOffset[i] / cardChannels[i];
+		if(!known[i])
+			latency[i] = 0;
+		latency[i] += offset;
+		known[i] = 1;
+		printf("%-5d %12.3f  %13.3f\n", i, offset, latency[i]);
+	}
+
+	f = fopen(fname, "w");
+	if(!f) {
+		printf("Can't write %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "# card\tlatency (samples late), measured by mrsync on %s\n",
+			take);
+	for(i=0; i<MAX_CARDS; i++)
+		if(known[i])
+			fprintf(f, "%d\t%.3f\n", i, latency[i]);
+	fclose(f);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *refName = "a", *csvFile = NULL, *calFile = NULL;
+	double maxOffset = 0, maxPpm = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "r:w:h:l:j:o:M:P:c:")) != -1) {
+		switch(opt) {
+		case 'r': refName = optarg; break;
+		case 'w': winLen = atoi(optarg); break;
+		case 'h': hopSecs = atof(optarg); break;
+		case 'l': maxLag = atoi(optarg); break;
+		case 'j': threadCount = atoi(optarg); break;
+		case 'o': csvFile = optarg; break;
+		case 'M': maxOffset = atof(optarg); break;
+		case 'P': maxPpm = atof(optarg); break;
+		case 'c': calFile = optarg; break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if(optind != argc - 1 || winLen < 64 || (winLen & (winLen - 1))
+			|| maxLag < 1 || maxLag >= winLen || hopSecs <= 0) {
+		printf("Usage: mrsync [-r ref] [-w window] [-h hop s] [-l max lag] "
+				"[-j threads] [-o offsets.csv] [-M max samples] [-P max ppm] "
+				"[-c calibration] <take-dir>\n");
+		return -1;
+	}
+
+	if(scanTake(argv[optind]))
+		return -1;
+	qsort(channels, chanCount, sizeof(Channel*), compareChannels);
+
+	int i, k;
+	for(i=0; i<chanCount; i++)
+		if(openChannel(channels[i]))
+			return -1;
+
+	size_t len = strlen(refName);
+	if(len > 4 && strcmp(refName + len - 4, ".wav") == 0) {
+		ref = calloc(1, sizeof(Channel));
+		snprintf(ref->name, sizeof(ref->name), "ref");
+		ref->path[0] = strdup(refName);
+		ref->segCount = 1;
+		if(openChannel(ref))
+			return -1;
+	} else {
+		for(i=0; i<chanCount; i++)
+			if(strcmp(channels[i]->name, refName) == 0)
+				ref = channels[i];
+		if(!ref) {
+			printf("No channel %s in %s\n", refName, argv[optind]);
+			return -1;
+		}
+	}
+	if(chanCount < 1 || ref->length < winLen) {
+		printf("Nothing to compare.\n");
+		return -1;
+	}
+
+	// *** Correlate every channel, window by window, in parallel ***
+	winCount = (ref->length - winLen) / (hopSecs * ref->rate) + 1;
+	results = calloc(chanCount * winCount, sizeof(Window));
+	for(i=0; i<chanCount; i++)
+		for(k=0; k<winCount; k++)
+			results[i * winCount + k].time = k * hopSecs;
+
+	if(threadCount < 1)
+		threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threadCount < 1)
+		threadCount = 1;
+	pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+	for(i=0; i<threadCount; i++)
+		if(pthread_create(&threads[i], NULL, worker, NULL)) {
+			printf("error creating thread.");
+			return -1;
+		}
+	for(i=0; i<threadCount; i++)
+		pthread_join(threads[i], NULL);
+
+	// *** Fit a line through the offsets of each channel ***
+	FILE *csv = csvFile ? fopen(csvFile, "w") : NULL;
+	if(csv)
+		fprintf(csv, "channel,time_s,offset_samples,score\n");
+
+	printf("reference %s, %d windows of %u samples, every %g s\n\n",
+			ref->name, winCount, winLen, hopSecs);
+	printf("chan  windows  offset (smp)  drift (ppm)  resid rms  resid max\n");
+
+	int failed = 0;
+	for(i=0; i<chanCount; i++) {
+		Channel *c = channels[i];
+		int card = c->name[1] ? -1 : (c->name[0] - 'a') / CARD_CHANNELS;
+		if(card < 0 || card >= MAX_CARDS)
+			card = -1;
+
+		// The reference is 0 samples off itself.
+		if(c == ref) {
+			if(card >= 0)
+				cardChannels[card]++;
+			continue;
+		}
+
+		Window *w = &results[i * winCount];
+		double n = 0, st = 0, so = 0, stt = 0, sto = 0, worst = 0;
+		for(k=0; k<winCount; k++) {
+			if(csv && w[k].valid)
+				fprintf(csv, "%s,%.3f,%.4f,%.3f\n", c->name, w[k].time,
+						w[k].offset, w[k].score);
+			if(!w[k].valid)
+				continue;
+			n++;
+			st += w[k].time;
+			so += w[k].offset;
+			stt += w[k].time * w[k].time;
+			sto += w[k].time * w[k].offset;
+			if(fabs(w[k].offset) > fabs(worst))
+				worst = w[k].offset;
+		}
+		if(n == 0) {
+			printf("%-5s no window matches the reference\n", c->name);
+			failed = 1;
+			continue;
+		}
+
+		// offset = a + b * time, least squares
+		double den = n * stt - st * st;
+		double b = den > 0 ? (n * sto - st * so) / den : 0;
+		double a = (so - b * st) / n;
+		double rms = 0, rmax = 0;
+		for(k=0; k<winCount; k++) {
+			if(!w[k].valid)
+				continue;
+			double r = w[k].offset - (a + b * w[k].time);
+			rms += r * r;
+			if(fabs(r) > rmax)
+				rmax = fabs(r);
+		}
+		rms = sqrt(rms / n);
+		double ppm = b / ref->rate * 1e6;
+
+		int bad = (maxOffset && fabs(worst) > maxOffset)
+				|| (maxPpm && fabs(ppm) > maxPpm);
+		printf("%-5s %7.0f  %12.3f  %11.4f  %9.3f  %9.3f%s\n", c->name, n,
+				so / n, ppm, rms, rmax, bad ? "  FAILED" : "");
+		failed |= bad;
+
+		if(card >= 0) {
+			cardOffset[card] += so / n;
+			cardChannels[card]++;
+		}
+	}
+
+	if(calFile && writeCalibration(calFile, argv[optind]))
+		failed = 1;
+
+	if(csv)
+		fclose(csv);
+	return failed;
+}
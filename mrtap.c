@@ -0,0 +1,229 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * mrtap.c
+ * Reads the live tap of a running multirec (see the tap option), and writes
+ * the synchronized frames of some channels to stdout, as interleaved 16 bit
+ * samples, e.g.
+ *
+ *   mrtap -c ab | aplay -t raw -f S16_LE -c 2 -r 48000
+ *
+ * It starts at the newest frame. Frames lost to a slow reader are written as
+ * silence, so the output stays on the timeline of the takes, and counted on
+ * stderr at the end. It stops when multirec exits, or stops publishing for
+ * a while (it died). It's also the reference reader of the protocol in tap.h.
+ *
+ * Usage: mrtap [-n name] [-c channels] [-s seconds]
+ *   -n name     : shared memory object (default /multirec)
+ *   -c channels : channels to read, e.g. "acd" (default: all)
+ *   -s seconds  : stop after this much audio (default: until multirec exits)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tap.h"
+
+
+/** Frames written per fwrite() */
+#define OUT_FRAMES 4096
+
+
+static const char *name = "/multirec";
+static const char *chanNames = NULL;
+static double seconds = 0;
+
+static MRTapHeader *tap;
+static const int16_t *ring;
+static int chans[TAP_MAX_CHANNELS];
+static int chanCount;
+
+static int16_t out[OUT_FRAMES * TAP_MAX_CHANNELS];
+
+
+/**
+ * Consistent snapshot of the header (step 1 of the protocol).
+ */
+static void snapshot(uint64_t *head, uint32_t *live, int64_t *ts)
+{
+	while(1) {
+		uint64_t seq = tap->seq;
+		__sync_synchronize();
+		if(seq & 1) {
+			sched_yield();
+			continue;
+		}
+		*head = tap->head;
+		*live = tap->live;
+		*ts = tap->ts;
+		__sync_synchronize();
+		if(tap->seq == seq)
+			return;
+	}
+}
+
+
+/**
+ * Whether the writer stopped publishing without clearing live (see tap.h).
+ */
+static int stale(int64_t ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t age = now.tv_sec * 1000000000LL + now.tv_nsec - ts;
+	return age > TAP_STALE_MS * 1000000LL
+			+ TAP_STALE_BLOCKS * 1000000000LL * tap->block / tap->rate;
+}
+
+
+/**
+ * Oldest frame which can't be being overwritten, for a given head (step 2).
+ */
+static uint64_t oldestSafe(uint64_t head)
+{
+	uint64_t margin = tap->frames - tap->block;
+	return head > margin ? head - margin : 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "n:c:s:")) != -1) {
+		switch(opt) {
+		case 'n': name = optarg; break;
+		case 'c': chanNames = optarg; break;
+		case 's': seconds = atof(optarg); break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if(optind != argc) {
+		printf("Usage: mrtap [-n name] [-c channels] [-s seconds]\n");
+		return -1;
+	}
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s : %s\n", name, strerror(errno));
+		return -1;
+	}
+	tap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(tap == MAP_FAILED) {
+		fprintf(stderr, "%s : %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	// Just created: wait for the header.
+	while(memcmp(tap->magic, TAP_MAGIC, sizeof(tap->magic)))
+		usleep(10000);
+	__sync_synchronize();
+	ring = (const int16_t*) ((const char*) tap + tap->offset);
+
+	if(!chanNames)
+		for(chanCount=0; chanCount<tap->channels
+				&& chanCount<TAP_MAX_CHANNELS; chanCount++)
+			chans[chanCount] = chanCount;
+	else
+		for(chanCount=0; chanNames[chanCount]; chanCount++) {
+			int c = chanNames[chanCount] - 'a';
+			if(chanCount == TAP_MAX_CHANNELS || c < 0
+					|| c >= tap->channels) {
+				fprintf(stderr, "%s : no channel %c (%u channels)\n", name,
+						chanNames[chanCount], tap->channels);
+				return -1;
+			}
+			chans[chanCount] = c;
+		}
+
+	fprintf(stderr, "%s : %u Hz, %u channels, %u frames\n", name, tap->rate,
+			tap->channels, tap->frames);
+
+	uint64_t head, pos, lost = 0, left = seconds * tap->rate;
+	uint32_t live;
+	int64_t ts;
+	snapshot(&pos, &live, &ts);
+
+	while(!seconds || left) {
+		snapshot(&head, &live, &ts);
+		if(pos >= head) {
+			if(!live)
+				break;
+			if(stale(ts)) {
+				fprintf(stderr, "%s : stale, multirec is gone\n", name);
+				break;
+			}
+			usleep(1000);
+			continue;
+		}
+
+		uint64_t n = head - pos, f;
+		if(n > OUT_FRAMES)
+			n = OUT_FRAMES;
+		if(seconds && n > left)
+			n = left;
+
+		// Too slow: the frames wanted are being overwritten.
+		uint64_t oldest = oldestSafe(head);
+		int gone = pos < oldest;
+		if(gone) {
+			if(n > oldest - pos)
+				n = oldest - pos;
+			memset(out, 0, n * chanCount * sizeof(int16_t));
+			lost += n;
+		} else
+			for(f=0; f<n; f++)
+				for(i=0; i<chanCount; i++)
+					out[f * chanCount + i] = ring[(size_t) chans[i]
+							* tap->frames + (pos + f) % tap->frames];
+
+		// Overwritten while being copied.
+		__sync_synchronize();
+		oldest = oldestSafe(tap->head);
+		if(!gone && pos < oldest) {
+			uint64_t torn = oldest - pos < n ? oldest - pos : n;
+			memset(out, 0, torn * chanCount * sizeof(int16_t));
+			lost += torn;
+		}
+
+		if(fwrite(out, sizeof(int16_t) * chanCount, n, stdout) != n)
+			break;
+		pos += n;
+		if(seconds)
+			left -= n;
+	}
+
+	if(lost)
+		fprintf(stderr, "%s : %llu frames lost\n", name,
+				(unsigned long long) lost);
+	return 0;
+}
@@ -24,16 +24,28 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <pthread.h>
 #include <dirent.h>
 #include <sched.h>
+#include <math.h>
 #include <alsa/asoundlib.h>
 
 #include "multirec.h"
 #include "main.h"
 #include "worker.h"
+#include "volume.h"
+#include "calibration.h"
+#include "dsp.h"
+#include "proxy.h"
+#include "tap.h"
+#include "fault.h"
+#include "trace.h"
+#include "control.h"
+#include "log.h"
 
 
 // *** Global vars ***
@@ -48,12 +60,14 @@ unsigned int CPMillis = 0; // MUST be set to nonzero!
 /** Name of the track being recorded. */
 const char *trackName;
 
+/** Current state of the recorder */
+States volatile state;
+
 
 MRDevice **devices;  /** Array of active devices, read from .rc file */
 size_t devCount;	     /** Number of active devices */
 
-
-static MRFrame tmpBuf[BSIZ]; /** Temporary alsa buffer */
+volatile int masterIdx = 0;
 
 
 /** Sample format */
@@ -61,18 +75,114 @@ snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
 
 unsigned int rate = 48000;   /** Stream rate */
 
+/**
+ * Rate of the takes. The drift correction of the slaves converts to it in the
+ * same pass, and the master goes through the converter too. Zero (the default)
+ * records at the stream rate. From then on, the output timeline (frame counts
+ * of the rings, take boundaries, latencies) is in frames at this rate.
+ */
+unsigned int outRate = 0;
+
 snd_output_t *output = NULL;  /** Alsa logging output */
 
 
+/**
+ * Durability of the output files: every syncMillis milliseconds, or every
+ * syncKBytes KB of audio written (whichever comes first), the disk worker
+ * rewrites the WAV headers and flushes the data to disk. Zero disables the
+ * corresponding trigger. Both can be changed by "set" lines in multirec.rc.
+ */
+unsigned int syncMillis = 2000;
+unsigned int syncKBytes = 0;
+
+/**
+ * Milliseconds of audio captured before the start request that are
+ * prepended to the take. Zero disables the pre-roll.
+ */
+unsigned int prerollMillis = 0;
+
+/**
+ * File rollover: takes are cut into segments of segmentSecs seconds, or
+ * segmentMBytes MB per file, whichever is shorter. Zero disables the
+ * corresponding limit.
+ */
+unsigned int segmentSecs = 0;
+unsigned int segmentMBytes = 0;
+
+/** If nonzero, write a waveform peak index (.peaks file) along with each .wav */
+unsigned int writePeaks = 0;
+
+/**
+ * Master election: for electMillis milliseconds after capture starts, the
+ * clocks of all cards are rated, then the steadiest one becomes the master.
+ * Zero keeps the first card of the .rc file as the master.
+ */
+unsigned int electMillis = 3000;
+
+/**
+ * Signal-activated start: while monitoring, a take starts as soon as an armed
+ * channel peaks above -triggerDb dBFS (the option is in dB below full scale).
+ * After the take is stopped, the trigger arms again once every channel has
+ * stayed below for TRIGGER_REARM_MS. Zero disables it. Best used with a pre-roll, which the
+ * take gets as usual.
+ */
+unsigned int triggerDb = 0;
+
+/**
+ * Sparse storage: past the first silenceMillis milliseconds of a stretch
+ * where a channel stays below -silenceDb dBFS, the silence is left out of its
+ * file, and listed in the take's silence.txt instead (see addSilence()).
+ * Zero disables it.
+ */
+unsigned int silenceMillis = 0;
+unsigned int silenceDb = 60;
+
+
+/** Options that can be set from the .rc file, via "set <name> <value>" lines */
+typedef struct MROption_s {
+	const char *name;
+	unsigned int *value;
+} MROption;
+
+static MROption options[] = {
+	{ "sync_ms", &syncMillis },
+	{ "sync_kb", &syncKBytes },
+	{ "preroll_ms", &prerollMillis },
+	{ "segment_s", &segmentSecs },
+	{ "segment_mb", &segmentMBytes },
+	{ "peaks", &writePeaks },
+	{ "stats_ms", &statsMillis },
+	{ "log_level", &logLevel },
+	{ "trace_s", &traceSecs },
+	{ "elect_ms", &electMillis },
+	{ "trigger_db", &triggerDb },
+	{ "silence_ms", &silenceMillis },
+	{ "silence_db", &silenceDb },
+	{ "proxy", &proxyChannels },
+	{ "proxy_q", &proxyQuality },
+	{ "out_rate", &outRate },
+	{ "tap_ms", &tapMillis },
+	{ NULL, NULL }
+};
+
+
 /** Possible state machine events coming from the GUI */
 typedef enum {
 	REQ_NONE=0,
-	REQ_START,
-	REQ_STOP,
+	REQ_START,   // start a take
+	REQ_NEXT,    // end the current take and start the next one
+	REQ_STOP,    // end the current take
+	REQ_QUIT,    // end the current take and stop capturing
 } Requests;
 
-/** Current request coming from the GUI. This variable is shared among threads */
-Requests volatile request;
+/** Current request coming from the GUI. Guarded by stateMutex. */
+static Requests request;
+
+/** When the current request was made (rdtsc) */
+static unsigned long long requestTS;
+
+/** Dir of the take being recorded */
+static char takeDir[256];
 
 
 
@@ -82,12 +192,45 @@ Requests volatile request;
  */
 static pthread_t mainThread;
 
-/** pthreads barrier to start recording in sync */
-static pthread_barrier_t stateBarrier;
+/**
+ * Guards requests and state changes. The main thread sleeps on requestCond
+ * until a request comes; device threads sleep on stateCond while the state is
+ * SKIP, and answer state changes through ackCond.
+ */
+static pthread_mutex_t stateMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requestCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t stateCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ackCond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * How long the main thread waits for the device threads to follow a state
+ * change, before going on without the late ones.
+ */
+#define ACK_TIMEOUT_MS 2000
+
+/** Peak that starts a take (see triggerDb), 0 if disabled */
+static MR_SAMPLE triggerPeak = 0;
+
+/** Cleared when the trigger fires, set again when all channels are quiet */
+static volatile int triggerReady = 1;
+
+/** Quiet time that arms the trigger again */
+#define TRIGGER_REARM_MS 1000
+
+/** When a channel was last above the trigger level, while it wasn't armed */
+static volatile unsigned long long triggerLoudTS = 0;
+
+/** Longest sleep of the main thread between two looks at the trace dumps */
+#define MAIN_TICK_MS 100
+
+/** How often a card that went away is tried again */
+#define REOPEN_MS 1000
 
 /** pthreads mutex guarding access to master device data */
 static pthread_mutex_t masterMutex = PTHREAD_MUTEX_INITIALIZER;
 
+static int cardOpen(MRDevice *card);
+
 /** Global count of output frames for the master device. */
 static unsigned long long masterFrameCount = 0;
 
@@ -97,8 +240,39 @@ static snd_pcm_sframes_t masterDelay = 0;
 /** Timestamp (got from rdtsc) of the most recent read from the master device */
 static unsigned long long masterTS = 0;
 
+/** Device updating the master vars above (-1 = none yet) */
+static int masterOwner = -1;
+
+/**
+ * Set while the clocks are being rated for the master election. The samples
+ * are added within the masterMutex critical section, where it's cleared, so
+ * that no fit is read while a sample is going in.
+ */
+static volatile int electing = 0;
+
+/** A clock more than this far from nominal is broken: never the master */
+#define ELECT_MAX_PPM 1000
+
+/** A new master must be this much steadier than the current one */
+#define ELECT_MARGIN 0.8
+
 
-#include "logging.inc"
+
+/**
+ * Set the value of a named option. Unknown names are logged and ignored.
+ */
+static void setOption(const char *name, const char *value)
+{
+	MROption *o;
+	for(o=options; o->name; o++) {
+		if(strcmp(o->name, name)==0) {
+			*(o->value) = atoi(value);
+			log_debug("Option %s = %u\n", name, *(o->value));
+			return;
+		}
+	}
+	log_error("Unknown option in .rc file: %s\n", name);
+}
 
 
 /**
@@ -120,6 +294,41 @@ void readConfig()
 		char *s = strtok(line, delims);
 		if(!s)
 			continue;
+
+		// Global option line: "set <name> <value>". Output roots may be set
+		// more than once, one volume each.
+		if(strcmp(s, "set")==0) {
+			char *name = strtok(NULL, delims);
+			char *value = strtok(NULL, delims);
+			if(name && value && strcmp(name, "root")==0)
+				addVolume(value);
+			else if(name && value && strcmp(name, "faults")==0)
+				faultFile = strdup(value);
+			else if(name && value && strcmp(name, "control_socket")==0)
+				controlSocket = strdup(value);
+			else if(name && value && strcmp(name, "calibration")==0)
+				calibrationFile = strdup(value);
+			else if(name && value && strcmp(name, "tap")==0)
+				tapName = strdup(value);
+			else if(name && value)
+				setOption(name, value);
+			continue;
+		}
+
+		// Channel processing line: "chan <channel> <stages...>"
+		if(strcmp(s, "chan")==0) {
+			if(dspParse(strtok(NULL, "\r\n")) < 0)
+				finish(-1);
+			continue;
+		}
+
+		// Proxy mix line: "mix <channel> <left dB> [<right dB>]"
+		if(strcmp(s, "mix")==0) {
+			if(mixParse(strtok(NULL, "\r\n")) < 0)
+				finish(-1);
+			continue;
+		}
+
 		char *devName = calloc(1,strlen(s));
 		strcpy(devName, s);
 		
@@ -167,15 +376,60 @@ void readConfig()
  * RDTSC assembly instruction: basically returns a counter of CPU clock cycles
  * (...yes, it wraps around every few hours / days).
  */
-inline unsigned long long int rdtsc()
+unsigned long long int rdtsc()
 {
-	unsigned long long int x;
-	__asm__ volatile (".byte 0x0f, 0x31" : "=A" (x));
-	return x;
+	unsigned int lo, hi;
+	__asm__ volatile (".byte 0x0f, 0x31" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long int)hi << 32) | lo;
 }
 
 
 
+/**
+ * Start a take if an armed channel of the device went above the trigger
+ * level (see triggerDb), and the trigger is armed. A request already
+ * pending wins.
+ */
+static void checkTrigger(MRDevice *c)
+{
+	int ch, loud = 0;
+	for(ch=0; ch<MR_CHANNELS; ch++)
+		if(!(c->disarmed & 1<<ch) && c->peaks[ch] > triggerPeak)
+			loud = 1;
+	if(!loud)
+		return;
+	if(!triggerReady) {
+		triggerLoudTS = rdtsc();
+		return;
+	}
+
+	pthread_mutex_lock(&stateMutex);
+	if(triggerReady && request == REQ_NONE) {
+		triggerReady = 0;
+		request = REQ_START;
+		requestTS = rdtsc();
+		pthread_cond_signal(&requestCond);
+		log_error("dev %d : signal above -%u dBFS, take started\n", c->idx,
+				triggerDb);
+	}
+	pthread_mutex_unlock(&stateMutex);
+}
+
+
+/**
+ * Arm the trigger again, once all the armed channels have been below its
+ * level for a while.
+ */
+static void rearmTrigger()
+{
+	if(rdtsc() - triggerLoudTS
+			< (unsigned long long) TRIGGER_REARM_MS * CPMillis)
+		return;
+	triggerReady = 1;
+	log_debug("trigger armed\n");
+}
+
+
 void calcPeakLevels(MRDevice *c, MRFrame *ptr, snd_pcm_sframes_t actual)
 {
 	// Reset peaks
@@ -199,6 +453,9 @@ void calcPeakLevels(MRDevice *c, MRFrame *ptr, snd_pcm_sframes_t actual)
 
 	c->peaks[0] = maxL;
 	c->peaks[1] = maxR;
+
+	if(triggerPeak && state == MONITORING)
+		checkTrigger(c);
 }
 
 
@@ -211,8 +468,10 @@ int initSrc()
 	{
 		c = devices[i];
 
-		c->srcState = src_new(SRC_LINEAR, MR_CHANNELS, &errn);
-		if(c->srcState==NULL)
+		c->srcState = src_new(MR_SRC_TYPE, MR_CHANNELS, &errn);
+		if(c->srcState)
+			c->srcMono = src_new(MR_SRC_TYPE, 1, &errn);
+		if(c->srcState==NULL || c->srcMono==NULL)
 		{
 			printf("error: %d\n", errn);
 			return -1;
@@ -224,6 +483,8 @@ int initSrc()
 
 
 void commitChunk(MRDevice *c, MRAlsaChunk *cnk) {
+	unsigned long long tr = traceStart();
+
 	// Read complete. Hand the buffer to the worker
 	pthread_mutex_lock( &masterMutex ); // >> critical section
 	cnk->masterFrameCount = masterFrameCount;
@@ -231,10 +492,13 @@ void commitChunk(MRDevice *c, MRAlsaChunk *cnk) {
 	cnk->masterDelay = masterDelay;
 	pthread_mutex_unlock( &masterMutex ); //<< critical section
 
-	log_debug("  DBG---producing %d frames...\n", cnk->len);
+	log_debug("  DBG---producing %lu frames...\n", cnk->len);
+
+	cnk->commitTS = rdtsc();
 
 	prod_free(c->dualQueue);
 	c->partialBucket = NULL;
+	traceEnd("commitChunk", tr, "frames", cnk->len);
 
 	log_debug("  DBG---bucket produced ok\n");
 	log_debug("  DBG---(full buckets = %d,\n", prod_len(c->dualQueue));
@@ -242,38 +506,287 @@ void commitChunk(MRDevice *c, MRAlsaChunk *cnk) {
 }
 
 
+/**
+ * Add a sample to the clock fit of a device: right before a read, the card has
+ * captured all the frames read so far, plus the ones waiting in its buffer.
+ */
+static void clockSample(MRDevice *c, snd_pcm_sframes_t delay) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	double t = ts.tv_sec + ts.tv_nsec * 1e-9;
+
+	MRClockFit *f = &c->clock;
+	if (f->n == 0)
+		f->t0 = t;
+	t -= f->t0;
+	double frames = f->frames + delay;
+	f->n++;
+	f->st += t;
+	f->sf += frames;
+	f->stt += t * t;
+	f->stf += t * frames;
+	f->sff += frames * frames;
+}
+
+
+/**
+ * Rate the clock of a device from its fit: drift from the nominal rate (ppm),
+ * and jitter (rms distance from the fitted line, in microseconds). Jitter is
+ * left negative if there are too few samples.
+ */
+static void clockRate(MRDevice *c) {
+	MRClockFit *f = &c->clock;
+	f->jitter = -1;
+	if (f->n < 8)
+		return;
+
+	double sxx = f->stt - f->st * f->st / f->n;
+	double sxy = f->stf - f->st * f->sf / f->n;
+	double syy = f->sff - f->sf * f->sf / f->n;
+	if (sxx <= 0)
+		return;
+
+	double slope = sxy / sxx;
+	double sse = syy - sxy * slope;
+	f->ppm = (slope / rate - 1) * 1e6;
+	f->jitter = sqrt(sse > 0 ? sse / f->n : 0) / rate * 1e6;
+}
+
+
+/**
+ * Make c the master (called within the masterMutex critical section). The
+ * output timeline goes on with no jump: the new master's frame count picks up
+ * from the old one's, extrapolated to the time of this read.
+ */
+static void takeOver(MRDevice *c, MRAlsaChunk *cnk, snd_pcm_sframes_t len) {
+	if (masterOwner < 0) {
+		masterFrameCount += len;
+	} else {
+		long long tsDiff = ((cnk->ts / (long long) CPS)
+				- (masterTS / (long long) CPS));
+		long long pos = masterFrameCount + masterDelay + tsDiff - cnk->delay;
+		if (pos > (long long) masterFrameCount)
+			masterFrameCount = pos;
+		log_dev_error(c, "now the master, at frame %llu\n", masterFrameCount);
+	}
+	masterOwner = c->idx;
+}
+
+
+/**
+ * Pick a new master among the devices still there, the steadiest one first.
+ * Returns -1 if there is none.
+ */
+static int pickMaster() {
+	int i, best = -1;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		if (!c->online)
+			continue;
+		if (best < 0 || (c->clock.jitter >= 0 && (devices[best]->clock.jitter < 0
+				|| c->clock.jitter < devices[best]->clock.jitter)))
+			best = i;
+	}
+	return best;
+}
+
+
+/**
+ * Master election: rate the clock of each device, and make the steadiest one
+ * the master, unless the current one is about as good. Cards too far from
+ * their nominal rate are left out.
+ */
+static void electMaster() {
+	// Past this, the device threads add no more samples.
+	pthread_mutex_lock( &masterMutex ); // >> critical section
+	electing = 0;
+	pthread_mutex_unlock( &masterMutex ); //<< critical section
+
+	int i, best = -1;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		clockRate(c);
+		if (c->clock.jitter < 0 || !c->online) {
+			log_dev_error(c, "clock not rated\n");
+			continue;
+		}
+		log_dev_error(c, "clock %+.1f ppm, jitter %.1f us\n", c->clock.ppm,
+				c->clock.jitter);
+		if (fabs(c->clock.ppm) > ELECT_MAX_PPM)
+			continue;
+		if (best < 0 || c->clock.jitter < devices[best]->clock.jitter)
+			best = i;
+	}
+
+	MRDevice *m = devices[masterIdx];
+	if (best < 0 || best == masterIdx || (m->clock.jitter >= 0
+			&& fabs(m->clock.ppm) <= ELECT_MAX_PPM
+			&& devices[best]->clock.jitter > m->clock.jitter * ELECT_MARGIN)) {
+		log_dev_error(m, "stays the master\n");
+		return;
+	}
+	log_dev_error(devices[best], "elected master\n");
+	masterIdx = best;
+}
+
+
+/** Absolute time (for pthread timed waits) ms milliseconds from now */
+static void deadline(struct timespec *ts, unsigned int ms) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+/**
+ * Tell the worker that a device is gone, through an empty CHUNK_LOST chunk
+ * queued after its audio: from there on, the worker records silence for it.
+ */
+static void postLost(MRDevice *c) {
+	MRAlsaChunk *cnk = c->partialBucket;
+	if (cnk && cnk->len > 0) {
+		commitChunk(c, cnk);
+		cnk = NULL;
+	}
+	if (!cnk)
+		cnk = (MRAlsaChunk*)prod_own(c->dualQueue);
+	cnk->len = 0;
+	cnk->flags = CHUNK_LOST;
+	commitChunk(c, cnk);
+}
+
+
+/**
+ * Give up on a slave device which failed (unplugged, or broken): close it,
+ * and have its channels recorded as silence until it is back.
+ */
+static void dropDevice(MRDevice *c) {
+	log_dev_error(c, "device lost, going on without it\n");
+	c->online = 0;
+
+	// The timeline needs a master: hand the role over to another device.
+	if (c->idx == masterIdx) {
+		int m = pickMaster();
+		if (m < 0) {
+			log_dev_error(c, "FATAL : master lost, and no other device left\n");
+			traceDump("master lost");
+			finish(-1);
+		}
+		log_dev_error(devices[m], "takes over as master\n");
+		masterIdx = m;
+	}
+
+	c->peaks[0] = c->peaks[1] = 0;
+	c->stats.lastReadTS = 0;
+	postLost(c);
+
+	snd_pcm_unlink(c->handle);
+	snd_pcm_close(c->handle);
+	c->handle = NULL;
+}
+
+
+/**
+ * Device thread, while its card is gone: try to reopen it every REOPEN_MS,
+ * until it works or capture stops. A reopened card is started on its own
+ * clock (it can't be linked to the running master), and the worker realigns
+ * its first chunk to the output timeline.
+ */
+static void reopenDevice(MRDevice *c) {
+	struct timespec ts;
+	deadline(&ts, REOPEN_MS);
+	pthread_mutex_lock(&stateMutex);
+	while (state == MONITORING || state == RECORDING)
+		if (pthread_cond_timedwait(&stateCond, &stateMutex, &ts) == ETIMEDOUT)
+			break;
+	pthread_mutex_unlock(&stateMutex);
+
+	if ((state != MONITORING && state != RECORDING) || faultUnplugged(c->idx))
+		return;
+
+	int err;
+	if (cardOpen(c) < 0)
+		return;
+	if ((err = snd_pcm_prepare(c->handle)) < 0
+			|| (err = snd_pcm_start(c->handle)) < 0) {
+		log_dev_error(c, "Restart failed: %s\n", snd_strerror(err));
+		snd_pcm_close(c->handle);
+		c->handle = NULL;
+		return;
+	}
+
+	log_dev_error(c, "device back, rejoining\n");
+	c->rejoined = 1;
+	c->online = 1;
+}
+
+
 /**
  * Wait until data is available on the specified device, then read the captured
  * data into ptr.
  * Also, feed the audio data to the VU meters.
  */
-inline int capture(MRDevice *c, MRFrame *ptr, snd_pcm_sframes_t *len,
+static inline int capture(MRDevice *c, MRFrame *ptr, snd_pcm_sframes_t *len,
 		snd_pcm_sframes_t *delay, unsigned long long *timeStamp) {
 	int err;
 	snd_pcm_t *pcm_handle = c->handle;
 
+	unsigned long long tr = traceStart();
+	unsigned long long t = rdtsc();
 	snd_pcm_wait(c->handle, c->act_period_time/1000);
+	histAddCycles(&c->stats.wait, rdtsc() - t);
+	traceEnd("wait", tr, NULL, 0);
+
+	int xrun = faultRead(c->idx);
 
 	err = snd_pcm_delay(pcm_handle, delay);
 	if (err < 0) {
 		log_dev_error(c, "pcm_delay error: %s\n", snd_strerror(err));
-		finish(-1);
 		return -1;
 	}
 
 	*timeStamp = rdtsc();
+	if (electing) {
+		pthread_mutex_lock( &masterMutex ); // >> critical section
+		if (electing)
+			clockSample(c, *delay);
+		pthread_mutex_unlock( &masterMutex ); //<< critical section
+	}
 
+	tr = traceStart();
 	snd_pcm_sframes_t actual = snd_pcm_readi(pcm_handle, ptr, c->period_size);
+	if (faultUnplugged(c->idx))
+		actual = -ENODEV;
+	histAddCycles(&c->stats.read, rdtsc() - *timeStamp);
+	traceEnd("read", tr, "frames", actual);
+
+	// Reads should be one period apart.
+	if(c->stats.lastReadTS) {
+		long long us = (*timeStamp - c->stats.lastReadTS) / (CPMillis/1000);
+		histAdd(&c->stats.jitter, llabs(us - c->act_period_time));
+	}
+	c->stats.lastReadTS = *timeStamp;
 
 	*len = actual;
 
 	if (actual < 0) {
 		log_dev_error(c, "snd_pcm_readi error: %s\n", snd_strerror(actual));
-		// No use in recovering a xrun.
-		// TODO exit gracefully, state=STOP_REQUEST and let the UI know...
-		finish(-1);
+		// The device is dropped and reopened (see dropDevice()).
+		traceTrigger(actual == -EPIPE ? "xrun" : "read error");
 		return -1;
 	}
+	c->clock.frames += actual;
+
+	// Injected xrun: the period is lost, as after a recovered overrun.
+	if (xrun) {
+		traceTrigger("xrun (injected)");
+		*len = 0;
+		return 0;
+	}
 
 	log_dev_debug(c, "read = %lu frames, delay = %lu frames.\n", actual, *delay);
 
@@ -283,19 +796,6 @@ inline int capture(MRDevice *c, MRFrame *ptr, snd_pcm_sframes_t *len,
 }
 
 
-/**
- * Capture audio data and discard it (just feed the VU meters).
- */
-static inline void doMonitor(MRDevice *c)
-{
-	snd_pcm_sframes_t len, delay;
-	unsigned long long ts;
-
-	capture(c, tmpBuf, &len, &delay, &ts);
-
-}
-
-
 /**
  * Capture audio data and append it to the current bucket. If the bucket becomes
  * full, send it to the outbound queue: a fresh one will be fetched from the
@@ -309,6 +809,8 @@ static inline void doRecord(MRDevice *c)
 		// Get a fresh buffer from the dualQueue.
 		cnk = (MRAlsaChunk*)prod_own(c->dualQueue);
 		cnk->len = 0;
+		cnk->flags = c->rejoined ? CHUNK_REJOIN : 0;
+		c->rejoined = 0;
 		c->partialBucket = cnk;
 	}
 
@@ -323,19 +825,32 @@ static inline void doRecord(MRDevice *c)
 		log_dev_debug(c, "** queue has grown! ** ");
 
 	snd_pcm_sframes_t len = 0;
-	capture(c, ptr, &len, &(cnk->delay), &(cnk->ts) );
+	if (capture(c, ptr, &len, &(cnk->delay), &(cnk->ts)) < 0) {
+		dropDevice(c);
+		return;
+	}
 	if(len<=0)
 		return;
 
+	// A new master takes over at a chunk boundary, so that its chunks are
+	// either all stretched or all master.
+	if (cnk->len == 0 && c->idx == masterIdx)
+		cnk->flags |= CHUNK_MASTER;
+
 	cnk->len += len;
 
 	// If this is the master device, update the related global vars (within a
 	// critical section)
-	if (c->idx == 0) {
+	if (cnk->flags & CHUNK_MASTER) {
 		pthread_mutex_lock( &masterMutex ); // >> critical section
-		masterFrameCount += len;
-		masterDelay = cnk->delay;
-		masterTS = cnk->ts;
+		if (masterOwner == c->idx)
+			masterFrameCount += len;
+		else if (c->idx == masterIdx)
+			takeOver(c, cnk, len);
+		if (masterOwner == c->idx) {
+			masterDelay = cnk->delay;
+			masterTS = cnk->ts;
+		}
 		pthread_mutex_unlock( &masterMutex ); //<< critical section
 	}
 
@@ -346,39 +861,101 @@ static inline void doRecord(MRDevice *c)
 }
 
 
-static inline void barrier() {
-	if (pthread_barrier_wait(&stateBarrier) == EINVAL) {
-		log_error("FATAL : barrier wait error.");
-		finish(-1);
-	}
+/**
+ * Tell the main thread that the device thread has followed the last state
+ * change.
+ */
+static void ack(MRDevice *c) {
+	pthread_mutex_lock(&stateMutex);
+	c->acked = 1;
+	pthread_cond_broadcast(&ackCond);
+	pthread_mutex_unlock(&stateMutex);
+}
+
+
+/**
+ * Change state, and wake up the device threads waiting for it. Called by the
+ * main thread only.
+ */
+static void setState(States s) {
+	int i;
+	pthread_mutex_lock(&stateMutex);
+	for (i = 0; i < devCount; i++)
+		devices[i]->acked = 0;
+	state = s;
+	pthread_cond_broadcast(&stateCond);
+	pthread_mutex_unlock(&stateMutex);
+}
+
+
+/**
+ * Wait until all device threads have acked the last state change, for
+ * ACK_TIMEOUT_MS at most. A device thread stuck in the driver must not hang
+ * the whole program: the late ones are logged, and left behind. Returns the
+ * number of them.
+ */
+static int waitAcks(const char *what) {
+	unsigned long long tr = traceStart();
+	unsigned long long t0 = rdtsc();
+	struct timespec ts;
+	int i, late = 0;
+
+	deadline(&ts, ACK_TIMEOUT_MS);
+	pthread_mutex_lock(&stateMutex);
+	for (i = 0; i < devCount; i++)
+		while (!devices[i]->acked)
+			if (pthread_cond_timedwait(&ackCond, &stateMutex, &ts) == ETIMEDOUT)
+				break;
+	for (i = 0; i < devCount; i++)
+		if (!devices[i]->acked) {
+			log_dev_error(devices[i], "no answer to %s after %d ms, going on "
+					"without it\n", what, ACK_TIMEOUT_MS);
+			late++;
+		}
+	pthread_mutex_unlock(&stateMutex);
+
+	histAddCycles(&ackHist, rdtsc() - t0);
+	ackTimeouts += late;
+	traceEnd("wait acks", tr, "late", late);
+	return late;
 }
 
 
 /**
  * Device thread code. Continuously read data from the specified device, and send
- * it to the disk worker or just to the VU-meters, according to the current state.
- * If the state becomes STOPPING, wait on the barrier and exit.
+ * it to the disk worker, which decides whether it goes to a take or not.
+ * If the state becomes STOPPING, ack and exit.
  */
 void deviceLoop(MRDevice *c) {
+	traceThread("capture %s", c->name);
+	// Missing since the start: silence until it shows up.
+	if (!c->handle)
+		postLost(c);
+	c->clock.jitter = -1;
 	while (1) {
 		switch (state) {
 		case RECORDING:
-			doRecord(c);
-			break;
 		case MONITORING:
-			doMonitor(c);
+			if (c->handle)
+				doRecord(c);
+			else
+				reopenDevice(c);
 			break;
 		case SKIP:
 			// Hold on until state changes...
-			log_dev_debug(c, "barrier wait...\n");
-			barrier();
+			log_dev_debug(c, "waiting for start...\n");
+			ack(c);
+			pthread_mutex_lock(&stateMutex);
+			while (state == SKIP)
+				pthread_cond_wait(&stateCond, &stateMutex);
+			pthread_mutex_unlock(&stateMutex);
 			log_dev_debug(c, " ...go!!\n");
 			break;
 		case STOPPING:
 			// flush the last partialBucket
 			if (c->partialBucket && c->partialBucket->len > 0)
 				commitChunk(c, c->partialBucket);
-			barrier();
+			ack(c);
 			log_dev_debug(c, "stopped.\n");
 			return;
 		}
@@ -386,165 +963,22 @@ void deviceLoop(MRDevice *c) {
 }
 
 
-int dirNameFilter(const struct dirent *fname)
-{
-	// dir name pattern is "trackname-NN"
-	//   N = attempt number (zero padded)
-	int tLen = strlen(trackName);
-	return (strlen(fname->d_name) == tLen+3 &&
-			strncmp(fname->d_name, trackName, tLen)==0 &&
-	        fname->d_name[tLen]=='-' &&
-	        fname->d_name[tLen+1]>='0' && fname->d_name[tLen+1]<='9' &&
-	        fname->d_name[tLen+2]>='0' && fname->d_name[tLen+2]<='9') ? 1 : 0;
-}
-
-
-/**
- * Create the output directory and .wav files for the session to be recorded.
- * File name pattern is "./DIR-NN/c.wav"
- *   DIR = track name (passed in as program argument)
- *   N = attempt number starting from 1 (zero padded)
- *   c = channel id (a = hw:0/left, b = hw:0/right, c = hw:1/left, ...)
- */
-int openFiles() {
-	int lastNum = 0;
-
-	// Scan dir contents to find the next available attempt number for the
-	// current track.
-	struct dirent **namelist;
-	int n;
-	n = scandir(".", &namelist, dirNameFilter, alphasort);
-	if (n < 0) {
-		log_error("Error in scandir. errno = %d \n", errno);
-	} else {
-		while(n--) {
-			if(lastNum==0)
-				lastNum = atoi( namelist[n]->d_name + strlen(trackName) + 1 );
-			free(namelist[n]);
-		}
-		free(namelist);
-	}
-
-	// Increment attempt number and derive the new dir name.
-	char recDir[256];
-	sprintf(recDir, "./%s-%02d", trackName, lastNum + 1);
-
-	// Attempt to create recDir. It must not already exist, otherwise bail.
-	if(mkdir(recDir, 0777) == -1) {
-		log_error("Error creating rec dir\n");
-		return -1;
-	}
-
-	// Recording directory created. Now go on and actually open new files...
-	char fname[256];
-	int i, chan;
-	for(i=0; i<devCount; i++) {
-		MRDevice *c	= devices[i];
-		for(chan=0; chan<MR_CHANNELS; chan++) {
-			sprintf(fname, "./%s/%c.wav", recDir, 'a'+((i*MR_CHANNELS)+chan) );
-			
-			// Open one mono wav file per channel per device.
-			SF_INFO sfi;
-			sfi.samplerate = rate;
-			sfi.channels = 1;
-			sfi.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
-			
-			log_debug("Trying to open %s ... ", fname);
-			c->outFile[chan] = sf_open(fname, SFM_WRITE, &sfi);
-
-			if(c->outFile[chan]==NULL) {
-				log_debug("  %s\n", sf_strerror (NULL));
-				return -1;
-			}
-			
-			log_debug("  OK.\n");
-		}
-	}
-	return 0;
-}
-
-
-// TODO
-int closeFile(MRDevice *c) {
-	int n;
-	for(n=0; n<MR_CHANNELS; n++)
-		if(c->outFile[n] )
-			sf_close(c->outFile[n]);
-		
-	return 0;
-}
-
-
 /**
- * Restart audio capture in-sync, and start actually write audio data to disk!
+ * Returns the number of frames captured so far by the master device, which is
+ * the current position on the output timeline of all devices.
  */
-void initRecording() {
-	int i, err;
-
-	initWorker(devices, devCount);
-
-	// Unlink PCMs, so we can drop them individually.
-	for(i=1; i<devCount; i++) {
-		MRDevice *c = devices[i];
-		if ( (err=snd_pcm_unlink(c->handle)) <0 ) {
-			log_dev_error(c, "Unlink failed: %s\n", snd_strerror(err));
-			finish(-1);
-		}
-	}
-
-	// *** Re-initializing devices ***
-	for(i=0; i<devCount; i++) {
-		MRDevice *c = devices[i];
-		// *** Stop previous capture to restart in-sync...
-		err = snd_pcm_drop(c->handle);
-		if (err < 0) {
-			log_dev_error(c, "Drop error: %s\n", snd_strerror(err));
-			finish(-1);
-		}
-
-		err = snd_pcm_prepare(c->handle);
-        if (err < 0) {
-        	log_dev_error(c, "Prepare failed: %s\n", snd_strerror(err));
-			finish(-1);
-		}
-
-        // Link all other devices to the master device
-		if (i>0) {
-			if ( (err=snd_pcm_link(devices[0]->handle, c->handle)) <0 ) {
-				log_dev_error(c, "Link failed: %s\n", snd_strerror(err));
-				finish(-1);
-			}
-			log_dev_debug(c, "Linked devz 0 and %d\n", i);
-		}
-
-		// Reset the total output frame count for this device
-		c->outputFrameCount = 0L;
-
-	}
-
-	// *** Open output files ***
-	if(openFiles()<0) {
-		log_error("Error opening files\n");
-		finish(-1);
-	}
-
-
-	// *** Initialize sample rate converter
-	initSrc();
-
-	// *** Start capturing ! ***
-	err = snd_pcm_start(devices[0]->handle);
-	if (err < 0) {
-		log_error("Start error: %s\n", snd_strerror(err));
-		finish(-1);
-	}
-
+unsigned long long currentFrame() {
+	pthread_mutex_lock( &masterMutex ); // >> critical section
+	unsigned long long rv = masterFrameCount;
+	pthread_mutex_unlock( &masterMutex ); //<< critical section
+	return rv;
 }
 
 
 /**
- * Main thread code. Starts audio capture on all devices, without writing data to
- * disk.
+ * Main thread code. Starts audio capture on all devices, and keeps it running
+ * until the program exits: takes are started and stopped by the disk worker,
+ * which routes the captured audio to their files.
  * Then, just loop forever waiting for start / stop events coming from
  * the GUI.
  */
@@ -552,7 +986,8 @@ void *mainLoop(void *arg)
 {
 	int err;
 
-	state = SKIP;
+	traceThread("mainLoop");
+	setState(SKIP);
 
 	// *** Re-initializing devices ***
 	MRDevice *c;
@@ -560,18 +995,19 @@ void *mainLoop(void *arg)
 	for(i=0; i<devCount; i++) {
 		c = devices[i];
 
-		err = snd_pcm_prepare(c->handle);
+		// A missing device is opened later by its thread.
+		err = c->handle ? snd_pcm_prepare(c->handle) : 0;
         if (err < 0) {
         	log_dev_error(c, "Prepare failed: %s\n", snd_strerror(err));
         	finish(-1);
 		}
 
-		if (i>0) {
-			if ( (err=snd_pcm_link(devices[0]->handle, c->handle)) <0 ) {
+		if (i != masterIdx && c->handle) {
+			if ( (err=snd_pcm_link(devices[masterIdx]->handle, c->handle)) <0 ) {
 				log_dev_error(c, "Link failed: %s\n", snd_strerror(err));
 				finish(-1);
 			}
-			log_dev_debug(c, "Linked devz 0 and %d\n", i);
+			log_dev_debug(c, "Linked devz %d and %d\n", masterIdx, i);
 		}
 
 		// Create device thread
@@ -581,56 +1017,105 @@ void *mainLoop(void *arg)
 		}
 	}
 
+	// *** Initialize sample rate converter and disk worker
+	if (!outRate)
+		outRate = rate;
+	if (!src_is_valid_ratio((double) outRate / rate)) {
+		printf("out_rate %u: can't convert to it from %u Hz\n", outRate, rate);
+		finish(-1);
+	}
+	if(initSrc() < 0)
+		finish(-1);
+	if (initCalibration() < 0)
+		finish(-1);
+	initWorker();
+	initStats();
+	if (triggerDb)
+		triggerPeak = 32767 * pow(10, -(double) triggerDb / 20) + 1;
+	if (initFaults() < 0)
+		finish(-1);
 
-	// Wait for all device threads to settle down in barrier wait...
-	usleep(100000);
+	// Wait for all device threads to settle down...
+	waitAcks("start");
 
 	// ... start capturing ...
 	log_debug("Start !!\n");
-	err = snd_pcm_start(devices[0]->handle);
+	err = snd_pcm_start(devices[masterIdx]->handle);
 	if (err < 0) {
 		log_debug("Start error: %s\n", snd_strerror(err));
 		finish(-1);
 	}
 
-	// ...then change state and unlock the barrier.
-	state = MONITORING;
-	barrier();
+	// ...then change state and let them go.
+	electing = electMillis > 0;
+	setState(MONITORING);
+	unsigned long long electEnd = rdtsc()
+			+ (unsigned long long) electMillis * CPMillis;
 
 
+	MRTake *t;
 	int run = 1;
 	while(run) {
-		switch(state) {
-		case MONITORING:
-			if(request == REQ_START) {
-				state = SKIP;
-				barrier();
-
-				initRecording();
-
-				state = RECORDING;
-				barrier();
+		// Sleep until a request comes, or the next tick.
+		struct timespec ts;
+		deadline(&ts, MAIN_TICK_MS);
+		pthread_mutex_lock(&stateMutex);
+		while (request == REQ_NONE)
+			if (pthread_cond_timedwait(&requestCond, &stateMutex, &ts)
+					== ETIMEDOUT)
+				break;
+		Requests req = request;
+		unsigned long long reqTS = requestTS;
+		request = REQ_NONE;
+		pthread_mutex_unlock(&stateMutex);
+
+		if (req != REQ_NONE)
+			histAddCycles(&requestHist, rdtsc() - reqTS);
+
+		if (electing && rdtsc() >= electEnd)
+			electMaster();
+
+		if (triggerPeak && !triggerReady && state == MONITORING)
+			rearmTrigger();
+
+		switch(req) {
+		case REQ_START:
+			if(state == MONITORING && (t = openTake()) != NULL) {
+				snprintf(takeDir, sizeof(takeDir), "%s", t->dir);
+				beginTake(t, currentFrame());
+				setState(RECORDING);
 			}
-			else if(request == REQ_STOP) {
-				state = STOPPING;
-				barrier();
-				run=0;
+			break;
+		case REQ_NEXT:
+			if(state == RECORDING && (t = openTake()) != NULL) {
+				snprintf(takeDir, sizeof(takeDir), "%s", t->dir);
+				switchTake(t, currentFrame());
 			}
 			break;
-		case RECORDING:
-			if(request == REQ_STOP) {
-				state = STOPPING;
-				barrier();
-				// TODO finalization!!!
-				waitPendingJobs();
-				run=0;
+		case REQ_STOP:
+			if(state == RECORDING) {
+				endTake(currentFrame());
+				setState(MONITORING);
+				// Don't start again on the signal that is still going on.
+				triggerReady = 0;
+				triggerLoudTS = rdtsc();
 			}
 			break;
+		case REQ_QUIT:
+			if(state == RECORDING)
+				endTake(currentFrame());
+			setState(STOPPING);
+			waitAcks("stop");
+			waitPendingJobs();
+			stopStats();
+			stopFaults();
+			run=0;
+			break;
 		default:
 			break;
 		}
 
-		usleep(100000);
+		traceCheck();
 	}
 	
 //	for(i=0; i<devCount; i++) {
@@ -643,21 +1128,56 @@ void *mainLoop(void *arg)
 }
 
 
+const char *currentTakeDir() {
+	return state == RECORDING ? takeDir : NULL;
+}
+
+
+/**
+ * Hand a request to the main thread, and wake it up. A request not handled
+ * yet is replaced.
+ */
+static void postRequest(Requests req) {
+	pthread_mutex_lock(&stateMutex);
+	request = req;
+	requestTS = rdtsc();
+	pthread_cond_signal(&requestCond);
+	pthread_mutex_unlock(&stateMutex);
+}
+
+
 /**
- * Start recording captured audio to disk
+ * Start recording captured audio to a new take
  */
 void startRecording() {
-	request = REQ_START;
+	postRequest(REQ_START);
 }
 
 
+/**
+ * Close the current take and go on recording to a new one, with no gap in
+ * between.
+ */
+void nextTake() {
+	postRequest(REQ_NEXT);
+}
+
 
 /**
- * Stop recording and close output files
+ * Stop recording: the current take is finalized in background, while
+ * capture goes on.
  */
 void stopRecording() {
+	postRequest(REQ_STOP);
+}
+
+
+/**
+ * Stop recording and capturing, and wait until all output files are closed.
+ */
+void stopCapture() {
 	// Set the request flag and wait for the main thread to terminate.
-	request = REQ_STOP;
+	postRequest(REQ_QUIT);
 	pthread_join(mainThread, NULL);
 }
 
@@ -798,16 +1318,19 @@ static int set_swparams(MRDevice *card, snd_pcm_sw_params_t *swparams)
 
 
 /*
- * Initializes the specified device, preparing it to start capture
+ * Opens the specified device, preparing it to start capture. Returns the
+ * error, with the device left closed (NULL handle), if it fails.
  */
-static int cardInit(MRDevice *card)
+static int cardOpen(MRDevice *card)
 {
 	int err;
 
 	if ((err = snd_pcm_open(&card->handle, card->name, SND_PCM_STREAM_CAPTURE, 0)) < 0)
 	{
-		printf("Capture open error: %s\n", snd_strerror(err));
-		finish(-1);
+		// Not an error while a lost card is being retried: see cardInit().
+		log_dev_debug(card, "Capture open error: %s\n", snd_strerror(err));
+		card->handle = NULL;
+		return err;
 	}
 
 	snd_pcm_hw_params_t *hwparams;
@@ -817,19 +1340,36 @@ static int cardInit(MRDevice *card)
 	snd_pcm_sw_params_alloca(&swparams);
 
 	if ((err = set_hwparams(card, hwparams)) < 0) {
-		printf("Setting of hwparams failed: %s\n", snd_strerror(err));
-		finish(-1);
+		log_dev_error(card, "Setting of hwparams failed: %s\n", snd_strerror(err));
+		snd_pcm_close(card->handle);
+		card->handle = NULL;
+		return err;
 	}
 	if ((err = set_swparams(card, swparams)) < 0) {
-		printf("Setting of swparams failed: %s\n", snd_strerror(err));
-		finish(-1);
+		log_dev_error(card, "Setting of swparams failed: %s\n", snd_strerror(err));
+		snd_pcm_close(card->handle);
+		card->handle = NULL;
+		return err;
 	}
 
-
-	snd_pcm_dump(card->handle, output);
+	return 0;
+}
 
 
-	return 0;
+/*
+ * Initializes the specified device, preparing it to start capture. A missing
+ * device is recorded as silence until it shows up.
+ */
+static void cardInit(MRDevice *card)
+{
+	// The setup dump writes to logFile directly: only before capture starts
+	// (see log.h), not when a device thread reopens the card.
+	if (cardOpen(card) == 0) {
+		snd_pcm_dump(card->handle, output);
+		card->online = 1;
+	} else
+		printf("Device %s missing, recording silence for it until it shows up\n",
+				card->name);
 }
 
 
@@ -846,8 +1386,7 @@ void init(const char* out)
 {
 	trackName = out;
 
-    FILE* lf = fopen("out.log", "w+");
-	initLogging(lf, ERROR);
+	initLogging("multirec.log");
 
 	log_debug("sof = %lu\n\n", sizeof(MRFrame));
 	
@@ -861,7 +1400,7 @@ void init(const char* out)
 	t2 = rdtsc();
 	CPS = (t2-t1)/rate;
 	CPMillis = (t2-t1)/1000;
-	log_debug("CPSample = %u\n\n", CPS);
+	log_debug("CPSample = %llu\n\n", CPS);
 
 	int err = snd_output_stdio_attach(&output, logFile, 0);
 	if (err < 0) {
@@ -875,6 +1414,15 @@ void init(const char* out)
 	for(i=0; i<devCount; i++)
 		cardInit(devices[i]);
 
+	// The first card there is the master, until the election.
+	for(i=0; i<devCount && !devices[i]->online; i++)
+		;
+	if(i == devCount) {
+		printf("No capture device could be opened\n");
+		finish(-1);
+	}
+	masterIdx = i;
+
 	fflush(logFile);
 
 
@@ -882,15 +1430,6 @@ void init(const char* out)
 	request = REQ_NONE;
 	state = SKIP;
 
-
-	// Initialize a barrier with devCount+1 participants (one for the mainThread
-	// and one for each device)
-	err = pthread_barrier_init(&stateBarrier, NULL, devCount + 1);
-	if (err != 0) {
-		log_error("FATAL : error initializing state barrier.");
-		finish(-1);
-	}
-
 	pthread_attr_t attr;
 
     err = pthread_attr_init(&attr);
@@ -25,9 +25,13 @@
 #include <samplerate.h>
 
 #include "buffer_queue.h"
+#include "peaks.h"
+#include "stats.h"
+#include "drift.h"
 
 #define MR_SAMPLE short  // Data type that will store sample data.
 #define MR_CHANNELS 2    // number of channels per device
+#define MR_ALL_CHANNELS ((1 << MR_CHANNELS) - 1) // channel bit mask, all set
 
 #define BSIZ 262144 // Alsa buffer size (n. of frames)
 
@@ -69,8 +73,36 @@ typedef struct MRAlsaChunk_s
  	unsigned long long masterTS;
  	snd_pcm_sframes_t masterDelay;
 
+	// Timestamp telling when this chunk was handed to the worker.
+	unsigned long long commitTS;
+
+	// CHUNK_* flags
+	int flags;
+
 } MRAlsaChunk;
 
+/** The device is gone: no audio in this chunk, and none until CHUNK_REJOIN */
+#define CHUNK_LOST 1
+/** First chunk read after the device came back */
+#define CHUNK_REJOIN 2
+/** Read by the master: it defines the output timeline, and is not stretched */
+#define CHUNK_MASTER 4
+
+
+/**
+ * Least squares fit of the frames captured by a card against
+ * CLOCK_MONOTONIC_RAW, to rate its clock for the master election.
+ */
+typedef struct MRClockFit_s
+{
+	double t0;                   // time of the first sample (s)
+	unsigned long long frames;   // frames read so far
+	double n, st, sf, stt, stf, sff;
+
+	// Results of the election (jitter < 0: not rated)
+	double ppm, jitter;
+} MRClockFit;
+
 
 /**
  * Per-device stuff...
@@ -103,31 +135,140 @@ typedef struct MRDevice_s
 
 	// libsamplerate stuff...
 	SRC_STATE *srcState;
+	SRC_STATE *srcMono;            // for a device with one channel armed
 	SRC_DATA srcData;
+
+	// Channels left out of the next takes (bit n = channel n), set by
+	// "chan <channel> disarm" and the disarm command.
+	volatile int disarmed;
+	// Worker side: channels converted and split into the ring. Those of the
+	// takes being written, or the armed ones between takes. With none, the
+	// device is only tracked, to keep its place on the timeline.
+	int armed;
+	double trackFrac;
 	
 	MRAlsaChunk *partialBucket;
 
-	// libsndfile stuff...
-	SNDFILE* outFile[MR_CHANNELS]; // libsndfile handle (1 file per channel !!)
+	// Ring of the most recent output frames, split to mono (1 ring per channel).
+	// Output frame n is stored at index n % ring size. Takes are written from
+	// here, so the ring also holds the pre-roll history.
+	MR_SAMPLE *ring[MR_CHANNELS];
+
+	// Performance counters (see stats.h)
+	MRDevStats stats;
 
 	// pcm thread
 	pthread_t thread;
 
+	// Set when the thread has followed the last state change (see setState())
+	volatile int acked;
+
+	// Whether the card is there. A slave that goes away is reopened in
+	// background, while the other ones go on recording.
+	volatile int online;
+	// Set by the device thread when it reopens the card: the next chunk
+	// gets CHUNK_REJOIN.
+	int rejoined;
+	// Worker side: set between CHUNK_LOST and CHUNK_REJOIN, while the output
+	// timeline of the device is filled with silence from gapFrom (a timeline
+	// frame) on.
+	int lost;
+	unsigned long long gapFrom;
+
+	// Worker side: clock tracking against the master (see drift.h)
+	MRDrift drift;
+	// Per channel processing, NULL if none (see dsp.h)
+	struct MRDsp_s *dsp;
+
+	// Fixed latency against the other cards, in frames (see
+	// initCalibration()): takes are written from this many frames later in
+	// the ring.
+	long latency;
+
+	// Clock quality (see electMaster())
+	MRClockFit clock;
+	// Worker side: set once the device went through the converter. Then it
+	// keeps going through it as master (at ratio 1), so that the converter
+	// delay doesn't vanish at once.
+	int converted;
+
 } MRDevice;
 
 
+/**
+ * Output files of one device, within a take.
+ */
+typedef struct MRTakeDev_s
+{
+	// libsndfile stuff...
+	SNDFILE* outFile[MR_CHANNELS]; // libsndfile handle (1 file per channel !!)
+	int outFd[MR_CHANNELS];        // underlying file descriptors, for fdatasync()
+	MRPeakFile *outPeaks[MR_CHANNELS]; // peak index of each file (NULL if disabled)
+	int outVol[MR_CHANNELS];       // volume each file lives on (see volume.h)
+
+	// Channels recorded (bit n = channel n). The other ones get no file.
+	int armed;
+
+	// Sparse storage (see silenceMillis): silent frames in a row on each
+	// channel, and whether its file is leaving them out, since frame
+	// skipFrom of the ring.
+	unsigned long long silentRun[MR_CHANNELS];
+	int skipping[MR_CHANNELS];
+	unsigned long long skipFrom[MR_CHANNELS];
+
+	// Next output frame to be written to the files.
+	unsigned long long pos;
+
+	// Segment being written to outFile, from frame segStart of the ring on.
+	// It runs over its segFrames while the files of the next one are late.
+	int segment;
+	unsigned long long segStart;
+	int rollLate;
+
+	// Files of the next segment, opened ahead of time.
+	SNDFILE* nextFile[MR_CHANNELS];
+	int nextFd[MR_CHANNELS];
+	MRPeakFile *nextPeaks[MR_CHANNELS];
+	int nextVol[MR_CHANNELS];
+	// Segment whose files are parked in nextFile (-1 = none)
+	volatile int nextSegment;
+} MRTakeDev;
+
+
+/**
+ * A take: one set of output files, holding the output frames in the range
+ * [startFrame, endFrame) of every device.
+ */
+typedef struct MRTake_s
+{
+	struct MRTake_s *next;
+
+	char dir[256];                 // "track-NN", created under each volume root
+	unsigned long long startFrame;
+	unsigned long long endFrame;   // ULLONG_MAX until the take is stopped
+
+	// Segment length in frames (0 = no rollover). Segment n holds the frames
+	// [startFrame + n*segFrames, startFrame + (n+1)*segFrames).
+	unsigned long long segFrames;
+
+	MRTakeDev *dev;                // one per device
+
+	struct MRProxy_s *proxy;       // listening copy, NULL if none (see proxy.h)
+} MRTake;
+
+
 
 // *** Global varz ***
 
 
 typedef enum {
-	MONITORING=0,
-	RECORDING,
+	MONITORING=0,   // Capturing, no take open
+	RECORDING,      // Capturing, and writing a take
 	STOPPING,
 	SKIP
 } States;
 
-States volatile state;
+extern States volatile state;
 
 
 extern unsigned long long CPS;
@@ -136,6 +277,31 @@ extern unsigned int CPMillis;
 extern MRDevice **devices;
 extern size_t devCount;
 
+/** Index of the master device, the reference clock of the output timeline */
+extern volatile int masterIdx;
+
+extern unsigned int rate;
+extern unsigned int outRate;
+
+/**
+ * Converter of every device, the master included, so that they all have the
+ * same group delay. Linear interpolation is enough for the ppm trims of the
+ * drift correction, but a conversion to another outRate needs the anti-alias
+ * filter of a sinc converter.
+ */
+#define MR_SRC_TYPE (outRate != rate ? SRC_SINC_MEDIUM_QUALITY : SRC_LINEAR)
+
+extern const char *trackName;
+
+extern unsigned int syncMillis;
+extern unsigned int syncKBytes;
+extern unsigned int prerollMillis;
+extern unsigned int segmentSecs;
+extern unsigned int segmentMBytes;
+extern unsigned int writePeaks;
+extern unsigned int silenceMillis;
+extern unsigned int silenceDb;
+
 
 
 // *** Funcz ***
@@ -149,7 +315,29 @@ void init(const char *out);
 
 void startRecording();
 
+void nextTake();
+
 void stopRecording();
 
+void stopCapture();
+
+/** Frames captured so far by the master device, i.e. the timeline position. */
+unsigned long long currentFrame();
+
+/** Dir of the take being recorded, NULL if not recording. */
+const char *currentTakeDir();
+
+MRTake *openTake();
+
+int openSegment(MRTake *t, int dev, int seg);
+
+void closeTake(MRTake *t);
+
+void addGap(MRTake *t, int dev, unsigned long long from,
+		unsigned long long to);
+
+void addSilence(MRTake *t, int dev, int chan, int seg, unsigned long long from,
+		unsigned long long to);
+
 
 #endif  // MULTIREC_H
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "peaks.h"
+
+/** Level 0 entries buffered before each write() */
+#define L0_BUFSIZE 1024
+
+
+/** Entry of the next level being accumulated */
+typedef struct Accum_s {
+	MRPeak e;
+	unsigned int n;   // samples (level 0) or entries (upper levels) so far
+} Accum;
+
+struct MRPeakFile_s {
+	int fd;
+	MRPeakHeader hdr;
+
+	Accum acc[PEAKS_MAX_LEVELS];
+
+	// Level 0 goes straight to the file...
+	MRPeak l0buf[L0_BUFSIZE];
+	unsigned int l0len;
+
+	// ...upper levels are small enough to be kept in memory until the end.
+	MRPeak *level[PEAKS_MAX_LEVELS];
+	unsigned long levelSize[PEAKS_MAX_LEVELS];
+};
+
+
+static void resetAccum(Accum *a) {
+	a->e.min = 32767;
+	a->e.max = -32768;
+	a->n = 0;
+}
+
+
+/**
+ * Write the buffered level 0 entries. Errors are not worth stopping the
+ * recording for: the index is just a convenience.
+ */
+static int flushLevel0(MRPeakFile *p) {
+	size_t size = p->l0len * sizeof(MRPeak);
+	p->l0len = 0;
+	return write(p->fd, p->l0buf, size) == size ? 0 : -1;
+}
+
+
+/**
+ * Store a finished entry of the specified level, and fold it into the entry
+ * being accumulated for the level above.
+ */
+static void emit(MRPeakFile *p, int l, MRPeak e) {
+	unsigned long long n = p->hdr.count[l]++;
+
+	if (l == 0) {
+		p->l0buf[p->l0len++] = e;
+		if (p->l0len == L0_BUFSIZE)
+			flushLevel0(p);
+	} else {
+		if (n == p->levelSize[l]) {
+			p->levelSize[l] = p->levelSize[l] ? p->levelSize[l] * 2 : 256;
+			p->level[l] = realloc(p->level[l], p->levelSize[l] * sizeof(MRPeak));
+		}
+		p->level[l][n] = e;
+	}
+
+	if (l + 1 == PEAKS_MAX_LEVELS)
+		return;
+
+	Accum *a = &p->acc[l + 1];
+	if (e.min < a->e.min)
+		a->e.min = e.min;
+	if (e.max > a->e.max)
+		a->e.max = e.max;
+	if (++a->n == PEAKS_FACTOR) {
+		emit(p, l + 1, a->e);
+		resetAccum(a);
+	}
+}
+
+
+/**
+ * Fold len samples into min / max.
+ */
+static inline void minMax(const short *d, unsigned long len, int16_t *min,
+		int16_t *max) {
+	int16_t mn = *min, mx = *max;
+
+#ifdef __SSE2__
+	if (len >= 8) {
+		__m128i vmin = _mm_set1_epi16(mn);
+		__m128i vmax = _mm_set1_epi16(mx);
+		for (; len >= 8; len -= 8, d += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *) d);
+			vmin = _mm_min_epi16(vmin, v);
+			vmax = _mm_max_epi16(vmax, v);
+		}
+
+		int16_t lmin[8], lmax[8];
+		_mm_storeu_si128((__m128i *) lmin, vmin);
+		_mm_storeu_si128((__m128i *) lmax, vmax);
+		int i;
+		for (i = 0; i < 8; i++) {
+			if (lmin[i] < mn)
+				mn = lmin[i];
+			if (lmax[i] > mx)
+				mx = lmax[i];
+		}
+	}
+#endif
+
+	for (; len; len--, d++) {
+		if (*d < mn)
+			mn = *d;
+		if (*d > mx)
+			mx = *d;
+	}
+
+	*min = mn;
+	*max = mx;
+}
+
+
+MRPeakFile *peaksOpen(const char *fname, unsigned int rate) {
+	int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return NULL;
+
+	MRPeakFile *p = calloc(1, sizeof(MRPeakFile));
+	p->fd = fd;
+
+	memcpy(&p->hdr, PEAKS_MAGIC, sizeof(p->hdr.magic));
+	p->hdr.rate = rate;
+	p->hdr.blockSize = PEAKS_BLOCK_SIZE;
+	p->hdr.factor = PEAKS_FACTOR;
+	p->hdr.offset[0] = sizeof(MRPeakHeader);
+
+	int l;
+	for (l = 0; l < PEAKS_MAX_LEVELS; l++)
+		resetAccum(&p->acc[l]);
+
+	// Unfinalized header for now: level 0 runs up to the end of the file.
+	if (write(fd, &p->hdr, sizeof(MRPeakHeader)) != sizeof(MRPeakHeader)) {
+		close(fd);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+
+void peaksAppend(MRPeakFile *p, const short *data, unsigned long len) {
+	Accum *a = &p->acc[0];
+	p->hdr.samples += len;
+
+	while (len) {
+		unsigned long n = PEAKS_BLOCK_SIZE - a->n;
+		if (n > len)
+			n = len;
+
+		minMax(data, n, &a->e.min, &a->e.max);
+		a->n += n;
+		data += n;
+		len -= n;
+
+		if (a->n == PEAKS_BLOCK_SIZE) {
+			emit(p, 0, a->e);
+			resetAccum(a);
+		}
+	}
+}
+
+
+void peaksClose(MRPeakFile *p) {
+	int l;
+
+	// Emit the partial entries left at every level, bottom up.
+	for (l = 0; l < PEAKS_MAX_LEVELS; l++)
+		if (p->acc[l].n) {
+			emit(p, l, p->acc[l].e);
+			resetAccum(&p->acc[l]);
+		}
+	flushLevel0(p);
+
+	// Append the upper levels, up to the first one made of a single entry.
+	uint64_t off = p->hdr.offset[0] + p->hdr.count[0] * sizeof(MRPeak);
+	p->hdr.levels = 1;
+	for (l = 1; l < PEAKS_MAX_LEVELS && p->hdr.count[l - 1] > 1; l++) {
+		size_t size = p->hdr.count[l] * sizeof(MRPeak);
+		p->hdr.offset[l] = off;
+		if (pwrite(p->fd, p->level[l], size, off) != size)
+			break;
+		off += size;
+		p->hdr.levels++;
+	}
+
+	if (pwrite(p->fd, &p->hdr, sizeof(MRPeakHeader), 0)
+			!= sizeof(MRPeakHeader))
+		p->hdr.levels = 0;
+
+	close(p->fd);
+	for (l = 0; l < PEAKS_MAX_LEVELS; l++)
+		free(p->level[l]);
+	free(p);
+}
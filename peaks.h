@@ -0,0 +1,89 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PEAKS_H_
+#define PEAKS_H_
+
+#include <stdint.h>
+
+
+/**
+ * peaks.c
+ * Waveform peak index, written alongside each .wav file as it is recorded, so
+ * that editors can draw the waveform without reading the audio data.
+ *
+ * File format (".peaks" sidecar, same base name as the .wav file). All fields
+ * are little endian, as is native on x86, and the header is padded to 256
+ * bytes, so the file can be mmap()ed and its levels used in place:
+ *
+ *   MRPeakHeader  header
+ *   MRPeak        level0[count[0]]   at offset[0] (= 256)
+ *   MRPeak        level1[count[1]]   at offset[1]
+ *   ...
+ *
+ * A level 0 entry holds the min / max sample value of blockSize samples; a
+ * level n entry holds the min / max of factor entries of level n-1. The last
+ * entry of each level may cover fewer samples.
+ * While recording, only level 0 is written, and "levels" is 0. If the file is
+ * never finalized (i.e. multirec crashed), level 0 runs up to the end of the
+ * file.
+ */
+
+#define PEAKS_MAGIC "MRPEAKS1"
+#define PEAKS_MAX_LEVELS 12
+#define PEAKS_BLOCK_SIZE 256
+#define PEAKS_FACTOR 16
+
+typedef struct MRPeakHeader_s {
+	char magic[8];
+	uint32_t rate;                        // sample rate of the .wav file
+	uint32_t blockSize;                   // samples per level 0 entry
+	uint32_t factor;                      // level n-1 entries per level n entry
+	uint32_t levels;                      // 0 until the file is finalized
+	uint64_t samples;                     // samples covered by the index
+	uint64_t offset[PEAKS_MAX_LEVELS];    // file offset of each level
+	uint64_t count[PEAKS_MAX_LEVELS];     // entries in each level
+	char pad[32];
+} MRPeakHeader;
+
+typedef struct MRPeak_s {
+	int16_t min, max;
+} MRPeak;
+
+
+typedef struct MRPeakFile_s MRPeakFile;
+
+
+/**
+ * Create a peak file. Returns NULL on error.
+ */
+MRPeakFile *peaksOpen(const char *fname, unsigned int rate);
+
+/**
+ * Add the next len samples to the index.
+ */
+void peaksAppend(MRPeakFile *p, const short *data, unsigned long len);
+
+/**
+ * Write the upper levels and the final header, then close the file.
+ */
+void peaksClose(MRPeakFile *p);
+
+
+#endif /* PEAKS_H_ */
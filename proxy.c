@@ -0,0 +1,295 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "proxy.h"
+#include "trace.h"
+#include "log.h"
+#include "main.h"
+
+
+unsigned int proxyChannels = 0;
+unsigned int proxyQuality = 3;
+
+/** Channels a mix line can name: a to z */
+#define MIX_LINES 26
+
+/** Gains of the mix lines, kept until the cards are known */
+static float mixLines[MIX_LINES][2];
+
+/** Bit n set: channel n has a mix line */
+static unsigned int mixSet = 0;
+
+/** Gain of each channel on each side of the proxy */
+static float (*mix)[2] = NULL;
+
+/** Sums of each side, before they are interleaved into a job */
+static float sums[2][PROXY_BLOCK];
+
+static DualQueue *queue = NULL;
+static pthread_t encoderThread;
+
+/** Set when no more jobs will be queued: the encoder exits once it's idle */
+static volatile int proxyExit = 0;
+
+
+/** Jobs queued to the encoder */
+typedef enum {
+	PJOB_WRITE=0,   // encode frames
+	PJOB_CLOSE      // finalize the file
+} ProxyJobType;
+
+typedef struct ProxyJob_s {
+	ProxyJobType type;
+	MRProxy *proxy;
+	unsigned long len;
+	float data[PROXY_BLOCK * 2];
+} ProxyJob;
+
+
+
+int mixParse(char *args) {
+	char delims[] = " \t\r\n";
+	char *save = NULL;
+	char *name = args ? strtok_r(args, delims, &save) : NULL;
+	if (!name || name[0] < 'a' || name[0] - 'a' >= MIX_LINES || name[1]) {
+		printf("mix %s: no such channel\n", name ? name : "");
+		return -1;
+	}
+	int k = name[0] - 'a';
+
+	char *gain[2];
+	gain[0] = strtok_r(NULL, delims, &save);
+	gain[1] = strtok_r(NULL, delims, &save);
+	if (!gain[0]) {
+		printf("mix %s: needs a gain in dB, or off\n", name);
+		return -1;
+	}
+	if (!gain[1])
+		gain[1] = gain[0];
+
+	int side;
+	for (side = 0; side < 2; side++) {
+		char *end = NULL;
+		double db = strtod(gain[side], &end);
+		if (strcmp(gain[side], "off") == 0)
+			mixLines[k][side] = 0;
+		else if (*end || end == gain[side]) {
+			printf("mix %s: bad gain %s\n", name, gain[side]);
+			return -1;
+		} else
+			mixLines[k][side] = pow(10, db / 20);
+	}
+	mixSet |= 1 << k;
+	return 0;
+}
+
+
+/**
+ * Encoder thread code: run the jobs queued by the worker, in order, until
+ * asked to exit.
+ */
+static void *encoder(void *arg) {
+	traceThread("proxy");
+	while (1) {
+		// Read the exit flag first, as the volume writers do.
+		int exiting = proxyExit;
+		__sync_synchronize();
+
+		ProxyJob *j = (ProxyJob*) cons_own(queue);
+		if (!j) {
+			if (exiting)
+				break;
+			usleep(1000);
+			continue;
+		}
+
+		MRProxy *p = j->proxy;
+		unsigned long long tr = traceStart();
+		switch (j->type) {
+		case PJOB_WRITE:
+			if (sf_writef_float(p->file, j->data, j->len) != j->len)
+				log_error("%s : write error: %s\n", p->path,
+						sf_strerror(p->file));
+			traceEnd("encode", tr, "frames", j->len);
+			break;
+		case PJOB_CLOSE:
+			sf_close(p->file);
+			log_debug("%s : ready\n", p->path);
+			free(p);
+			traceEnd("close", tr, NULL, 0);
+			break;
+		}
+
+		cons_free(queue);
+	}
+	return NULL;
+}
+
+
+void initProxy() {
+	if (!proxyChannels)
+		return;
+	if (proxyChannels > 2) {
+		log_error("proxy: %u channels, only 1 or 2 can be made\n",
+				proxyChannels);
+		proxyChannels = 2;
+	}
+	if (proxyQuality > 10)
+		proxyQuality = 10;
+
+	// The mix lines may come before some of the cards: only checked now.
+	int n = devCount * MR_CHANNELS, k;
+	mix = calloc(n, sizeof(*mix));
+	for (k = 0; k < MIX_LINES; k++) {
+		if (!(mixSet & 1 << k))
+			continue;
+		if (k >= n) {
+			printf("mix %c: no such channel (%d channels)\n", 'a' + k, n);
+			finish(-1);
+		}
+		mix[k][0] = mixLines[k][0];
+		mix[k][1] = mixLines[k][1];
+	}
+
+	// No mix lines: spread the channels from left to right, with a constant
+	// power pan law, and as much power on each side as a single channel.
+	if (!mixSet) {
+		for (k = 0; k < n; k++) {
+			double angle = n > 1 ? M_PI / 2 * k / (n - 1) : M_PI / 4;
+			double g = n > 1 ? sqrt(2.0 / n) : 1;
+			mix[k][0] = g * cos(angle);
+			mix[k][1] = g * sin(angle);
+		}
+	}
+
+	// Mono: the mean of both sides. Scaled to the float range of the encoder.
+	for (k = 0; k < n; k++) {
+		if (proxyChannels == 1)
+			mix[k][0] = (mix[k][0] + mix[k][1]) / 2;
+		mix[k][0] /= 32768;
+		mix[k][1] /= 32768;
+	}
+
+	queue = create(8, sizeof(ProxyJob));
+	if (pthread_create(&encoderThread, NULL, encoder, NULL)) {
+		printf("error creating thread.");
+		finish(-1);
+	}
+}
+
+
+MRProxy *proxyOpen(const char *path) {
+	if (!proxyChannels)
+		return NULL;
+
+	SF_INFO sfi;
+	memset(&sfi, 0, sizeof(sfi));
+	sfi.samplerate = outRate;
+	sfi.channels = proxyChannels;
+	sfi.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+
+	MRProxy *p = calloc(1, sizeof(MRProxy));
+	snprintf(p->path, sizeof(p->path), "%s", path);
+	p->file = sf_open(path, SFM_WRITE, &sfi);
+	if (!p->file) {
+		log_error("Error creating %s: %s\n", path, sf_strerror(NULL));
+		free(p);
+		return NULL;
+	}
+
+	double q = proxyQuality / 10.0;
+	sf_command(p->file, SFC_SET_VBR_ENCODING_QUALITY, &q, sizeof(q));
+	return p;
+}
+
+
+/**
+ * Get an empty job from the encoder queue. The queue grows as needed, so
+ * this never blocks.
+ */
+static ProxyJob *newJob(ProxyJobType type, MRProxy *p) {
+	ProxyJob *j = (ProxyJob*) prod_own(queue);
+	if (!j) {
+		log_error("proxy : no free job buffers!\n");
+		finish(-1);
+	}
+	j->type = type;
+	j->proxy = p;
+	return j;
+}
+
+
+void proxyWrite(MRProxy *p, const MR_SAMPLE **in, unsigned long len) {
+	while (len) {
+		unsigned long n = len < PROXY_BLOCK ? len : PROXY_BLOCK;
+		unsigned long f;
+		int k, s;
+
+		// One side at a time, so the loops run on contiguous arrays.
+		for (s = 0; s < proxyChannels; s++) {
+			float *sum = sums[s];
+			memset(sum, 0, n * sizeof(float));
+			for (k = 0; k < devCount * MR_CHANNELS; k++) {
+				float g = mix[k][s];
+				const MR_SAMPLE *x = in[k];
+				if (x && g != 0)
+					for (f = 0; f < n; f++)
+						sum[f] += g * x[f];
+			}
+		}
+
+		ProxyJob *j = newJob(PJOB_WRITE, p);
+		float *d = j->data;
+		for (s = 0; s < proxyChannels; s++)
+			for (f = 0; f < n; f++) {
+				float v = sums[s][f];
+				d[f * proxyChannels + s] = v > 1 ? 1 : v < -1 ? -1 : v;
+			}
+
+		j->len = n;
+		prod_free(queue);
+
+		for (k = 0; k < devCount * MR_CHANNELS; k++)
+			if (in[k])
+				in[k] += n;
+		len -= n;
+	}
+}
+
+
+void proxyClose(MRProxy *p) {
+	newJob(PJOB_CLOSE, p);
+	prod_free(queue);
+}
+
+
+void stopProxy() {
+	if (!queue)
+		return;
+	proxyExit = 1;
+	if (pthread_join(encoderThread, NULL))
+		printf("error joining thread.");
+}
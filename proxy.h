@@ -0,0 +1,90 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#include "multirec.h"
+
+
+/**
+ * proxy.c
+ * Listening copy of each take, made while it is recorded: the channels are
+ * mixed down to stereo (or mono) and encoded to proxy.ogg (Ogg Vorbis) in
+ * the take dir, on the first volume. The disk worker mixes the frames from
+ * its rings as soon as every card has written them; the encoding is done by
+ * a thread of its own, so it never holds up the .wav files. When the take
+ * stops, only the last block is left to encode.
+ *
+ * Enabled by "set proxy <channels>" (1 or 2). The mix comes from "mix" lines
+ * in multirec.rc, one per channel:
+ *
+ *   mix <channel> <left dB> [<right dB>]
+ *
+ * where "off" leaves the channel out of that side, and a single gain goes
+ * to both sides. A mono proxy takes the mean of both gains. Channels with no
+ * mix line are left out; with no mix line at all, every channel is spread
+ * evenly from left to right, in order, at equal power.
+ */
+
+/** Frames mixed per encoder job */
+#define PROXY_BLOCK 8192
+
+typedef struct MRProxy_s {
+	SNDFILE *file;
+	char path[600];
+
+	// Worker side: next timeline frame to mix
+	unsigned long long pos;
+} MRProxy;
+
+
+/** Channels of the proxy (0 = none), set by the proxy option */
+extern unsigned int proxyChannels;
+
+/** Vorbis quality of the proxy, 0 to 10, set by the proxy_q option */
+extern unsigned int proxyQuality;
+
+
+/**
+ * Parse the arguments of a "mix" line. Returns -1 on errors.
+ */
+int mixParse(char *args);
+
+/** Set up the mix, and start the encoder thread, if enabled. */
+void initProxy();
+
+/** Create the proxy file of a take. Returns NULL if disabled or on error. */
+MRProxy *proxyOpen(const char *path);
+
+/**
+ * Mix len frames of the channels into the proxy, and queue them to the
+ * encoder. in holds one pointer per channel, in a, b, c... order: NULL for
+ * the channels not recorded.
+ */
+void proxyWrite(MRProxy *p, const MR_SAMPLE **in, unsigned long len);
+
+/** Queue the finalization of a proxy, after its pending frames. */
+void proxyClose(MRProxy *p);
+
+/** Wait for the encoder to finish its queue, then stop it. */
+void stopProxy();
+
+
+#endif /* PROXY_H_ */
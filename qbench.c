@@ -0,0 +1,313 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * qbench.c
+ * DualQueue stress test and microbenchmark. A producer and a consumer thread
+ * pass numbered buckets through one queue, each at its own rate and burst
+ * size, as a capture thread and the disk worker do.
+ *
+ * Every bucket carries its sequence number and a fill pattern. The consumer
+ * checks that the numbers come in order (none lost, none duplicated) and that
+ * the pattern is intact, then poisons the bucket; the producer checks that
+ * every bucket it gets was poisoned, i.e. consumed. Starting with few buckets
+ * makes the queue grow() under pressure.
+ *
+ * The duration of each prod_own / prod_free / cons_own / cons_free call is
+ * measured, and reported as percentiles.
+ *
+ * Usage: mrqbench [-n buckets to pass] [-b initial buckets] [-s bucket size]
+ *                 [-p producer rate] [-P producer burst]
+ *                 [-c consumer rate] [-C consumer burst] [-i idle us]
+ *   Rates are in buckets per second, 0 = as fast as possible. A thread
+ *   passes a burst of buckets back to back, then waits for its rate to catch
+ *   up. -i is how long the consumer sleeps when the queue is empty (0 = just
+ *   yield).
+ *
+ * The exit status is 0 if no errors were found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "buffer_queue.h"
+
+
+/** Byte a consumed bucket is filled with */
+#define POISON 0xee
+
+/** Per-operation timings kept for the percentiles, at most */
+#define MAX_SAMPLES 4000000
+
+typedef struct OpStats_s {
+	const char *name;
+	unsigned int *ns;
+	unsigned long count;
+	unsigned long long sum;
+} OpStats;
+
+enum { PROD_OWN=0, PROD_FREE, CONS_OWN, CONS_FREE, OP_COUNT };
+
+static OpStats ops[OP_COUNT] = {
+	{ "prod_own" }, { "prod_free" }, { "cons_own" }, { "cons_free" }
+};
+
+
+static unsigned long total = 1000000;
+static unsigned int bucketCount = 2;
+static unsigned int bucketSize = 64;
+static double prodRate = 0, consRate = 0;
+static unsigned int prodBurst = 1, consBurst = 1;
+static unsigned int idleMicros = 0;
+
+static DualQueue *dq;
+static volatile int prodDone = 0;
+
+// Results
+static unsigned long nullOwns = 0, overwrites = 0, grows = 0;
+static unsigned long consumed = 0, lost = 0, duplicated = 0, corrupted = 0;
+static unsigned long emptyPolls = 0;
+
+
+static unsigned long long now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+
+static void record(OpStats *s, unsigned long long ns) {
+	if (s->count < MAX_SAMPLES)
+		s->ns[s->count] = ns > 0xffffffffULL ? 0xffffffff : ns;
+	s->count++;
+	s->sum += ns;
+}
+
+
+/**
+ * Sleep until the n-th item is due, at the given rate, starting from t0.
+ */
+static void pace(unsigned long long t0, unsigned long n, double rate) {
+	if (!rate)
+		return;
+
+	unsigned long long due = t0 + n * 1e9 / rate;
+	long long wait = due - now();
+	if (wait > 0)
+		usleep(wait / 1000);
+}
+
+
+static void fill(unsigned char *p, unsigned long seq) {
+	memcpy(p, &seq, sizeof(seq));
+	memset(p + sizeof(seq), seq & 0xff, bucketSize - sizeof(seq));
+}
+
+
+static int poisoned(const unsigned char *p) {
+	unsigned int i;
+	int zero = 1, poison = 1;
+	for (i = 0; i < bucketSize; i++) {
+		zero &= p[i] == 0;      // fresh from createBucket()
+		poison &= p[i] == POISON;
+	}
+	return zero || poison;
+}
+
+
+static void *producer(void *arg) {
+	unsigned long long t0 = now(), t;
+	unsigned long seq;
+
+	for (seq = 0; seq < total; seq++) {
+		if (seq % prodBurst == 0)
+			pace(t0, seq, prodRate);
+
+		t = now();
+		unsigned char *p = prod_own(dq);
+		record(&ops[PROD_OWN], now() - t);
+		if (!p) {
+			nullOwns++;
+			seq--;
+			sched_yield();
+			continue;
+		}
+
+		if (!poisoned(p))
+			overwrites++;
+		fill(p, seq);
+
+		t = now();
+		prod_free(dq);
+		record(&ops[PROD_FREE], now() - t);
+
+		// Only this thread calls prod_free(), so the flag is ours.
+		if (has_grown())
+			grows++;
+	}
+
+	prodDone = 1;
+	return NULL;
+}
+
+
+static void *consumer(void *arg) {
+	unsigned long long t0 = now(), t;
+	unsigned long expected = 0;
+
+	while (1) {
+		if (consumed % consBurst == 0)
+			pace(t0, consumed, consRate);
+
+		// Read the flag first: everything produced before it was set is then
+		// sure to be seen by cons_own().
+		int done = prodDone;
+		__sync_synchronize();
+
+		t = now();
+		unsigned char *p = cons_own(dq);
+		record(&ops[CONS_OWN], now() - t);
+		if (!p) {
+			if (done)
+				break;
+			emptyPolls++;
+			if (idleMicros)
+				usleep(idleMicros);
+			else
+				sched_yield();
+			continue;
+		}
+
+		unsigned long seq;
+		memcpy(&seq, p, sizeof(seq));
+		if (seq < expected)
+			duplicated++;
+		else {
+			lost += seq - expected;
+			expected = seq + 1;
+		}
+
+		unsigned int i;
+		for (i = sizeof(seq); i < bucketSize; i++)
+			if (p[i] != (seq & 0xff)) {
+				corrupted++;
+				break;
+			}
+		memset(p, POISON, bucketSize);
+		consumed++;
+
+		t = now();
+		cons_free(dq);
+		record(&ops[CONS_FREE], now() - t);
+	}
+
+	lost += total - expected;
+	return NULL;
+}
+
+
+static int compareUInt(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+	return x < y ? -1 : x > y;
+}
+
+
+static void printStats(OpStats *s) {
+	unsigned long n = s->count < MAX_SAMPLES ? s->count : MAX_SAMPLES;
+	if (!n) {
+		printf("%-10s: no calls\n", s->name);
+		return;
+	}
+
+	qsort(s->ns, n, sizeof(unsigned int), compareUInt);
+	printf("%-10s: %9lu calls, avg %6llu ns, p50 %6u, p90 %6u, p99 %6u, "
+			"p99.9 %7u, max %8u ns\n", s->name, s->count, s->sum / s->count,
+			s->ns[n / 2], s->ns[n * 9 / 10], s->ns[n * 99 / 100],
+			s->ns[n * 999 / 1000], s->ns[n - 1]);
+}
+
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:b:s:p:P:c:C:i:")) != -1) {
+		switch (opt) {
+		case 'n': total = strtoul(optarg, NULL, 10); break;
+		case 'b': bucketCount = atoi(optarg); break;
+		case 's': bucketSize = atoi(optarg); break;
+		case 'p': prodRate = atof(optarg); break;
+		case 'P': prodBurst = atoi(optarg); break;
+		case 'c': consRate = atof(optarg); break;
+		case 'C': consBurst = atoi(optarg); break;
+		case 'i': idleMicros = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-n buckets] [-b initial buckets] "
+					"[-s bucket size] [-p producer rate] [-P producer burst] "
+					"[-c consumer rate] [-C consumer burst] [-i idle us]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+	if (bucketCount < 1 || bucketCount > 255 || bucketSize < sizeof(long)
+			|| !prodBurst || !consBurst) {
+		fprintf(stderr, "bad parameters\n");
+		return 2;
+	}
+
+	int i;
+	for (i = 0; i < OP_COUNT; i++)
+		ops[i].ns = malloc(MAX_SAMPLES * sizeof(unsigned int));
+
+	printf("%lu buckets of %u bytes, %u to start with\n", total, bucketSize,
+			bucketCount);
+	printf("producer: %.0f/s (0 = max), bursts of %u\n", prodRate, prodBurst);
+	printf("consumer: %.0f/s (0 = max), bursts of %u\n", consRate, consBurst);
+
+	dq = create(bucketCount, bucketSize);
+
+	pthread_t prod, cons;
+	unsigned long long t0 = now();
+	if (pthread_create(&cons, NULL, consumer, NULL)
+			|| pthread_create(&prod, NULL, producer, NULL)) {
+		printf("error creating thread.");
+		return 2;
+	}
+	pthread_join(prod, NULL);
+	pthread_join(cons, NULL);
+	double secs = (now() - t0) / 1e9;
+
+	printf("\n%.2f s, %.0f buckets/s\n", secs, consumed / secs);
+	for (i = 0; i < OP_COUNT; i++)
+		printStats(&ops[i]);
+	printf("queue grew %lu times, to %d buckets; %lu empty polls\n", grows,
+			queue_size(dq), emptyPolls);
+
+	unsigned long errors = nullOwns + overwrites + lost + duplicated + corrupted
+			+ (consumed != total);
+	printf("consumed %lu, lost %lu, duplicated %lu, corrupted %lu, "
+			"overwritten %lu, null prod_own %lu\n", consumed, lost, duplicated,
+			corrupted, overwrites, nullOwns);
+	printf("%s\n", errors ? "FAILED" : "OK");
+
+	return errors ? 1 : 0;
+}
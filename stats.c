@@ -0,0 +1,266 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "volume.h"
+
+/** Snapshot file, and the temp file it is written to before being renamed */
+#define STATS_FILE "multirec.prom"
+#define STATS_TMP_FILE "multirec.prom.tmp"
+
+unsigned int statsMillis = 0;
+
+MRHist requestHist;
+MRHist ackHist;
+volatile unsigned long ackTimeouts = 0;
+
+static pthread_t statsThread;
+static volatile int statsExit = 0;
+
+
+static int bucketIndex(unsigned long long v) {
+	if (v < HIST_SUB)
+		return v;
+
+	int e = 63 - __builtin_clzll(v);
+	int idx = (e - HIST_SUB_BITS + 1) * HIST_SUB
+			+ ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+
+/** Highest value falling in the specified bucket */
+static unsigned long long bucketTop(int idx) {
+	if (idx < HIST_SUB)
+		return idx;
+
+	int e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	unsigned long long sub = HIST_SUB + idx % HIST_SUB;
+	return ((sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+
+void histAdd(MRHist *h, unsigned long long us) {
+	h->bucket[bucketIndex(us)]++;
+	h->sum += us;
+	if (us > h->max)
+		h->max = us;
+	h->count++;
+}
+
+
+void histAddCycles(MRHist *h, unsigned long long cycles) {
+	histAdd(h, cycles / (CPMillis / 1000));
+}
+
+
+unsigned long long histQuantile(const MRHist *h, double q) {
+	unsigned long long count = h->count;
+	if (!count)
+		return 0;
+
+	unsigned long long target = q * count + 0.5, seen = 0;
+	if (target < 1)
+		target = 1;
+
+	int i;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= target)
+			break;
+	}
+
+	unsigned long long top = bucketTop(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+	return top < h->max ? top : h->max;
+}
+
+
+/**
+ * Write one histogram as a Prometheus summary, plus its max as a gauge.
+ */
+static void writeHist(FILE *f, const char *name, const char *label,
+		const MRHist *h) {
+	static const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999", NULL };
+	static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+	int i;
+
+	for (i = 0; quantiles[i]; i++)
+		fprintf(f, "%s{%s,quantile=\"%s\"} %llu\n", name, label, quantiles[i],
+				histQuantile(h, qs[i]));
+	fprintf(f, "%s_sum{%s} %llu\n", name, label, h->sum);
+	fprintf(f, "%s_count{%s} %llu\n", name, label, h->count);
+	fprintf(f, "%s_max{%s} %llu\n", name, label, h->max);
+}
+
+
+/** Device histograms, in the order they are exported */
+static const struct {
+	const char *name, *help;
+	size_t offset;
+} devHists[] = {
+	{ "multirec_capture_wait_us", "Time spent in snd_pcm_wait()",
+			offsetof(MRDevStats, wait) },
+	{ "multirec_capture_read_us", "Duration of snd_pcm_readi()",
+			offsetof(MRDevStats, read) },
+	{ "multirec_period_jitter_us", "Deviation of the time between reads from the period time",
+			offsetof(MRDevStats, jitter) },
+	{ "multirec_queue_latency_us", "Time from chunk commit to the worker picking it up",
+			offsetof(MRDevStats, queue) },
+	{ "multirec_conve_us", "Duration of the drift correction of a chunk",
+			offsetof(MRDevStats, conv) },
+	{ NULL, NULL, 0 }
+};
+
+
+/**
+ * Write a snapshot of all counters. The file is written aside, then renamed
+ * over the old one, so readers never see a partial snapshot.
+ */
+static void writeStats() {
+	FILE *f = fopen(STATS_TMP_FILE, "w");
+	if (!f)
+		return;
+
+	char label[300];
+	int i, d;
+
+	for (i = 0; devHists[i].name; i++) {
+		fprintf(f, "# HELP %s %s\n", devHists[i].name, devHists[i].help);
+		fprintf(f, "# TYPE %s summary\n", devHists[i].name);
+		for (d = 0; d < devCount; d++) {
+			snprintf(label, sizeof(label), "dev=\"%s\"", devices[d]->name);
+			writeHist(f, devHists[i].name, label,
+					(MRHist*) ((char*) &devices[d]->stats + devHists[i].offset));
+		}
+	}
+
+	fprintf(f, "# HELP multirec_drift_ratio Current drift correction ratio\n");
+	fprintf(f, "# TYPE multirec_drift_ratio gauge\n");
+	for (d = 0; d < devCount; d++)
+		fprintf(f, "multirec_drift_ratio{dev=\"%s\"} %.9f\n", devices[d]->name,
+				devices[d]->stats.ratio);
+
+	fprintf(f, "# HELP multirec_drift_ppm Clock drift against the master, as tracked\n");
+	fprintf(f, "# TYPE multirec_drift_ppm gauge\n");
+	for (d = 0; d < devCount; d++)
+		fprintf(f, "multirec_drift_ppm{dev=\"%s\"} %.3f\n", devices[d]->name,
+				devices[d]->drift.ppm);
+
+	fprintf(f, "# HELP multirec_drift_ppm_error Standard error of the drift estimate (0 = not tracked yet)\n");
+	fprintf(f, "# TYPE multirec_drift_ppm_error gauge\n");
+	for (d = 0; d < devCount; d++)
+		fprintf(f, "multirec_drift_ppm_error{dev=\"%s\"} %.3f\n",
+				devices[d]->name, devices[d]->drift.ppmError);
+
+	fprintf(f, "# HELP multirec_drift_phase_frames Distance of the output from the master timeline\n");
+	fprintf(f, "# TYPE multirec_drift_phase_frames gauge\n");
+	for (d = 0; d < devCount; d++)
+		fprintf(f, "multirec_drift_phase_frames{dev=\"%s\"} %.1f\n",
+				devices[d]->name, devices[d]->drift.phase);
+
+	fprintf(f, "# HELP multirec_output_frames Output frames produced so far\n");
+	fprintf(f, "# TYPE multirec_output_frames counter\n");
+	for (d = 0; d < devCount; d++)
+		fprintf(f, "multirec_output_frames{dev=\"%s\"} %llu\n",
+				devices[d]->name, devices[d]->outputFrameCount);
+
+	fprintf(f, "# HELP multirec_state_latency_us Time from a request to its handling, and for all devices to follow a state change\n");
+	fprintf(f, "# TYPE multirec_state_latency_us summary\n");
+	writeHist(f, "multirec_state_latency_us", "stage=\"request\"", &requestHist);
+	writeHist(f, "multirec_state_latency_us", "stage=\"ack\"", &ackHist);
+
+	fprintf(f, "# HELP multirec_state_ack_timeouts_total Devices that missed a state change\n");
+	fprintf(f, "# TYPE multirec_state_ack_timeouts_total counter\n");
+	fprintf(f, "multirec_state_ack_timeouts_total %lu\n", ackTimeouts);
+
+	fprintf(f, "# HELP multirec_write_us Duration of sf_writef_short()\n");
+	fprintf(f, "# TYPE multirec_write_us summary\n");
+	for (i = 0; i < volCount; i++) {
+		snprintf(label, sizeof(label), "volume=\"%s\"", volumes[i]->root);
+		writeHist(f, "multirec_write_us", label, &volumes[i]->writeHist);
+	}
+
+	fprintf(f, "# HELP multirec_commit_us Duration of a header update + fdatasync() pass\n");
+	fprintf(f, "# TYPE multirec_commit_us summary\n");
+	for (i = 0; i < volCount; i++) {
+		snprintf(label, sizeof(label), "volume=\"%s\"", volumes[i]->root);
+		writeHist(f, "multirec_commit_us", label, &volumes[i]->commitHist);
+	}
+
+	fprintf(f, "# HELP multirec_volume_throughput_bytes Measured write throughput\n");
+	fprintf(f, "# TYPE multirec_volume_throughput_bytes gauge\n");
+	for (i = 0; i < volCount; i++)
+		fprintf(f, "multirec_volume_throughput_bytes{volume=\"%s\"} %.0f\n",
+				volumes[i]->root, volumes[i]->throughput);
+
+	fprintf(f, "# HELP multirec_write_errors_total Failed writes\n");
+	fprintf(f, "# TYPE multirec_write_errors_total counter\n");
+	for (i = 0; i < volCount; i++)
+		fprintf(f, "multirec_write_errors_total{volume=\"%s\"} %lu\n",
+				volumes[i]->root, volumes[i]->writeErrors);
+
+	fprintf(f, "# HELP multirec_volume_open_files Files placed on the volume\n");
+	fprintf(f, "# TYPE multirec_volume_open_files gauge\n");
+	for (i = 0; i < volCount; i++)
+		fprintf(f, "multirec_volume_open_files{volume=\"%s\"} %d\n",
+				volumes[i]->root, volumes[i]->openFiles);
+
+	fclose(f);
+	rename(STATS_TMP_FILE, STATS_FILE);
+}
+
+
+/**
+ * Export thread code: rewrite the snapshot every statsMillis milliseconds.
+ */
+static void *statsLoop(void *arg) {
+	while (!statsExit) {
+		usleep(statsMillis * 1000);
+		writeStats();
+	}
+	return NULL;
+}
+
+
+void initStats() {
+	if (!statsMillis)
+		return;
+
+	if (pthread_create(&statsThread, NULL, statsLoop, NULL)) {
+		printf("error creating thread.");
+		statsMillis = 0;
+	}
+}
+
+
+void stopStats() {
+	if (!statsMillis)
+		return;
+
+	statsExit = 1;
+	if (pthread_join(statsThread, NULL)) {
+		printf("error joining thread.");
+	}
+	writeStats();
+}
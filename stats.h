@@ -0,0 +1,92 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+
+/**
+ * stats.c
+ * Live performance counters. Each pipeline stage records its timings into
+ * histograms owned by the thread running it, so recording costs no locks:
+ * just a rdtsc() and a few additions. A background thread periodically
+ * rewrites a snapshot of all counters to a text file, in the Prometheus
+ * exposition format (see initStats()).
+ *
+ * Histograms are log-linear, like HDR histograms: values (in microseconds)
+ * below 8 get a bucket each, then every power of two is split into 8 buckets,
+ * so quantiles are accurate within 12.5%.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)   // up to 2^41 us
+
+typedef struct MRHist_s {
+	unsigned long long count, sum, max;
+	unsigned long bucket[HIST_BUCKETS];
+} MRHist;
+
+
+/**
+ * Per-device counters. Capture timings are written by the device thread, the
+ * other ones by the disk worker.
+ */
+typedef struct MRDevStats_s {
+	MRHist wait;      // time spent in snd_pcm_wait()
+	MRHist read;      // snd_pcm_readi() duration
+	MRHist jitter;    // deviation of the time between reads from the period time
+	MRHist queue;     // time from commitChunk() to the worker picking the chunk up
+	MRHist conv;      // conve() duration (slaves only)
+
+	volatile double ratio;            // current drift correction ratio
+	unsigned long long lastReadTS;    // timestamp of the previous read
+} MRDevStats;
+
+
+/** Export period in milliseconds (0 = no export) */
+extern unsigned int statsMillis;
+
+/** Time from a start/next/stop/quit request to the main thread handling it */
+extern MRHist requestHist;
+
+/** Time for all device threads to reach a state change (start, stop) */
+extern MRHist ackHist;
+
+/** State changes some device thread missed, by not answering in time */
+extern volatile unsigned long ackTimeouts;
+
+
+/** Record a value, in microseconds. */
+void histAdd(MRHist *h, unsigned long long us);
+
+/** Record a duration measured by rdtsc(). */
+void histAddCycles(MRHist *h, unsigned long long cycles);
+
+/** Estimate the value below which the q fraction (0..1) of values fall. */
+unsigned long long histQuantile(const MRHist *h, double q);
+
+/** Start the export thread, if enabled. */
+void initStats();
+
+/** Write a last snapshot, and stop the export thread. */
+void stopStats();
+
+
+#endif /* STATS_H_ */
@@ -0,0 +1,434 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "multirec.h"
+#include "volume.h"
+#include "proxy.h"
+#include "log.h"
+
+
+/**
+ * take.c
+ * Output files of the takes: naming, placement on the output volumes, opening
+ * and closing.
+ */
+
+
+static int dirNameFilter(const struct dirent *fname)
+{
+	// dir name pattern is "trackname-NN"
+	//   N = attempt number (zero padded)
+	int tLen = strlen(trackName);
+	return (strlen(fname->d_name) == tLen+3 &&
+			strncmp(fname->d_name, trackName, tLen)==0 &&
+	        fname->d_name[tLen]=='-' &&
+	        fname->d_name[tLen+1]>='0' && fname->d_name[tLen+1]<='9' &&
+	        fname->d_name[tLen+2]>='0' && fname->d_name[tLen+2]<='9') ? 1 : 0;
+}
+
+
+/**
+ * Derive the file name for a channel of a take. Without rollover, the pattern
+ * is "c.ext"; with rollover, segments are numbered from 1, as in "c-SSS.ext".
+ */
+static void segmentFileName(MRTake *t, int dev, int chan, int seg,
+		const char *ext, char *fname) {
+	char id = 'a'+((dev*MR_CHANNELS)+chan);
+	if(t->segFrames)
+		sprintf(fname, "%c-%03d.%s", id, seg+1, ext);
+	else
+		sprintf(fname, "%c.%s", id, ext);
+}
+
+
+/**
+ * Full path of a take file on the specified volume: "ROOT/DIR-NN/name".
+ */
+static void takeFilePath(MRTake *t, int vol, const char *name, char *path) {
+	sprintf(path, "%s/%s/%s", volumes[vol]->root, t->dir, name);
+}
+
+
+/**
+ * When a take is spread over several volumes, a manifest in its dir on the
+ * first volume lists where each file lives, one "name<TAB>path" line per file.
+ */
+static void addToManifest(MRTake *t, const char *name, const char *path) {
+	char fname[600];
+	takeFilePath(t, 0, "manifest.txt", fname);
+	FILE *f = fopen(fname, "a");
+	if(!f) {
+		log_error("Error writing %s\n", fname);
+		return;
+	}
+	fprintf(f, "%s\t%s\n", name, path);
+	fclose(f);
+}
+
+
+/**
+ * Record in the take's gaps.txt (on the first volume) that the channels of a
+ * device hold silence over the output frames [from, to), because the card was
+ * gone. One "channel<TAB>from<TAB>to" line per channel, in frames from the
+ * start of the take.
+ */
+void addGap(MRTake *t, int dev, unsigned long long from,
+		unsigned long long to) {
+	char fname[600];
+	takeFilePath(t, 0, "gaps.txt", fname);
+	FILE *f = fopen(fname, "a");
+	if(!f) {
+		log_error("Error writing %s\n", fname);
+		return;
+	}
+	int chan;
+	for(chan=0; chan<MR_CHANNELS; chan++)
+		if(t->dev[dev].armed & 1<<chan)
+			fprintf(f, "%c\t%llu\t%llu\n", 'a'+((dev*MR_CHANNELS)+chan),
+					from - t->startFrame, to - t->startFrame);
+	fclose(f);
+}
+
+
+/**
+ * Record in the take's silence.txt (on the first volume) that the frames
+ * [from, to) of a channel's file, in frames from the start of the file, were
+ * silent and left out of it (see silenceMillis). One "file<TAB>from<TAB>to"
+ * line per stretch, with the file named as in the manifest; mrexpand puts the
+ * silence back.
+ */
+void addSilence(MRTake *t, int dev, int chan, int seg, unsigned long long from,
+		unsigned long long to) {
+	char name[32], fname[600];
+	takeFilePath(t, 0, "silence.txt", fname);
+	FILE *f = fopen(fname, "a");
+	if(!f) {
+		log_error("Error writing %s\n", fname);
+		return;
+	}
+	segmentFileName(t, dev, chan, seg, "wav", name);
+	fprintf(f, "%s\t%llu\t%llu\n", name, from, to);
+	fclose(f);
+}
+
+
+/**
+ * Drop from the manifest the files that no longer exist, i.e. the ones opened
+ * ahead for a segment that never started.
+ */
+static void pruneManifest(MRTake *t) {
+	char fname[600], tmpName[610], line[1024];
+	takeFilePath(t, 0, "manifest.txt", fname);
+	sprintf(tmpName, "%s.tmp", fname);
+
+	FILE *in = fopen(fname, "r");
+	if(!in)
+		return;
+	FILE *out = fopen(tmpName, "w");
+	if(!out) {
+		fclose(in);
+		return;
+	}
+
+	while(fgets(line, sizeof(line), in)) {
+		char *path = strchr(line, '\t');
+		if(!path)
+			continue;
+		path++;
+		path[strcspn(path, "\n")] = '\0';
+		if(access(path, F_OK) == 0)
+			fprintf(out, "%s\n", line);
+	}
+
+	fclose(in);
+	fclose(out);
+	rename(tmpName, fname);
+}
+
+
+/**
+ * Close and remove the files opened ahead for segment seg of a take device,
+ * which never got any data. Returns whether there were any.
+ */
+static int dropNextFiles(MRTake *t, int dev, int seg) {
+	MRTakeDev *td = &t->dev[dev];
+	char name[32], fname[600];
+	int chan, dropped = 0;
+	for(chan=0; chan<MR_CHANNELS; chan++) {
+		if(td->nextFile[chan]) {
+			sf_close(td->nextFile[chan]);
+			td->nextFile[chan] = NULL;
+			volumeRelease(td->nextVol[chan]);
+			segmentFileName(t, dev, chan, seg, "wav", name);
+			takeFilePath(t, td->nextVol[chan], name, fname);
+			unlink(fname);
+			dropped = 1;
+		}
+		if(td->nextPeaks[chan]) {
+			peaksClose(td->nextPeaks[chan]);
+			td->nextPeaks[chan] = NULL;
+			segmentFileName(t, dev, chan, seg, "peaks", name);
+			takeFilePath(t, td->nextVol[chan], name, fname);
+			unlink(fname);
+		}
+	}
+	return dropped;
+}
+
+
+/**
+ * Open the files of the specified segment of a take, for one device, and
+ * park them in its nextFile slots. The worker moves them in place when the
+ * device reaches the segment.
+ * Each file goes to the volume picked by pickVolume(), where the take dir is
+ * created on first use.
+ * Returns -1 on error, after removing the files of the segment opened so far.
+ */
+int openSegment(MRTake *t, int dev, int seg) {
+	MRTakeDev *td = &t->dev[dev];
+	char name[32], fname[600];
+	int chan;
+	for(chan=0; chan<MR_CHANNELS; chan++) {
+		if(!(td->armed & 1<<chan))
+			continue;
+
+		int vol = pickVolume();
+		td->nextVol[chan] = vol;
+
+		takeFilePath(t, vol, "", fname);
+		if(mkdir(fname, 0777) == -1 && errno != EEXIST) {
+			log_error("Error creating rec dir %s\n", fname);
+			volumeRelease(vol);
+			dropNextFiles(t, dev, seg);
+			return -1;
+		}
+
+		segmentFileName(t, dev, chan, seg, "wav", name);
+		takeFilePath(t, vol, name, fname);
+		
+		// Open one mono wav file per channel per device.
+		SF_INFO sfi;
+		sfi.samplerate = outRate;
+		sfi.channels = 1;
+		sfi.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
+		
+		log_debug("Trying to open %s ... ", fname);
+
+		// Open the file descriptor ourselves, so that the volume writer can
+		// fdatasync() it while recording.
+		td->nextFd[chan] = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if(td->nextFd[chan] < 0) {
+			log_debug("  %s\n", strerror(errno));
+			volumeRelease(vol);
+			dropNextFiles(t, dev, seg);
+			return -1;
+		}
+
+		// With close_desc set, libsndfile closes the descriptor on failure
+		// too: closing it again could close one another thread just opened.
+		td->nextFile[chan] = sf_open_fd(td->nextFd[chan], SFM_WRITE, &sfi, 1);
+
+		if(td->nextFile[chan]==NULL) {
+			log_debug("  %s\n", sf_strerror (NULL));
+			unlink(fname);
+			volumeRelease(vol);
+			dropNextFiles(t, dev, seg);
+			return -1;
+		}
+		
+		log_debug("  OK.\n");
+
+		if(volCount > 1)
+			addToManifest(t, name, fname);
+
+		if(writePeaks) {
+			segmentFileName(t, dev, chan, seg, "peaks", name);
+			takeFilePath(t, vol, name, fname);
+			td->nextPeaks[chan] = peaksOpen(fname, outRate);
+			if(!td->nextPeaks[chan])
+				log_error("Error creating %s\n", fname);
+		}
+	}
+
+	// Publish the files before the segment number.
+	__sync_synchronize();
+	td->nextSegment = seg;
+	return 0;
+}
+
+
+/**
+ * Remove what a take which failed to open left behind: the files of the
+ * first segment of devices 0 to devs - 1, the manifest and the take dirs, so
+ * that it doesn't use up the take number.
+ */
+static void dropTake(MRTake *t, int devs) {
+	char fname[600];
+	int i, chan, v;
+	for(i=0; i<devs; i++) {
+		MRTakeDev *td = &t->dev[i];
+		for(chan=0; chan<MR_CHANNELS; chan++) {
+			td->nextFile[chan] = td->outFile[chan];
+			td->nextPeaks[chan] = td->outPeaks[chan];
+			td->nextVol[chan] = td->outVol[chan];
+			td->outFile[chan] = NULL;
+			td->outPeaks[chan] = NULL;
+		}
+		dropNextFiles(t, i, 0);
+	}
+
+	takeFilePath(t, 0, "manifest.txt", fname);
+	unlink(fname);
+	for(v=0; v<volCount; v++) {
+		takeFilePath(t, v, "", fname);
+		rmdir(fname);
+	}
+}
+
+
+/**
+ * Create the output directory and .wav files for a new take.
+ * Dir name pattern is "ROOT/DIR-NN"
+ *   ROOT = output volume (the current dir, unless set in multirec.rc)
+ *   DIR = track name (passed in as program argument)
+ *   N = attempt number starting from 1 (zero padded)
+ * and files are named after the channel id (a = hw:0/left, b = hw:0/right,
+ * c = hw:1/left, ...). See segmentFileName(). Disarmed channels get no file.
+ * The attempt number is the first one free on all volumes.
+ * Returns NULL on error.
+ */
+MRTake *openTake() {
+	int lastNum = 0;
+
+	// Scan the contents of each root to find the next available attempt
+	// number for the current track.
+	int v;
+	for(v=0; v<volCount; v++) {
+		struct dirent **namelist;
+		int n;
+		n = scandir(volumes[v]->root, &namelist, dirNameFilter, alphasort);
+		if (n < 0) {
+			log_error("Error in scandir of %s. errno = %d \n",
+					volumes[v]->root, errno);
+			continue;
+		}
+		while(n--) {
+			int num = atoi( namelist[n]->d_name + strlen(trackName) + 1 );
+			if(num > lastNum)
+				lastNum = num;
+			free(namelist[n]);
+		}
+		free(namelist);
+	}
+
+	MRTake *t = calloc(1, sizeof(MRTake));
+	t->dev = calloc(devCount, sizeof(MRTakeDev));
+
+	// Segment length: the shortest of the time and size limits.
+	t->segFrames = (unsigned long long)segmentSecs * outRate;
+	unsigned long long sizeFrames =
+			(unsigned long long)segmentMBytes * 1024 * 1024 / sizeof(MR_SAMPLE);
+	if(sizeFrames && (!t->segFrames || sizeFrames < t->segFrames))
+		t->segFrames = sizeFrames;
+
+	// Increment attempt number and derive the new dir name.
+	sprintf(t->dir, "%s-%02d", trackName, lastNum + 1);
+
+	// Attempt to create the dir on the first volume (the other ones get it
+	// when they get a file). It must not already exist, otherwise bail.
+	char path[600];
+	takeFilePath(t, 0, "", path);
+	if(mkdir(path, 0777) == -1) {
+		log_error("Error creating rec dir\n");
+		closeTake(t);
+		return NULL;
+	}
+
+	// Recording directory created. Now go on and actually open new files,
+	// and move them in place.
+	int i, chan;
+	for(i=0; i<devCount; i++) {
+		MRTakeDev *td = &t->dev[i];
+		td->nextSegment = -1;
+		td->armed = MR_ALL_CHANNELS & ~devices[i]->disarmed;
+		if(openSegment(t, i, 0) < 0) {
+			dropTake(t, i);
+			closeTake(t);
+			return NULL;
+		}
+
+		for(chan=0; chan<MR_CHANNELS; chan++) {
+			td->outFile[chan] = td->nextFile[chan];
+			td->outFd[chan] = td->nextFd[chan];
+			td->outPeaks[chan] = td->nextPeaks[chan];
+			td->outVol[chan] = td->nextVol[chan];
+			td->nextFile[chan] = NULL;
+			td->nextPeaks[chan] = NULL;
+		}
+		td->nextSegment = -1;
+	}
+
+	takeFilePath(t, 0, "proxy.ogg", path);
+	t->proxy = proxyOpen(path);
+
+	return t;
+}
+
+
+/**
+ * Release a take and free it. Written files have already been handed to
+ * their volume writers by the worker, so only files which never got any data
+ * are left: the ones opened ahead for a segment that never started, which
+ * are removed (a take that failed to open was cleared by dropTake()).
+ */
+void closeTake(MRTake *t) {
+	int i, n, pruned = 0;
+	for(i=0; i<devCount; i++) {
+		MRTakeDev *td = &t->dev[i];
+		for(n=0; n<MR_CHANNELS; n++) {
+			if(td->outFile[n]) {
+				sf_close(td->outFile[n]);
+				volumeRelease(td->outVol[n]);
+			}
+			if(td->outPeaks[n])
+				peaksClose(td->outPeaks[n]);
+		}
+		// A failed openSegment() removed its own files: these are complete.
+		if(dropNextFiles(t, i, td->nextSegment))
+			pruned = 1;
+	}
+
+	if(pruned && volCount > 1)
+		pruneManifest(t);
+
+	log_debug("Take %s closed.\n", t->dir);
+
+	free(t->dev);
+	free(t);
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tap.h"
+#include "multirec.h"
+#include "log.h"
+
+
+char *tapName = NULL;
+unsigned int tapMillis = 2000;
+
+static MRTapHeader *tap = NULL;
+static short *ring;
+static size_t tapSize;
+
+
+int initTap() {
+	if (!tapName)
+		return 0;
+
+	unsigned int channels = devCount * MR_CHANNELS;
+	if (channels > TAP_MAX_CHANNELS) {
+		printf("tap %s: %u channels, the tap takes up to %d\n", tapName,
+				channels, TAP_MAX_CHANNELS);
+		return -1;
+	}
+
+	unsigned long long frames = (unsigned long long) tapMillis * outRate / 1000;
+	if (frames < 2 * TAP_BLOCK)
+		frames = 2 * TAP_BLOCK;
+	tapSize = TAP_HEADER_SIZE + frames * channels * sizeof(short);
+
+	// Truncating the object left over would crash its readers (SIGBUS):
+	// replace it with a new one instead.
+	shm_unlink(tapName);
+	int fd = shm_open(tapName, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		printf("tap %s: %s\n", tapName, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, tapSize) < 0) {
+		printf("tap %s: %s\n", tapName, strerror(errno));
+		close(fd);
+		shm_unlink(tapName);
+		return -1;
+	}
+	tap = mmap(NULL, tapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tap == MAP_FAILED) {
+		printf("tap %s: %s\n", tapName, strerror(errno));
+		tap = NULL;
+		shm_unlink(tapName);
+		return -1;
+	}
+
+	tap->rate = outRate;
+	tap->channels = channels;
+	tap->frames = frames;
+	tap->block = TAP_BLOCK;
+	tap->offset = TAP_HEADER_SIZE;
+	tap->live = 1;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	tap->ts = now.tv_sec * 1000000000LL + now.tv_nsec;
+	ring = (short*) ((char*) tap + TAP_HEADER_SIZE);
+
+	// The magic goes last: readers wait for it.
+	__sync_synchronize();
+	memcpy(tap->magic, TAP_MAGIC, sizeof(tap->magic));
+
+	log_error("tap %s : %u channels, %llu frames\n", tapName, channels,
+			frames);
+	return 0;
+}
+
+
+void tapWrite(const short **in, unsigned long len, unsigned int armed) {
+	unsigned int frames = tap->frames;
+	int k;
+
+	while (len) {
+		unsigned long n = len < TAP_BLOCK ? len : TAP_BLOCK;
+		unsigned long pos = tap->head % frames;
+		unsigned long m = frames - pos < n ? frames - pos : n;
+
+		tap->seq++;
+		__sync_synchronize();
+
+		for (k = 0; k < tap->channels; k++) {
+			short *r = ring + (size_t) k * frames;
+			if (in[k]) {
+				memcpy(r + pos, in[k], m * sizeof(short));
+				memcpy(r, in[k] + m, (n - m) * sizeof(short));
+				in[k] += n;
+			} else {
+				memset(r + pos, 0, m * sizeof(short));
+				memset(r, 0, (n - m) * sizeof(short));
+			}
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		__sync_synchronize();
+		tap->head += n;
+		tap->ts = now.tv_sec * 1000000000LL + now.tv_nsec;
+		tap->armed = armed;
+		__sync_synchronize();
+		tap->seq++;
+
+		len -= n;
+	}
+}
+
+
+void stopTap() {
+	if (!tap)
+		return;
+	tap->live = 0;
+	__sync_synchronize();
+	munmap(tap, tapSize);
+	tap = NULL;
+	shm_unlink(tapName);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TAP_H_
+#define TAP_H_
+
+#include <stdint.h>
+
+
+/**
+ * tap.c
+ * Live tap of the synchronized stream, for analyzers, streamers or live mixes
+ * running on the same machine: the disk worker publishes the frames of every
+ * channel, lined up on the output timeline, to a POSIX shared memory object
+ * named by "set tap <name>" (e.g. /multirec). Readers map it and read the
+ * audio in place. They never hold up the worker: one that falls behind by
+ * more than the ring just loses the oldest frames, and can tell.
+ *
+ * Layout (native endian). The header is padded to 4096 bytes, so the ring is
+ * page aligned:
+ *
+ *   MRTapHeader  header
+ *   int16_t      ring[channels][frames]   at offset
+ *
+ * Timeline frame f of channel n (a = 0, b = 1...) is ring[n][f % frames].
+ * Channels not recorded (see the disarm stage of dsp.h) are silent. The
+ * worker publishes up to block frames at a time, once every card has
+ * captured them.
+ *
+ * Reader protocol, lock free:
+ *   1. Snapshot: read seq, until it's even; read head, ts and armed; read seq
+ *      again, and start over if it changed.
+ *   2. The frames below head - frames + block may be being overwritten: a
+ *      reader that wants older ones was too slow, and skips to that frame.
+ *   3. Copy the frames wanted, below head, out of the ring.
+ *   4. Read head again: the frames copied which are now below
+ *      head - frames + block were overwritten during the copy, and are lost.
+ * live drops to 0 when multirec exits; the object is then removed. If
+ * multirec dies instead, live stays at 1: a reader should take the writer as
+ * gone once ts is older than TAP_STALE_MS plus TAP_STALE_BLOCKS blocks. A new
+ * multirec creates a new object under the same name, so readers of the old
+ * one must open it again.
+ */
+
+#define TAP_MAGIC "MRTAP001"
+#define TAP_HEADER_SIZE 4096
+
+/** Most frames published at once */
+#define TAP_BLOCK 4096
+
+/** Most channels, as many as bits in armed */
+#define TAP_MAX_CHANNELS 32
+
+/** Age of ts after which the writer is gone, if live is still set */
+#define TAP_STALE_MS 1000
+#define TAP_STALE_BLOCKS 4
+
+typedef struct MRTapHeader_s {
+	char magic[8];
+	uint32_t rate;                 // sample rate of the timeline
+	uint32_t channels;             // a, b, c... in multirec.rc order
+	uint32_t frames;               // ring length, per channel
+	uint32_t block;                // most frames published at once
+	uint64_t offset;               // of the ring, from the start of the object
+	volatile uint32_t live;        // 1 while multirec publishes
+	volatile uint32_t armed;       // bit n set: channel n is recorded
+
+	// Seqlock: odd while the writer publishes a block
+	volatile uint64_t seq;
+	volatile uint64_t head;        // timeline frames published so far
+	volatile int64_t ts;           // CLOCK_REALTIME of head (or of the
+	                               // creation), in ns
+} MRTapHeader;
+
+
+/** Name of the shared memory object, NULL (the default) if no tap */
+extern char *tapName;
+
+/** Ring length in milliseconds, set by the tap_ms option */
+extern unsigned int tapMillis;
+
+
+/**
+ * Create the shared memory object, if enabled, replacing any left over.
+ * Returns -1 on errors, or if there are more than TAP_MAX_CHANNELS channels.
+ */
+int initTap();
+
+/**
+ * Publish the next len frames of the timeline. in holds one pointer per
+ * channel, in a, b, c... order: NULL for the silent ones. armed is the
+ * channels recorded.
+ */
+void tapWrite(const short **in, unsigned long len, unsigned int armed);
+
+/** Tell the readers there's no more to come, and remove the object. */
+void stopTap();
+
+
+#endif /* TAP_H_ */
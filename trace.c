@@ -0,0 +1,204 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "multirec.h"
+#include "log.h"
+
+/** Spans kept per thread (a power of 2) */
+#define TRACE_RING_SIZE 32768
+
+
+unsigned int traceSecs = 0;
+
+
+typedef struct TraceEvent_s {
+	unsigned long long start, dur;   // rdtsc() cycles
+	const char *name, *argName;
+	long arg;
+} TraceEvent;
+
+/**
+ * Ring of the last spans of one thread. Only the owner thread writes it; a
+ * dump copies it while it goes on, and drops what may have been overwritten
+ * meanwhile.
+ */
+typedef struct TraceRing_s {
+	struct TraceRing_s *next;
+	int tid;
+	char name[48];
+	volatile unsigned long head;
+	TraceEvent ev[TRACE_RING_SIZE];
+} TraceRing;
+
+/** All the rings, newest first. Rings are never removed. */
+static TraceRing * volatile rings = NULL;
+static int ringCount = 0;
+
+static __thread TraceRing *myRing = NULL;
+
+static const char * volatile pendingDump = NULL;
+static int dumpCount = 0;
+static pthread_mutex_t dumpMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static TraceRing *newRing() {
+	TraceRing *r = calloc(1, sizeof(TraceRing));
+	r->tid = __sync_add_and_fetch(&ringCount, 1);
+	sprintf(r->name, "thread %d", r->tid);
+	do {
+		r->next = rings;
+	} while (!__sync_bool_compare_and_swap(&rings, r->next, r));
+	myRing = r;
+	return r;
+}
+
+
+void traceThread(const char *fmt, ...) {
+	if (!traceSecs)
+		return;
+
+	TraceRing *r = myRing ? myRing : newRing();
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(r->name, sizeof(r->name), fmt, args);
+	va_end(args);
+}
+
+
+unsigned long long traceStart() {
+	return traceSecs ? rdtsc() : 0;
+}
+
+
+void traceEnd(const char *name, unsigned long long start, const char *argName,
+		long arg) {
+	if (!start)
+		return;
+
+	TraceRing *r = myRing ? myRing : newRing();
+	unsigned long h = r->head;
+	TraceEvent *e = &r->ev[h % TRACE_RING_SIZE];
+	e->start = start;
+	e->dur = rdtsc() - start;
+	e->name = name;
+	e->argName = argName;
+	e->arg = arg;
+
+	__sync_synchronize();
+	r->head = h + 1;
+}
+
+
+void traceTrigger(const char *reason) {
+	if (traceSecs)
+		pendingDump = reason;
+}
+
+
+void traceCheck() {
+	const char *reason = pendingDump;
+	if (reason) {
+		pendingDump = NULL;
+		traceDump(reason);
+	}
+}
+
+
+/**
+ * Write the spans of one ring that end after since. Returns the number of
+ * spans written.
+ */
+static int dumpRing(FILE *f, TraceRing *r, TraceEvent *copy,
+		unsigned long long since, double cyclesPerUs) {
+	fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"name\":\"%s\"}}", r->tid, r->name);
+
+	// Copy the ring, then keep only what the owner can't have overwritten
+	// while we copied it.
+	unsigned long h1 = r->head;
+	__sync_synchronize();
+	memcpy(copy, r->ev, sizeof(r->ev));
+	__sync_synchronize();
+	unsigned long h2 = r->head;
+
+	unsigned long i = h1 > TRACE_RING_SIZE ? h1 - TRACE_RING_SIZE : 0;
+	if (h2 >= TRACE_RING_SIZE && i <= h2 - TRACE_RING_SIZE)
+		i = h2 - TRACE_RING_SIZE + 1;
+
+	int n = 0;
+	for (; i < h1; i++) {
+		TraceEvent *e = &copy[i % TRACE_RING_SIZE];
+		if (e->start + e->dur < since)
+			continue;
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f", e->name, r->tid,
+				((long long) (e->start - since)) / cyclesPerUs,
+				e->dur / cyclesPerUs);
+		if (e->argName)
+			fprintf(f, ",\"args\":{\"%s\":%ld}", e->argName, e->arg);
+		fprintf(f, "}");
+		n++;
+	}
+	return n;
+}
+
+
+void traceDump(const char *reason) {
+	if (!traceSecs || !CPMillis)
+		return;
+
+	pthread_mutex_lock(&dumpMutex);
+	unsigned long long now = rdtsc();
+	double cyclesPerUs = CPMillis / 1000.0;
+	unsigned long long since = now - (unsigned long long) traceSecs * CPMillis
+			* 1000;
+
+	char fname[64];
+	sprintf(fname, "multirec-trace-%02d.json", ++dumpCount);
+	FILE *f = fopen(fname, "w");
+	if (!f) {
+		log_error("trace: can't write %s\n", fname);
+		pthread_mutex_unlock(&dumpMutex);
+		return;
+	}
+
+	TraceEvent *copy = malloc(sizeof(TraceEvent) * TRACE_RING_SIZE);
+	int n = 0;
+	TraceRing *r;
+
+	// The reason of the dump marks its time, across all threads.
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,"
+			"\"tid\":0,\"ts\":%.3f}", reason, (now - since) / cyclesPerUs);
+	for (r = rings; r; r = r->next)
+		n += dumpRing(f, r, copy, since, cyclesPerUs);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	free(copy);
+
+	log_error("trace: %d spans dumped to %s (%s)\n", n, fname, reason);
+	pthread_mutex_unlock(&dumpMutex);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+
+/**
+ * trace.c
+ * Flight recorder of thread activity. Each thread records the spans it
+ * spends in capture, queueing, conversion, writes, barrier waits, ... into
+ * a ring of its own, overwriting the oldest ones. On demand (the 'd' key, or
+ * SIGUSR1), or when an xrun happens, the last traceSecs seconds of all rings
+ * are dumped to multirec-trace-NN.json, in the Chrome trace event format:
+ * open it in chrome://tracing or ui.perfetto.dev.
+ *
+ * A span is recorded as:
+ *
+ *   unsigned long long t = traceStart();
+ *   ...
+ *   traceEnd("read", t, "frames", len);
+ *
+ * Names must be literals. With tracing off (trace_s = 0), traceStart()
+ * returns 0 and traceEnd() returns at once.
+ */
+
+/** Seconds of history dumped, set by the trace_s option. 0 = tracing off. */
+extern unsigned int traceSecs;
+
+
+/** Name the calling thread in the traces. */
+void traceThread(const char *fmt, ...)
+		__attribute__ ((format (printf, 1, 2)));
+
+/** Timestamp of the start of a span, 0 if tracing is off. */
+unsigned long long traceStart();
+
+/** Record a span started at start, with one numeric argument (argName may be NULL). */
+void traceEnd(const char *name, unsigned long long start, const char *argName,
+		long arg);
+
+/**
+ * Ask for a dump, to be done by traceCheck(). Safe in signal handlers; reason
+ * must be a literal.
+ */
+void traceTrigger(const char *reason);
+
+/** Do the dump asked for, if any. Called periodically by the main loop. */
+void traceCheck();
+
+/** Dump right now, from the calling thread. */
+void traceDump(const char *reason);
+
+
+#endif /* TRACE_H_ */
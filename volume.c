@@ -0,0 +1,319 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "volume.h"
+#include "fault.h"
+#include "trace.h"
+#include "log.h"
+#include "main.h"
+
+
+MRVolume **volumes = NULL;
+int volCount = 0;
+
+/** Set when no more jobs will be queued: writers exit once their queue is empty */
+static volatile int volExit = 0;
+
+
+/** Jobs queued to a volume writer */
+typedef enum {
+	VJOB_WRITE=0,   // append data to a file
+	VJOB_COMMIT,    // update the headers of the dirty files, and flush them
+	VJOB_CLOSE      // finalize a file
+} VolumeJobType;
+
+typedef struct VolumeJob_s {
+	VolumeJobType type;
+	SNDFILE *file;
+	int fd;
+	MRPeakFile *peaks;
+	unsigned long len;
+	MR_SAMPLE data[WBLOCK];
+} VolumeJob;
+
+
+
+void addVolume(const char *root) {
+	MRVolume *v = calloc(1, sizeof(MRVolume));
+	v->root = strdup(root);
+	v->idx = volCount;
+
+	volumes = (MRVolume **) realloc(volumes, sizeof(MRVolume*) * (volCount + 1));
+	volumes[volCount++] = v;
+}
+
+
+/**
+ * Remember that a file has been written to, so the next commit flushes it.
+ */
+static void markDirty(MRVolume *v, SNDFILE *file, int fd) {
+	int i;
+	for (i = 0; i < v->dirtyCount; i++)
+		if (v->dirty[i] == file)
+			return;
+
+	if (v->dirtyCount == v->dirtySize) {
+		v->dirtySize = v->dirtySize ? v->dirtySize * 2 : 16;
+		v->dirty = realloc(v->dirty, v->dirtySize * sizeof(SNDFILE*));
+		v->dirtyFd = realloc(v->dirtyFd, v->dirtySize * sizeof(int));
+	}
+	v->dirty[v->dirtyCount] = file;
+	v->dirtyFd[v->dirtyCount] = fd;
+	v->dirtyCount++;
+}
+
+
+static void forgetDirty(MRVolume *v, SNDFILE *file) {
+	int i;
+	for (i = 0; i < v->dirtyCount; i++)
+		if (v->dirty[i] == file) {
+			v->dirtyCount--;
+			v->dirty[i] = v->dirty[v->dirtyCount];
+			v->dirtyFd[i] = v->dirtyFd[v->dirtyCount];
+			return;
+		}
+}
+
+
+/**
+ * Make the files written since the last commit recoverable: rewrite the size
+ * fields of their headers, then flush them to disk. All the headers are
+ * updated before the first fdatasync() call, so the batch costs one pass of
+ * disk flushes.
+ * The disk busy time since the last commit also gives a fresh estimate of the
+ * volume throughput.
+ */
+static void commitVolume(MRVolume *v) {
+	unsigned long long t = rdtsc();
+	int i;
+
+	for (i = 0; i < v->dirtyCount; i++)
+		sf_command(v->dirty[i], SFC_UPDATE_HEADER_NOW, NULL, 0);
+
+	for (i = 0; i < v->dirtyCount; i++)
+		if (fdatasync(v->dirtyFd[i]))
+			log_error("%s : fdatasync error\n", v->root);
+	v->dirtyCount = 0;
+
+	t = rdtsc() - t;
+	histAddCycles(&v->commitHist, t);
+	v->busyCycles += t;
+	v->commitCount++;
+	v->commitCycles += t;
+	if (t > v->maxCommitCycles)
+		v->maxCommitCycles = t;
+
+	// Bytes per second of busy time, smoothed over the last few commits.
+	if (v->bytes && v->busyCycles) {
+		double tp = (double) v->bytes * CPMillis * 1000 / v->busyCycles;
+		v->throughput = v->throughput ? 0.75 * v->throughput + 0.25 * tp : tp;
+		v->bytes = 0;
+		v->busyCycles = 0;
+	}
+
+	log_debug("%s : commit #%lu : %llu us, %.1f MB/s\n", v->root,
+			v->commitCount, t / (CPMillis / 1000), v->throughput / 1048576);
+}
+
+
+/**
+ * Writer thread code: run the jobs queued to one volume, in order, until
+ * asked to exit.
+ */
+static void *volumeWriter(void *arg) {
+	MRVolume *v = (MRVolume*) arg;
+	traceThread("writer %s", v->root);
+	while (1) {
+		// Read the exit flag first: everything queued before it was set is
+		// then sure to be seen by cons_own().
+		int exiting = volExit;
+		__sync_synchronize();
+
+		VolumeJob *j = (VolumeJob*) cons_own(v->queue);
+		if (!j) {
+			if (exiting)
+				break;
+			usleep(500);
+			continue;
+		}
+
+		unsigned long long t, tr = traceStart();
+		int err;
+		switch (j->type) {
+		case VJOB_WRITE:
+			t = rdtsc();
+			if ((err = faultWrite(v->idx)) != 0) {
+				log_error("%s : write error: %s (injected)\n", v->root,
+						strerror(err));
+				v->writeErrors++;
+			} else if (sf_writef_short(j->file, j->data, j->len) != j->len) {
+				log_error("%s : write error: %s\n", v->root,
+						sf_strerror(j->file));
+				v->writeErrors++;
+			}
+			t = rdtsc() - t;
+			histAddCycles(&v->writeHist, t);
+			v->busyCycles += t;
+			v->bytes += j->len * sizeof(MR_SAMPLE);
+
+			if (j->peaks)
+				peaksAppend(j->peaks, j->data, j->len);
+			markDirty(v, j->file, j->fd);
+			traceEnd("write", tr, "frames", j->len);
+			break;
+		case VJOB_COMMIT:
+			commitVolume(v);
+			traceEnd("commit", tr, NULL, 0);
+			break;
+		case VJOB_CLOSE:
+			forgetDirty(v, j->file);
+			sf_close(j->file);
+			if (j->peaks)
+				peaksClose(j->peaks);
+			__sync_fetch_and_sub(&v->openFiles, 1);
+			traceEnd("close", tr, NULL, 0);
+			break;
+		}
+
+		cons_free(v->queue);
+	}
+	return NULL;
+}
+
+
+void initVolumes() {
+	if (volCount == 0)
+		addVolume(".");
+
+	int i;
+	for (i = 0; i < volCount; i++) {
+		MRVolume *v = volumes[i];
+		v->queue = create(8, sizeof(VolumeJob));
+		if (pthread_create(&v->thread, NULL, volumeWriter, v)) {
+			printf("error creating thread.");
+			finish(-1);
+		}
+	}
+}
+
+
+int pickVolume() {
+	// Score each volume by the throughput each of its files would get if one
+	// more was added. Volumes never measured yet come first.
+	int i, best = 0;
+	double bestScore = -1;
+	for (i = 0; i < volCount; i++) {
+		double tp = volumes[i]->throughput;
+		double score = (tp ? tp : DBL_MAX) / (volumes[i]->openFiles + 1);
+		if (score > bestScore) {
+			bestScore = score;
+			best = i;
+		}
+	}
+
+	__sync_fetch_and_add(&volumes[best]->openFiles, 1);
+	return best;
+}
+
+
+/**
+ * Get an empty job from the queue of a volume. The queue grows as needed, so
+ * this never blocks.
+ */
+static VolumeJob *newJob(MRVolume *v, VolumeJobType type) {
+	VolumeJob *j = (VolumeJob*) prod_own(v->queue);
+	if (!j) {
+		log_error("%s : no free job buffers!\n", v->root);
+		finish(-1);
+	}
+	j->type = type;
+	return j;
+}
+
+
+void volumeWrite(int vol, SNDFILE *file, int fd, MRPeakFile *peaks,
+		const MR_SAMPLE *data, unsigned long len) {
+	MRVolume *v = volumes[vol];
+	while (len) {
+		unsigned long n = len < WBLOCK ? len : WBLOCK;
+
+		VolumeJob *j = newJob(v, VJOB_WRITE);
+		j->file = file;
+		j->fd = fd;
+		j->peaks = peaks;
+		j->len = n;
+		memcpy(j->data, data, n * sizeof(MR_SAMPLE));
+		prod_free(v->queue);
+
+		data += n;
+		len -= n;
+	}
+}
+
+
+void volumeClose(int vol, SNDFILE *file, MRPeakFile *peaks) {
+	MRVolume *v = volumes[vol];
+	VolumeJob *j = newJob(v, VJOB_CLOSE);
+	j->file = file;
+	j->peaks = peaks;
+	prod_free(v->queue);
+}
+
+
+void volumeRelease(int vol) {
+	__sync_fetch_and_sub(&volumes[vol]->openFiles, 1);
+}
+
+
+void volumeCommit() {
+	int i;
+	for (i = 0; i < volCount; i++) {
+		newJob(volumes[i], VJOB_COMMIT);
+		prod_free(volumes[i]->queue);
+	}
+}
+
+
+void stopVolumes() {
+	volExit = 1;
+
+	int i;
+	for (i = 0; i < volCount; i++) {
+		MRVolume *v = volumes[i];
+		if (pthread_join(v->thread, NULL)) {
+			printf("error joining thread.");
+		}
+
+		if (v->commitCount)
+			log_debug("%s : %lu commits, avg %llu us, max %llu us, %.1f MB/s\n",
+					v->root, v->commitCount,
+					v->commitCycles / v->commitCount / (CPMillis / 1000),
+					v->maxCommitCycles / (CPMillis / 1000),
+					v->throughput / 1048576);
+		if (v->writeErrors)
+			log_error("%s : %lu write errors\n", v->root, v->writeErrors);
+	}
+}
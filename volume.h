@@ -0,0 +1,101 @@
+/*
+ * Copyright 2010 Alberto Romei
+ *
+ * This file is part of Multirec.
+ *
+ * Multirec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Multirec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Multirec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VOLUME_H_
+#define VOLUME_H_
+
+#include "multirec.h"
+
+
+/**
+ * volume.c
+ * Output volumes. Each output root listed in multirec.rc is a volume, with its
+ * own writer thread and queue: the disk worker hands the audio over to the
+ * volume each file lives on, so a slow disk only backs up its own files.
+ * New files are placed on the volume with the most measured throughput to
+ * spare.
+ */
+
+/** Samples carried by each write job */
+#define WBLOCK 32768
+
+typedef struct MRVolume_s {
+	char *root;
+	int idx;
+
+	DualQueue *queue;
+	pthread_t thread;
+
+	// Files currently placed on this volume.
+	volatile int openFiles;
+
+	// Measured throughput (bytes per second of disk busy time), 0 until the
+	// first commit.
+	volatile double throughput;
+
+	// Files written since the last commit (only touched by the writer thread)
+	SNDFILE **dirty;
+	int *dirtyFd;
+	int dirtyCount, dirtySize;
+
+	// Bytes written and cycles spent writing since the last commit
+	unsigned long long bytes, busyCycles;
+
+	// Commit statistics
+	unsigned long commitCount;
+	unsigned long long commitCycles, maxCommitCycles;
+
+	// Timings of the sf_writef_short() calls, and of the commits
+	MRHist writeHist, commitHist;
+
+	// Failed writes (their data is lost)
+	volatile unsigned long writeErrors;
+} MRVolume;
+
+extern MRVolume **volumes;
+extern int volCount;
+
+
+/** Add an output root. Called while reading the .rc file. */
+void addVolume(const char *root);
+
+/** Create the writer threads. The current dir is used if no root was given. */
+void initVolumes();
+
+/** Choose the volume for a new file, and account the file to it. */
+int pickVolume();
+
+/** Queue len samples to be written to a file (and its peak index). */
+void volumeWrite(int vol, SNDFILE *file, int fd, MRPeakFile *peaks,
+		const MR_SAMPLE *data, unsigned long len);
+
+/** Queue the finalization of a file, after its pending writes. */
+void volumeClose(int vol, SNDFILE *file, MRPeakFile *peaks);
+
+/** Account the closing of a file that was never written to. */
+void volumeRelease(int vol);
+
+/** Make all the files written so far recoverable, on every volume. */
+void volumeCommit();
+
+/** Wait for all volumes to write their queues, then stop the writers. */
+void stopVolumes();
+
+
+#endif /* VOLUME_H_ */
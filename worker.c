@@ -18,9 +18,21 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "worker.h"
+#include "volume.h"
+#include "dsp.h"
+#include "proxy.h"
+#include "tap.h"
+#include "fault.h"
+#include "trace.h"
+#include "log.h"
 #include "main.h"
 
 #undef SHORT_CIRCUIT
@@ -31,22 +43,108 @@ pthread_t wrk;
 int finished = 0;
 
 static float floatIn[BSIZ*MR_CHANNELS];
-static float floatOut[MAXOUTFRMS*MR_CHANNELS];
+static float *floatOut;
 
 
-MR_SAMPLE *leftData, *rightData;
 static MRFrame *tmpOutBuf;
 
-#include "logging.inc"
+/**
+ * Output frames per master frame (outRate / rate), and room for the output of
+ * a chunk: MAXOUTFRMS, grown by as much when the takes have a higher rate.
+ */
+static double outScale;
+static unsigned long maxOutFrames;
 
 /**
- * Stretches the given audio chunk to align it to the audio of the master device
+ * Size of the per-device output rings (in frames): the pre-roll, plus enough
+ * room for devices running a couple of chunks ahead of each other.
  */
-int conve(MRDevice *c, MRAlsaChunk *chunk, int end, MRFrame *outBuf,
-		long *outputLen) {
-	// *** Auto-adjust algorithm : re-calculate src ratio to obtain the same number
-	// *** of output frames as the master device.
+static unsigned long ringSize;
+
+/** Frames per silence check of the sparse storage (see silenceMillis) */
+#define SILENCE_BLOCK 1024
+
+/** Sparse storage: loudest silent sample, and silence kept in the files */
+static MR_SAMPLE silenceLevel;
+static unsigned long long silenceFrames;
+
+/** Takes being written, oldest first. Only touched by the worker thread. */
+static MRTake *takes = NULL;
+/** The take that has no end frame yet, if any */
+static MRTake *currentTake = NULL;
+
+/** Device of the last master chunk (see CHUNK_MASTER) */
+static MRDevice *masterDev = NULL;
+
+/** Timeline frames published to the tap so far (see tap.h) */
+static unsigned long long tapPos = 0;
+
+/** Take commands posted by the main thread (guarded by workerMutex) */
+typedef enum {
+	TAKE_NONE=0,
+	TAKE_BEGIN,
+	TAKE_END,
+	TAKE_SWITCH
+} TakeCommand;
+
+static TakeCommand takeCmd = TAKE_NONE;
+static MRTake *takeCmdTake;
+static unsigned long long takeCmdFrame;
+
+/**
+ * Finalizer thread: does the slow file work off the worker's back. It frees
+ * ended takes, and opens the files of the next segment ahead of time. Jobs
+ * are queued in finQueue (guarded by finMutex) and run in order.
+ * Written files are closed by their volume writer instead, after their
+ * pending data.
+ */
+typedef enum {
+	JOB_CLOSE_TAKE=0,
+	JOB_OPEN_SEGMENT
+} FileJobType;
+
+typedef struct FileJob_s {
+	struct FileJob_s *next;
+	FileJobType type;
+	MRTake *take;
+	int dev, segment;              // JOB_OPEN_SEGMENT
+} FileJob;
+
+static pthread_t fin;
+static pthread_mutex_t finMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finCond = PTHREAD_COND_INITIALIZER;
+static FileJob *finQueue = NULL;
+static int finExit = 0;
+
+/** Bytes queued to the output files since the last commit */
+static unsigned long long uncommittedBytes = 0;
+/** Timestamp (got from rdtsc) of the last commit */
+static unsigned long long lastCommitTS = 0;
+
+
+/**
+ * Commit the output files if the time or byte threshold has been reached.
+ */
+static inline void maybeCommitFiles() {
+	if (uncommittedBytes == 0)
+		return;
+
+	if ((syncKBytes && uncommittedBytes >= syncKBytes * 1024ULL)
+			|| (syncMillis
+					&& rdtsc() - lastCommitTS >= (unsigned long long) syncMillis * CPMillis)) {
+		// Each volume commits its own files, once the data queued so far
+		// has been written.
+		volumeCommit();
+		uncommittedBytes = 0;
+		lastCommitTS = rdtsc();
+	}
+}
 
+/**
+ * Estimate how many frames the master device had captured when the given
+ * chunk was read.
+ */
+static unsigned long long masterPosition(MRAlsaChunk *chunk) {
 	// Time difference (in frames) between now and the last read from the master
 	// device.
 	long long tsDiff = ((chunk->ts / (long long) CPS)
@@ -54,42 +152,67 @@ int conve(MRDevice *c, MRAlsaChunk *chunk, int end, MRFrame *outBuf,
 
 	// Given the above time difference and the master pcm delay, estimate how many
 	// frames the master device has captured in this instant.
-	unsigned long long framesThatShouldHaveBeen = (chunk->masterFrameCount
-			+ chunk->masterDelay + tsDiff);
+	return chunk->masterFrameCount + chunk->masterDelay + tsDiff;
+}
 
-	// This (slave) device should have captured the same amount of frames in this
-	// same instant. Calculate the frame difference considering this pcm delay.
-	long diff = framesThatShouldHaveBeen
-			- (c->outputFrameCount + chunk->len + chunk->delay);
+
+/**
+ * Stretches the given audio chunk to align it to the audio of the master device,
+ * and converts it to the output rate in the same pass.
+ */
+int conve(MRDevice *c, MRAlsaChunk *chunk, int end, MRFrame *outBuf,
+		long *outputLen) {
+	// *** Auto-adjust algorithm : track the clock of this device against the
+	// *** master's, and get the ratio that keeps its output on the master
+	// *** timeline (see drift.h).
+	unsigned long long framesThatShouldHaveBeen = masterPosition(chunk);
 
 	c->srcData.data_in = floatIn;
 	c->srcData.data_out = floatOut;
-	c->srcData.output_frames = MAXOUTFRMS;
+	c->srcData.output_frames = maxOutFrames;
 
-	// Now, calculate a proper ratio to make that difference disappear.
-	// (...or, how much this input chunk has to be stretched in order to
-	// have the same total output frames as master?)
-	double ratio = ((double) (chunk->len + diff)) / chunk->len;
+	// The master itself is the reference: it only goes through here for the
+	// output rate, or to keep the converter delay, after it was a slave. The
+	// drift is tracked in master frames, and the rate conversion folded into
+	// the ratio, so a slave is still resampled only once.
+	double ratio = outScale;
+	if (chunk->flags & CHUNK_MASTER)
+		driftReset(&c->drift);
+	else if (chunk->masterFrameCount)
+		ratio = outScale * driftUpdate(&c->drift, framesThatShouldHaveBeen,
+				chunk->delay, c->outputFrameCount / outScale, chunk->len);
+	// With one channel armed, only that one is converted.
+	int mono = c->armed != MR_ALL_CHANNELS;
+	int chan = ffs(c->armed) - 1;
+	SRC_STATE *src = mono ? c->srcMono : c->srcState;
+
+	c->converted = 1;
 	c->srcData.src_ratio = ratio;
-	int err = src_set_ratio(c->srcState, ratio);
+	int err = src_set_ratio(src, ratio);
 	if (err < 0) {
 		log_error("dev %d : src_set_ratio error: %s\n", c->idx,
 				src_strerror(err));
 		return -1;
 	}
 
-	log_debug("dev %d : outcount=%llu tsDiff=%lld diff=%ld new ratio=%f\n",
-			c->idx, c->outputFrameCount, tsDiff, diff, ratio);
+	log_debug("dev %d : outcount=%llu master=%llu phase=%.1f new ratio=%f\n",
+			c->idx, c->outputFrameCount, framesThatShouldHaveBeen,
+			c->drift.phase, ratio);
 
 	// *** Convert input data to float, put the result in the SRC input buffer. ***
-	src_short_to_float_array((short*) chunk->buf, c->srcData.data_in,
-			chunk->len * MR_CHANNELS);
+	unsigned long n;
+	if (mono)
+		for (n = 0; n < chunk->len; n++)
+			floatIn[n] = chunk->buf[n].v[chan] / 32768.0f;
+	else
+		src_short_to_float_array((short*) chunk->buf, c->srcData.data_in,
+				chunk->len * MR_CHANNELS);
 
 	// *** Stretch audio in the SRC input buffer ***
 	c->srcData.input_frames = chunk->len;
 	c->srcData.end_of_input = end;
 
-	int errn = src_process(c->srcState, &(c->srcData));
+	int errn = src_process(src, &(c->srcData));
 	if (errn) {
 		log_error("dev %d : src_process error : %s\n", c->idx,
 				src_strerror(errn));
@@ -100,6 +223,13 @@ int conve(MRDevice *c, MRAlsaChunk *chunk, int end, MRFrame *outBuf,
 	*outputLen = c->srcData.output_frames_gen;
 
 	// *** Convert SRC output buffer data from float back to short. ***
+	if (mono) {
+		for (n = 0; n < *outputLen; n++) {
+			long v = lrintf(c->srcData.data_out[n] * 32768.0f);
+			outBuf[n].v[chan] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+		}
+		return 0;
+	}
 	int size = c->srcData.output_frames_gen * MR_CHANNELS;
 	// TODO OPTIMIZATION : i have to store each channel in a separate
 	// output buffer. Would be best to do it in the same loop as the
@@ -139,19 +269,707 @@ void splitStereo(MRFrame *stereoBuf, int len, int invert, MR_SAMPLE *left,
 }
 
 
+/**
+ * Copy one channel of the frames to a mono buffer (see splitStereo()).
+ */
+static void splitMono(MRFrame *stereoBuf, int len, int chan, int invert,
+		MR_SAMPLE *out) {
+	int n;
+	if (invert)
+		for (n = 0; n < len; n++)
+			out[n] = ((MR_SAMPLE) 0xFFFF) - stereoBuf[n].v[chan];
+	else
+		for (n = 0; n < len; n++)
+			out[n] = stereoBuf[n].v[chan];
+}
+
+
+/**
+ * Queue a job for the finalizer thread.
+ */
+static void postFileJob(FileJobType type, MRTake *t, int dev, int segment) {
+	FileJob *j = (FileJob*) calloc(1, sizeof(FileJob));
+	j->type = type;
+	j->take = t;
+	j->dev = dev;
+	j->segment = segment;
+
+	pthread_mutex_lock(&finMutex);
+	FileJob **q = &finQueue;
+	while (*q)
+		q = &(*q)->next;
+	*q = j;
+	pthread_cond_signal(&finCond);
+	pthread_mutex_unlock(&finMutex);
+}
+
+
+/**
+ * Hand the current files of a take device over to their volume writers, to be
+ * closed after their pending data.
+ */
+static void closeFiles(MRTakeDev *td) {
+	int chan;
+	for (chan = 0; chan < MR_CHANNELS; chan++) {
+		if (!td->outFile[chan])
+			continue;
+		volumeClose(td->outVol[chan], td->outFile[chan], td->outPeaks[chan]);
+		td->outFile[chan] = NULL;
+		td->outPeaks[chan] = NULL;
+	}
+}
+
+
+/**
+ * Frame of the ring of a device that holds the given timeline frame: takes
+ * are written from later in the ring of the cards with more latency.
+ */
+static inline unsigned long long ringFrame(MRDevice *c, unsigned long long f) {
+	return f == ULLONG_MAX ? f : f + c->latency;
+}
+
+
+/**
+ * Append output frames to the ring of the specified device, splitting them to
+ * dual mono on the way, through its channel chains if any.
+ */
+static void ringAppend(MRDevice *c, MRFrame *buf, long len) {
+	unsigned long pos = c->outputFrameCount % ringSize;
+	unsigned long n = ringSize - pos;
+	if (n > len)
+		n = len;
+
+	// Only the armed channels were converted: the others are stale.
+	int chan;
+	if (c->armed == MR_ALL_CHANNELS && c->dsp) {
+		dspSplit(c, buf, n, c->ring[0] + pos, c->ring[1] + pos);
+		dspSplit(c, buf + n, len - n, c->ring[0], c->ring[1]);
+	} else if (c->armed == MR_ALL_CHANNELS) {
+		splitStereo(buf, n, c->invert, c->ring[0] + pos, c->ring[1] + pos);
+		splitStereo(buf + n, len - n, c->invert, c->ring[0], c->ring[1]);
+	} else
+		for (chan = 0; chan < MR_CHANNELS; chan++) {
+			if (!(c->armed & 1 << chan))
+				continue;
+			if (c->dsp) {
+				dspSplitMono(c, buf, n, chan, c->ring[chan] + pos);
+				dspSplitMono(c, buf + n, len - n, chan, c->ring[chan]);
+			} else {
+				splitMono(buf, n, chan, c->invert, c->ring[chan] + pos);
+				splitMono(buf + n, len - n, chan, c->invert, c->ring[chan]);
+			}
+		}
+}
+
+
+/**
+ * Append silence to the ring of the specified device, up to output frame to.
+ */
+static void ringSilence(MRDevice *c, unsigned long long to) {
+	int chan;
+	while (c->outputFrameCount < to) {
+		unsigned long pos = c->outputFrameCount % ringSize;
+		unsigned long n = ringSize - pos;
+		if (n > to - c->outputFrameCount)
+			n = to - c->outputFrameCount;
+		for (chan = 0; chan < MR_CHANNELS; chan++)
+			memset(c->ring[chan] + pos, 0, n * sizeof(MR_SAMPLE));
+		c->outputFrameCount += n;
+	}
+}
+
+
+/**
+ * Whether all the samples of a block are below the silence level.
+ */
+static inline int isSilent(const MR_SAMPLE *data, unsigned long len) {
+	int loud = 0;
+	unsigned long i;
+	for (i = 0; i < len; i++)
+		loud |= data[i] > silenceLevel || data[i] < -silenceLevel;
+	return !loud;
+}
+
+
+/**
+ * A channel of a take device is done leaving out silence, at frame to of the
+ * ring: list the stretch in the take's silence.txt, relative to the file.
+ */
+static void endSkip(MRDevice *c, MRTake *t, int chan, unsigned long long to) {
+	MRTakeDev *td = &t->dev[(int) c->idx];
+	if (to > td->skipFrom[chan])
+		addSilence(t, c->idx, chan, td->segment,
+				td->skipFrom[chan] - td->segStart, to - td->segStart);
+	td->skipping[chan] = 0;
+}
+
+
+/**
+ * Queue len samples of a channel, for the output frames from on, to its file,
+ * leaving out what comes after the first silenceFrames of a silent stretch.
+ */
+static void sparseWrite(MRDevice *c, MRTake *t, int chan,
+		unsigned long long from, const MR_SAMPLE *data, unsigned long len) {
+	MRTakeDev *td = &t->dev[(int) c->idx];
+	unsigned long i = 0, run = 0;
+
+	while (i < len) {
+		unsigned long n = len - i < SILENCE_BLOCK ? len - i : SILENCE_BLOCK;
+		if (!isSilent(data + i, n)) {
+			td->silentRun[chan] = 0;
+			if (td->skipping[chan]) {
+				endSkip(c, t, chan, from + i);
+				run = i;
+			}
+		} else {
+			td->silentRun[chan] += n;
+			if (!td->skipping[chan] && td->silentRun[chan] > silenceFrames) {
+				volumeWrite(td->outVol[chan], td->outFile[chan],
+						td->outFd[chan], td->outPeaks[chan], data + run, i - run);
+				uncommittedBytes += (i - run) * sizeof(MR_SAMPLE);
+				td->skipping[chan] = 1;
+				td->skipFrom[chan] = from + i;
+			}
+		}
+		i += n;
+	}
+
+	if (!td->skipping[chan]) {
+		volumeWrite(td->outVol[chan], td->outFile[chan], td->outFd[chan],
+				td->outPeaks[chan], data + run, len - run);
+		uncommittedBytes += (len - run) * sizeof(MR_SAMPLE);
+	}
+}
+
+
+/**
+ * Queue the output frames [from, to) of the specified device, taken from its
+ * ring, to a take's files. The volume writers do the actual writing, and index
+ * the peaks.
+ */
+static void ringWrite(MRDevice *c, MRTake *t, unsigned long long from,
+		unsigned long long to) {
+	MRTakeDev *td = &t->dev[(int) c->idx];
+	int chan;
+	while (from < to) {
+		unsigned long pos = from % ringSize;
+		unsigned long n = ringSize - pos;
+		if (n > to - from)
+			n = to - from;
+
+		// *** queue output to audio file ***
+		for (chan = 0; chan < MR_CHANNELS; chan++)
+			if (!td->outFile[chan])
+				continue;
+			else if (silenceFrames)
+				sparseWrite(c, t, chan, from, c->ring[chan] + pos, n);
+			else {
+				volumeWrite(td->outVol[chan], td->outFile[chan], td->outFd[chan],
+						td->outPeaks[chan], c->ring[chan] + pos, n);
+				uncommittedBytes += n * sizeof(MR_SAMPLE);
+			}
+
+		from += n;
+	}
+}
+
+
+/**
+ * Move the specified device of a take on to its next segment, from its
+ * current frame. The files of the finished segment are closed in background;
+ * the ones of the new segment have been opened in advance by the finalizer
+ * thread. If they aren't ready yet, returns -1 and leaves the device on its
+ * current segment: the worker must not wait for a slow open, so it goes on
+ * writing there and tries again with the next chunk.
+ */
+static int rollSegment(MRDevice *c, MRTake *t) {
+	int dev = c->idx;
+	MRTakeDev *td = &t->dev[dev];
+	int chan, skipping[MR_CHANNELS];
+
+	// Should never happen: the files were requested a whole segment ago.
+	if (td->nextSegment != td->segment + 1) {
+		if (!td->rollLate)
+			log_error("dev %d : segment %d files of take %s not ready, "
+					"segment %d goes on\n", dev, td->segment + 1, t->dir,
+					td->segment);
+		td->rollLate = 1;
+		return -1;
+	}
+	__sync_synchronize();
+
+	// A silent stretch going on is listed in both files.
+	for (chan = 0; chan < MR_CHANNELS; chan++)
+		if ((skipping[chan] = td->skipping[chan]))
+			endSkip(c, t, chan, td->pos);
+
+	closeFiles(td);
+
+	for (chan = 0; chan < MR_CHANNELS; chan++) {
+		td->outFile[chan] = td->nextFile[chan];
+		td->outFd[chan] = td->nextFd[chan];
+		td->outPeaks[chan] = td->nextPeaks[chan];
+		td->outVol[chan] = td->nextVol[chan];
+		td->nextFile[chan] = NULL;
+		td->nextPeaks[chan] = NULL;
+		if (skipping[chan]) {
+			td->skipping[chan] = 1;
+			td->skipFrom[chan] = td->pos;
+		}
+	}
+	td->segment++;
+	td->segStart = td->pos;
+	td->rollLate = 0;
+	td->nextSegment = -1;
+
+	log_debug("dev %d : take %s rolled over to segment %d\n", dev, t->dir,
+			td->segment);
+
+	// Get the files of the following segment ready.
+	postFileJob(JOB_OPEN_SEGMENT, t, dev, td->segment + 1);
+	return 0;
+}
+
+
+/**
+ * Write the newest output frames of the specified device to every take
+ * that wants them.
+ */
+static void writeTakes(MRDevice *c) {
+	MRTake *t;
+	for (t = takes; t; t = t->next) {
+		MRTakeDev *td = &t->dev[(int) c->idx];
+		unsigned long long to = c->outputFrameCount;
+		if (to > ringFrame(c, t->endFrame))
+			to = ringFrame(c, t->endFrame);
+		if (td->pos >= to)
+			continue;
+
+		// Frames that already left the ring are lost. Should never happen,
+		// since take boundaries are clamped to what the rings hold.
+		unsigned long long oldest = c->outputFrameCount > ringSize ?
+				c->outputFrameCount - ringSize : 0;
+		if (td->pos < oldest) {
+			log_error("dev %d : %llu frames lost from take %s\n", c->idx,
+					oldest - td->pos, t->dir);
+			td->pos = oldest;
+		}
+
+		// Write up to the end of the current segment, then roll over. A
+		// segment whose successor isn't ready yet goes on to the end of the
+		// chunk instead.
+		while (td->pos < to) {
+			unsigned long long segEnd = ULLONG_MAX;
+			if (t->segFrames)
+				segEnd = td->segStart + t->segFrames;
+			if (td->pos >= segEnd && rollSegment(c, t) == 0)
+				continue;
+
+			unsigned long long end = td->pos < segEnd && segEnd < to ?
+					segEnd : to;
+			ringWrite(c, t, td->pos, end);
+			td->pos = end;
+		}
+	}
+}
+
+
+/**
+ * Point in at the ring samples of timeline frame f, one per channel, in a, b,
+ * c... order: NULL for the channels not recorded by take t (or not armed, with
+ * no take). Returns how many of the next n frames follow in all the rings, or
+ * 0 if a device has already overwritten frame f, with the frames lost in lost.
+ */
+static unsigned long ringSpan(MRTake *t, unsigned long long f,
+		unsigned long n, const MR_SAMPLE **in, unsigned long long *lost) {
+	int i, chan;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		unsigned long long rf = ringFrame(c, f);
+
+		// A card far behind the others: their frames are gone already.
+		if (c->outputFrameCount > ringSize
+				&& rf < c->outputFrameCount - ringSize) {
+			*lost = c->outputFrameCount - ringSize - rf;
+			return 0;
+		}
+
+		unsigned long pos = rf % ringSize;
+		if (n > ringSize - pos)
+			n = ringSize - pos;
+		int armed = t ? t->dev[i].armed : c->armed;
+		for (chan = 0; chan < MR_CHANNELS; chan++)
+			in[i * MR_CHANNELS + chan] = armed & 1 << chan ?
+					c->ring[chan] + pos : NULL;
+	}
+	return n;
+}
+
+
+/**
+ * Mix into the proxy of a take the frames every device has written to it.
+ */
+static void feedProxy(MRTake *t) {
+	MRProxy *p = t->proxy;
+	if (!p)
+		return;
+
+	unsigned long long to = t->endFrame, lost;
+	int i;
+	for (i = 0; i < devCount; i++) {
+		unsigned long long written = t->dev[i].pos - devices[i]->latency;
+		if (written < to)
+			to = written;
+	}
+
+	const MR_SAMPLE *in[devCount * MR_CHANNELS];
+	while (p->pos < to) {
+		unsigned long n = ringSpan(t, p->pos, to - p->pos < PROXY_BLOCK ?
+				to - p->pos : PROXY_BLOCK, in, &lost);
+		if (!n) {
+			log_error("%llu frames lost from the proxy of %s\n", lost,
+					t->dir);
+			p->pos += lost;
+			continue;
+		}
+
+		proxyWrite(p, in, n);
+		p->pos += n;
+	}
+}
+
+
+/**
+ * Publish to the tap the frames every device has captured.
+ */
+static void feedTap() {
+	if (!tapName)
+		return;
+
+	long long to = LLONG_MAX;
+	unsigned long long lost;
+	unsigned int armed = 0;
+	int i;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		long long written = (long long) c->outputFrameCount - c->latency;
+		if (written < to)
+			to = written;
+		armed |= c->armed << i * MR_CHANNELS;    // up to TAP_MAX_CHANNELS
+	}
+
+	const MR_SAMPLE *in[devCount * MR_CHANNELS];
+	while ((long long) tapPos < to) {
+		unsigned long n = ringSpan(NULL, tapPos, to - tapPos, in, &lost);
+		// Frames gone from a ring are published as silence, so that the tap
+		// stays on the timeline.
+		if (!n) {
+			memset(in, 0, sizeof(in));
+			n = lost < to - tapPos ? lost : to - tapPos;
+			log_error("tap : %llu frames lost\n", lost);
+		}
+
+		tapWrite(in, n, armed);
+		tapPos += n;
+	}
+}
+
+
+/**
+ * A device is gone (CHUNK_LOST): from here on, its timeline is filled with
+ * silence as the master advances (see fillSilence()).
+ */
+static void deviceLost(MRDevice *c) {
+	c->lost = 1;
+	c->gapFrom = c->outputFrameCount - c->latency;
+	log_error("dev %d : lost at frame %llu, recording silence\n", c->idx,
+			c->gapFrom);
+}
+
+
+/**
+ * Keep the timeline of the lost devices up with the master's, with silence,
+ * so that their files stay aligned with the other ones.
+ */
+static void fillSilence() {
+	int i;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		unsigned long long to = masterDev->outputFrameCount
+				- masterDev->latency + c->latency;
+		if (!c->lost || c->outputFrameCount >= to)
+			continue;
+		ringSilence(c, to);
+		writeTakes(c);
+	}
+}
+
+
+/**
+ * A lost device is back (CHUNK_REJOIN). Its new stream has nothing to do with
+ * the old one: put the first chunk where it belongs on the master timeline,
+ * padding with silence or dropping the frames that overlap what was already
+ * filled in. Then record the gap in the takes.
+ */
+static void deviceRejoined(MRDevice *c, MRAlsaChunk *cnk) {
+	// No master chunk consumed yet, during start-up: no latency to undo.
+	long masterLatency = masterDev ? masterDev->latency : 0;
+	long long start = llround(((long long) masterPosition(cnk) - (long long)
+			cnk->len - cnk->delay) * outScale) + c->latency - masterLatency;
+	if (start < 0)
+		start = 0;
+
+	if (start > c->outputFrameCount)
+		ringSilence(c, start);
+	else {
+		// In frames of the chunk, i.e. at the stream rate.
+		unsigned long long skip = (c->outputFrameCount - start) / outScale;
+		if (skip > cnk->len)
+			skip = cnk->len;
+		memmove(cnk->buf, cnk->buf + skip, (cnk->len - skip) * sizeof(MRFrame));
+		cnk->len -= skip;
+	}
+
+	// Fresh converter and clock tracking: the old ones belong to the old
+	// stream.
+	src_reset(c->srcState);
+	src_reset(c->srcMono);
+	driftReset(&c->drift);
+	c->lost = 0;
+
+	unsigned long long back = c->outputFrameCount - c->latency;
+	MRTake *t;
+	for (t = takes; t; t = t->next)
+		if (c->gapFrom < t->endFrame && back > t->startFrame)
+			addGap(t, c->idx, c->gapFrom > t->startFrame ? c->gapFrom
+					: t->startFrame, back < t->endFrame ? back : t->endFrame);
+
+	log_error("dev %d : rejoined at frame %llu, after %llu frames of silence\n",
+			c->idx, back, back - c->gapFrom);
+	writeTakes(c);
+}
+
+
+/**
+ * Hand the takes which have been completely written over to the finalizer
+ * thread. If force is set, hand over all takes, complete or not.
+ */
+static void retireTakes(int force) {
+	MRTake **pt = &takes;
+	while (*pt) {
+		MRTake *t = *pt;
+		int i, done = 1;
+		for (i = 0; i < devCount && !force; i++)
+			if (t->dev[i].pos < ringFrame(devices[i], t->endFrame))
+				done = 0;
+
+		if (!done) {
+			pt = &t->next;
+			continue;
+		}
+
+		// Shutting down: the cards with latency haven't captured the last
+		// frames of the take yet. Pad them with as much silence, so that all
+		// files end together.
+		for (i = 0; i < devCount && force && t->endFrame != ULLONG_MAX; i++) {
+			MRDevice *c = devices[i];
+			unsigned long long to = ringFrame(c, t->endFrame);
+			if (c->latency <= 0 || c->outputFrameCount >= to)
+				continue;
+			if (to > c->outputFrameCount + c->latency)
+				to = c->outputFrameCount + c->latency;
+			ringSilence(c, to);
+			writeTakes(c);
+		}
+
+		log_debug("take %s ended at frame %llu\n", t->dir, t->endFrame);
+
+		// Devices still gone: their silence lasts up to the end.
+		for (i = 0; i < devCount; i++)
+			if (devices[i]->lost && devices[i]->gapFrom < t->endFrame)
+				addGap(t, i, devices[i]->gapFrom > t->startFrame ?
+						devices[i]->gapFrom : t->startFrame, t->endFrame);
+
+		*pt = t->next;
+		if (t == currentTake)
+			currentTake = NULL;
+
+		for (i = 0; i < devCount; i++) {
+			int chan;
+			for (chan = 0; chan < MR_CHANNELS; chan++)
+				if (t->dev[i].skipping[chan])
+					endSkip(devices[i], t, chan, t->dev[i].pos);
+			closeFiles(&t->dev[i]);
+		}
+		if (t->proxy) {
+			feedProxy(t);
+			proxyClose(t->proxy);
+			t->proxy = NULL;
+		}
+		postFileJob(JOB_CLOSE_TAKE, t, 0, 0);
+	}
+}
+
+
+/**
+ * Pick up the take command posted by the main thread, if any, and turn the
+ * requested frame into a boundary which is exact on the output timeline of
+ * all devices.
+ */
+static void handleTakeCommand() {
+	pthread_mutex_lock(&workerMutex);
+	TakeCommand cmd = takeCmd;
+	MRTake *t = takeCmdTake;
+	unsigned long long frame = takeCmdFrame;
+	takeCmd = TAKE_NONE;
+	pthread_mutex_unlock(&workerMutex);
+
+	if (cmd == TAKE_NONE)
+		return;
+
+	// From master frames to the output timeline.
+	frame = llround(frame * outScale);
+
+	// A take can't end before a frame some device has already written, and
+	// can't start before the oldest frame still held by all the rings (both
+	// on the timeline, i.e. less the latency of the device).
+	unsigned long long now = frame;
+	long long oldest = 0;
+	int i;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		long long ofc = (long long) c->outputFrameCount - c->latency;
+		if (ofc > (long long) now)
+			now = ofc;
+		long long kept = c->outputFrameCount > ringSize ?
+				c->outputFrameCount - ringSize : 0;
+		if (kept - c->latency > oldest)
+			oldest = kept - c->latency;
+	}
+
+	if (cmd != TAKE_BEGIN && currentTake) {
+		currentTake->endFrame = now;
+		currentTake = NULL;
+	}
+
+	if (cmd == TAKE_END)
+		return;
+
+	unsigned long long start = now;
+	if (cmd == TAKE_BEGIN) {
+		unsigned long long preroll = (unsigned long long) prerollMillis
+				* outRate / 1000;
+		start = frame > preroll ? frame - preroll : 0;
+		if (start < (unsigned long long) oldest)
+			start = oldest;
+	}
+
+	t->startFrame = start;
+	t->endFrame = ULLONG_MAX;
+	if (t->proxy)
+		t->proxy->pos = start;
+	for (i = 0; i < devCount; i++)
+		t->dev[i].pos = t->dev[i].segStart = ringFrame(devices[i], start);
+
+	MRTake **pt = &takes;
+	while (*pt)
+		pt = &(*pt)->next;
+	t->next = NULL;
+	*pt = t;
+	currentTake = t;
+
+	if (t->segFrames)
+		for (i = 0; i < devCount; i++)
+			postFileJob(JOB_OPEN_SEGMENT, t, i, 1);
+
+	log_debug("take %s starts at frame %llu\n", t->dir, start);
+}
+
+
+/**
+ * Set the channels processed for each device: the ones recorded by the takes
+ * being written, or the armed ones between takes. A channel that comes back
+ * starts with a silent ring, since its history wasn't kept: that's the
+ * pre-roll of the take that armed it.
+ */
+static void updateArming() {
+	int i, chan;
+	for (i = 0; i < devCount; i++) {
+		MRDevice *c = devices[i];
+		int armed = 0;
+		MRTake *t;
+		for (t = takes; t; t = t->next)
+			armed |= t->dev[i].armed;
+		if (!takes)
+			armed = MR_ALL_CHANNELS & ~c->disarmed;
+		if (armed == c->armed)
+			continue;
+
+		for (chan = 0; chan < MR_CHANNELS; chan++)
+			if (armed & ~c->armed & 1 << chan)
+				memset(c->ring[chan], 0, ringSize * sizeof(MR_SAMPLE));
+
+		// The converter changes, or converts another channel.
+		if (ffs(armed) != ffs(c->armed) || (armed == MR_ALL_CHANNELS)
+				!= (c->armed == MR_ALL_CHANNELS)) {
+			src_reset(c->srcState);
+			src_reset(c->srcMono);
+		}
+
+		log_debug("dev %d : armed channels %d -> %d\n", c->idx, c->armed,
+				armed);
+		c->armed = armed;
+	}
+}
+
+
+/**
+ * Keep the place on the timeline of a device with no channel armed, without
+ * converting its audio: its output frame count goes on as if it did.
+ */
+static long trackOnly(MRDevice *c, MRAlsaChunk *cnk) {
+	double ratio = 1.0;
+	if (!(cnk->flags & CHUNK_MASTER) && cnk->masterFrameCount)
+		ratio = driftUpdate(&c->drift, masterPosition(cnk), cnk->delay,
+				c->outputFrameCount / outScale, cnk->len);
+	c->stats.ratio = ratio;
+
+	double out = cnk->len * ratio * outScale + c->trackFrac;
+	long len = (long) out;
+	c->trackFrac = out - len;
+	return len;
+}
+
+
 void *diskWorker(void *arg) {
 	MRDevice *currentDev;
+	traceThread("diskWorker");
 	while (1) {
+		handleTakeCommand();
+		updateArming();
+
 		// Consume data from all the queues, starting from the one associated with
 		// the 1st device. Exit when all devices' queues are empty.
-		int i;
+		int i, consumed = 0;
 		for (i = 0; i < devCount; i++) {
 			currentDev = devices[i];
 
+			unsigned long long tr = traceStart();
 			MRAlsaChunk *cnk = (MRAlsaChunk*) cons_own(currentDev->dualQueue);
 
+			// Empty polls are not traced: they would flood the ring.
 			if (cnk == NULL)
 				continue;
+			traceEnd("cons_own", tr, "dev", i);
+
+			consumed++;
+
+			histAddCycles(&currentDev->stats.queue, rdtsc() - cnk->commitTS);
+
+			if (cnk->flags & CHUNK_LOST)
+				deviceLost(currentDev);
+			else if (cnk->flags & CHUNK_REJOIN && currentDev->lost)
+				deviceRejoined(currentDev, cnk);
 
 			// FIXME FIXME
 			if (cnk->len == 0) {
@@ -161,85 +979,210 @@ void *diskWorker(void *arg) {
 				continue;
 			}
 
-			log_debug("\nDBG---gotit (len= %d)\n", cnk->len);
+			log_debug("\nDBG---gotit (len= %lu)\n", cnk->len);
 
 			MRFrame* outBuf;
 			long outLen;
 
-			// don't stretch audio coming from dev 0
+			if (cnk->flags & CHUNK_MASTER)
+				masterDev = currentDev;
+
+			// don't even split a device with no channel armed
+			// don't stretch audio coming from the master
 			// don't stretch if no data has been read from master device yet.
-			if (i == 0 || cnk->masterFrameCount == 0) {
+			// (unless the takes have their own rate: then everything is
+			// converted)
+			if (!currentDev->armed) {
+				outBuf = NULL;
+				outLen = trackOnly(currentDev, cnk);
+			} else if (outRate == rate && ((cnk->flags & CHUNK_MASTER
+					&& !currentDev->converted) || cnk->masterFrameCount == 0)) {
 				outBuf = cnk->buf;
 				outLen = cnk->len;
+				currentDev->stats.ratio = 1.0;
 			} else {
 				outBuf = tmpOutBuf;
 
 				int end = (state == STOPPING
 						&& currentDev->dualQueue->full.head != NULL) ? 1 : 0;
 
+				tr = traceStart();
 				unsigned long long t = rdtsc();
 				if (conve(currentDev, cnk, end, outBuf, &outLen)) {
 					log_error("Error stretching audio from dev %d",
 							currentDev->idx);
 					finish(-1);
 				}
-				log_debug("conversion time =%llu us\n",
-						((rdtsc() - t) / (CPMillis / 1000)));
+				t = rdtsc() - t;
+				histAddCycles(&currentDev->stats.conv, t);
+				traceEnd("conve", tr, "frames", outLen);
+				currentDev->stats.ratio = currentDev->srcData.src_ratio
+						/ outScale;
+				log_debug("conversion time =%llu us\n", t / (CPMillis / 1000));
 
 			}
 
-#ifdef MRSLOW
-			// Fuzzy "handbrake" just for stress testing...
-			unsigned long long zz = rdtsc();
-			unsigned long long diff = CPMillis* (abs(random()) % 85);
-			while(rdtsc()-zz < diff);
-#endif
+			// Stress testing: see worker_slow in fault.h
+			faultWorker();
+
+			// *** split stereo audio to dual mono, into the ring ***
+			if (outBuf) {
+				tr = traceStart();
+				ringAppend(currentDev, outBuf, outLen);
+				traceEnd("split", tr, "frames", outLen);
+			}
 
 			// Update the total frame count recorded by this device.
 			currentDev->outputFrameCount += outLen;
 
-			// *** split stereo audio to dual mono ***
-			splitStereo(outBuf, outLen, currentDev->invert, leftData,
-					rightData);
-
-			// *** write output to audio file ***
-			sf_writef_short(currentDev->outFile[0], leftData, outLen);
-			sf_writef_short(currentDev->outFile[1], rightData, outLen);
-
 			// *** release the audio chunk to its queue ***
 			cons_free(currentDev->dualQueue);
 
+			// *** write the new frames to the takes ***
+			tr = traceStart();
+			writeTakes(currentDev);
+			traceEnd("writeTakes", tr, "dev", i);
+
+			// *** and mix those all the devices have written to the proxies ***
+			MRTake *t;
+			for (t = takes; t; t = t->next)
+				feedProxy(t);
+
+			if (currentDev == masterDev)
+				fillSilence();
+
+			// *** and publish them to the tap ***
+			feedTap();
+
 		} // end for
 
+		retireTakes(0);
+		maybeCommitFiles();
+
 		// No more jobs pending.
-		// Check if we are stopping: if so, finalize and truncate the output files.
+		// Check if we are stopping: if so, hand all takes to the finalizer.
 		// Otherwise, sleep for 10millis
 		// then check again for new jobs.
-		if (finished) {
-			// TODO perform files truncation...
+		if (finished && !consumed) {
+			retireTakes(1);
 			break;
-		} else {
+		} else if (!consumed) {
 			usleep(500);
 		}
 
 	} // end while
+
+	return NULL;
+}
+
+
+/**
+ * Finalizer thread code: run the file jobs queued by the worker, until asked
+ * to exit.
+ */
+void *finalizer(void *arg) {
+	traceThread("finalizer");
+	pthread_mutex_lock(&finMutex);
+	while (1) {
+		while (!finQueue && !finExit)
+			pthread_cond_wait(&finCond, &finMutex);
+
+		FileJob *j = finQueue;
+		if (!j)
+			break;
+		finQueue = j->next;
+		pthread_mutex_unlock(&finMutex);
+
+		switch (j->type) {
+		case JOB_CLOSE_TAKE:
+			closeTake(j->take);
+			break;
+		case JOB_OPEN_SEGMENT:
+			if (openSegment(j->take, j->dev, j->segment) < 0) {
+				log_error("dev %d : error opening segment %d of take %s\n",
+						j->dev, j->segment, j->take->dir);
+				finish(-1);
+			}
+			break;
+		}
+		free(j);
+
+		pthread_mutex_lock(&finMutex);
+	}
+	pthread_mutex_unlock(&finMutex);
 	return NULL;
 }
 
 
+static void postTakeCommand(TakeCommand cmd, MRTake *t,
+		unsigned long long frame) {
+	// Commands are rare: just wait for the previous one to be picked up.
+	while (1) {
+		pthread_mutex_lock(&workerMutex);
+		if (takeCmd == TAKE_NONE) {
+			takeCmd = cmd;
+			takeCmdTake = t;
+			takeCmdFrame = frame;
+			pthread_mutex_unlock(&workerMutex);
+			return;
+		}
+		pthread_mutex_unlock(&workerMutex);
+		usleep(1000);
+	}
+}
+
+
+void beginTake(MRTake *t, unsigned long long frame) {
+	postTakeCommand(TAKE_BEGIN, t, frame);
+}
+
+
+void endTake(unsigned long long frame) {
+	postTakeCommand(TAKE_END, NULL, frame);
+}
+
+
+void switchTake(MRTake *t, unsigned long long frame) {
+	postTakeCommand(TAKE_SWITCH, t, frame);
+}
+
+
 /**
  * Allocate buffers needed for conversion & output, and create the "consumer" thread.
  */
 void initWorker() {
-	FILE* log = fopen("output.log", "w+");
-	initLogging(log, DEBUG);
+	outScale = (double) outRate / rate;
+	maxOutFrames = outScale > 1 ? ceil(MAXOUTFRMS * outScale) : MAXOUTFRMS;
+
+	// allocate the conversion output buffers
+	floatOut = (float*) malloc(sizeof(float) * maxOutFrames * MR_CHANNELS);
+	tmpOutBuf = (MRFrame*) malloc(sizeof(MRFrame) * maxOutFrames);
+
+	// allocate the mono output rings
+	ringSize = (unsigned long long) prerollMillis * outRate / 1000
+			+ 2 * maxOutFrames;
+	int i, chan;
+	for (i = 0; i < devCount; i++)
+		for (chan = 0; chan < MR_CHANNELS; chan++)
+			devices[i]->ring[chan] = (MR_SAMPLE*) malloc(
+					sizeof(MR_SAMPLE) * ringSize);
+
+	if (initDsp() < 0)
+		finish(-1);
+	initProxy();
+	if (initTap() < 0)
+		finish(-1);
+	lastCommitTS = rdtsc();
+
+	silenceFrames = (unsigned long long) silenceMillis * outRate / 1000;
+	silenceLevel = 32767 * pow(10, -(double) silenceDb / 20);
 
-	// allocate 2 mono output buffers
-	tmpOutBuf = (MRFrame*) malloc(sizeof(MRFrame) * MAXOUTFRMS);
+	initVolumes();
 
-	// allocate 2 mono output buffers
-	leftData = (MR_SAMPLE*) malloc(sizeof(MR_SAMPLE) * MAXOUTFRMS);
-	rightData = (MR_SAMPLE*) malloc(sizeof(MR_SAMPLE) * MAXOUTFRMS);
+	if (pthread_create(&fin, NULL, finalizer, NULL)) {
+		printf("error creating thread.");
+		finish(-1);
+	}
 
 #ifndef SHORT_CIRCUIT
 	if (pthread_create(&wrk, NULL, diskWorker, NULL)) {
@@ -256,4 +1199,18 @@ void waitPendingJobs() {
 	if (pthread_join(wrk, NULL)) {
 		printf("error joining thread.");
 	}
+
+	// Let the encoder and the volume writers finish what they were given.
+	stopProxy();
+	stopVolumes();
+	stopTap();
+
+	// All takes have been handed to the finalizer: wait for it to free them.
+	pthread_mutex_lock(&finMutex);
+	finExit = 1;
+	pthread_cond_signal(&finCond);
+	pthread_mutex_unlock(&finMutex);
+	if (pthread_join(fin, NULL)) {
+		printf("error joining thread.");
+	}
 }
@@ -40,7 +40,24 @@ void initWorker();
 
 
 /**
- * Wait for worker thread to consume all pending buckets.
+ * Take control, called from the main thread. "frame" is the position on the
+ * output timeline (i.e. master frames captured so far) when the request was
+ * made; the worker picks the actual sample-accurate boundary.
+ */
+
+/** Start writing to the specified take (pre-roll included). */
+void beginTake(MRTake *t, unsigned long long frame);
+
+/** End the current take. It will be finalized in background. */
+void endTake(unsigned long long frame);
+
+/** End the current take and start the specified one at the same frame. */
+void switchTake(MRTake *t, unsigned long long frame);
+
+
+/**
+ * Wait for worker thread to consume all pending buckets, and for all the
+ * takes to be finalized.
  */
 void waitPendingJobs();
 